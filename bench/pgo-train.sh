@@ -0,0 +1,112 @@
+#!/bin/bash
+#
+# The training workload for "make pgo", also used to compare builds.
+#
+#	bench/pgo-train.sh rds-stress [rds-stress...]
+#
+# Each binary runs a passive side on 127.0.0.2 and an active side on
+# 127.0.0.1, over RDS when the module is loaded and over the loopback
+# transport otherwise, and the userspace cycles per message of the active
+# side are printed, the best of $PGO_RUNS runs. The passive side is a
+# separate process, not --loopback's child, so that neither count below
+# includes it. perf counts the cycles when it is installed;
+# otherwise they are estimated from the user time and the clock rate.
+# The messages are small so that the tool's own overhead dominates.
+# After the first binary, the change relative to it is shown.
+#
+# PGO_ARGS, PGO_RUNS and PGO_TRANSPORT override the defaults.
+
+if [ $# -eq 0 ]; then
+	echo "usage: $0 rds-stress [rds-stress...]" >&2
+	exit 2
+fi
+
+if [ -z "$PGO_TRANSPORT" ]; then
+	if [ -d /proc/sys/net/rds ]; then
+		PGO_TRANSPORT=rds
+	else
+		PGO_TRANSPORT=loopback
+	fi
+fi
+args=${PGO_ARGS:-"-T 5 -t 2 -d 8 -q 256 -a 256"}
+runs=${PGO_RUNS:-3}
+mhz=$(awk -F: '/^cpu MHz/ { print $2 + 0; exit }' /proc/cpuinfo)
+perf=$(command -v perf)
+
+res=$(mktemp) || exit 1
+out=$(mktemp) || exit 1
+trap 'rm -f $res $out' EXIT
+
+# cycles per message for one run of $1
+one_run()
+{
+	local cycles msgs user peer active
+
+	"$1" --transport $PGO_TRANSPORT -r 127.0.0.2 > /dev/null 2>&1 &
+	peer=$!
+	active="$1 --transport $PGO_TRANSPORT -r 127.0.0.1 -s 127.0.0.2
+		--connect-retries 10 $args --result-file $res"
+
+	TIMEFORMAT=%U
+	if [ -n "$perf" ]; then
+		"$perf" stat -x, -e cycles:u -o $out -- $active \
+			> /dev/null 2>&1
+	else
+		{ time $active > /dev/null 2>&1 ; } 2> $out
+	fi
+	if [ $? -ne 0 ]; then
+		kill $peer 2> /dev/null
+		wait $peer
+		return 1
+	fi
+	wait $peer
+
+	if [ -n "$perf" ]; then
+		cycles=$(awk -F, '/cycles/ { print $1; exit }' $out)
+	else
+		user=$(tail -n 1 $out)
+		cycles=$(awk "BEGIN { print $user * $mhz * 1000000 }")
+	fi
+
+	msgs=$(awk '/^summary.tx_per_sec / { tx = $2 }
+		    /^summary.rx_per_sec / { rx = $2 }
+		    /^param.run_time / { t = $2 }
+		    END { print (tx + rx) * t }' $res)
+	awk "BEGIN { if ($msgs > 0) printf \"%.1f %.0f\n\", $cycles / $msgs, $msgs }"
+}
+
+if [ -n "$perf" ]; then
+	unit="cycles/msg"
+else
+	unit="cycles/msg (user time at $mhz MHz)"
+fi
+printf "%-28s %10s  %s\n" "binary" "messages" "$unit"
+
+ref=
+status=0
+for bin in "$@"; do
+	best=
+	for i in $(seq $runs); do
+		r=$(one_run "$bin") || { echo "$bin failed" >&2; status=1; continue 2; }
+		[ -z "$r" ] && continue
+		read cpm n <<< "$r"
+		if [ -z "$best" ] || awk "BEGIN { exit !($cpm < $best) }"; then
+			best=$cpm
+			msgs=$n
+		fi
+	done
+	if [ -z "$best" ]; then
+		echo "$bin passed no messages" >&2
+		status=1
+		continue
+	fi
+
+	if [ -z "$ref" ]; then
+		ref=$best
+		printf "%-28s %10s  %.1f\n" "$bin" "$msgs" "$best"
+	else
+		printf "%-28s %10s  %.1f (%+.1f%%)\n" "$bin" "$msgs" "$best" \
+			$(awk "BEGIN { print 100 * ($best - $ref) / $ref }")
+	fi
+done
+exit $status
@@ -0,0 +1,443 @@
+/*
+ * Microbenchmarks for the userspace hot path of rds-stress.
+ *
+ * rds-stress is a single file full of static functions, so we include
+ * it whole, with its main() renamed, and time the functions directly.
+ * No RDS is needed.
+ *
+ * Each benchmark is run a number of times; a run calls the function in
+ * a loop calibrated to take a couple of milliseconds. We report the
+ * median, minimum and relative standard deviation of the cost per call,
+ * loop included, in TSC cycles where available and nanoseconds
+ * otherwise. Results can be saved as a baseline and later runs compared
+ * against it. The comparison uses the minimum, which interruptions can
+ * only push up, so that noise on a busy machine isn't taken for a
+ * regression.
+ *
+ * Usage: rds-stress-bench [-r runs] [-s file] [-b file] [-t pct] [name...]
+ */
+#define main rds_stress_main
+#include "../rds-stress.c"
+#undef main
+
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_UNIT	"cycles"
+static inline uint64_t bench_clock(void)
+{
+	return __rdtsc();
+}
+#else
+#define BENCH_UNIT	"ns"
+static inline uint64_t bench_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+#define BENCH_BASELINE_MAGIC	"# rds-stress-bench baseline v2"
+#define BENCH_RUN_NSECS		2000000		/* per run, roughly */
+#define BENCH_MSG_SIZE		1024
+
+/* keep the compiler from dropping or hoisting the work */
+#define barrier()	asm volatile("" ::: "memory")
+
+struct bench {
+	const char	*name;
+	void		(*run)(unsigned long iters);
+	double		median, min, rsd;
+};
+
+/* Inputs shared by the benchmarks, set up once */
+static struct header	b_hdr;
+static unsigned char	b_msg[BENCH_MSG_SIZE];
+static uint64_t		b_rtt[256];
+static struct counter	b_ctr;
+static void		*b_rdma_buf;
+
+static void bench_setup(void)
+{
+	unsigned int i;
+
+	sol = SOL_RDS;
+	opt.req_size = BENCH_MSG_SIZE;
+	opt.ack_size = BENCH_MSG_SIZE;
+	opt.req_depth = 1;
+	opt.nr_tasks = 1;
+	init_msg_pattern(&opt);
+
+	memset(&b_hdr, 0, sizeof(b_hdr));
+	b_hdr.op = OP_REQ;
+	b_hdr.seq = 42;
+	b_hdr.from_addr = htonl(0x0a000001);
+	b_hdr.from_port = htons(4001);
+	b_hdr.to_addr = htonl(0x0a000002);
+	b_hdr.to_port = htons(4001);
+	b_hdr.index = 3;
+	b_hdr.rdma_op = RDMA_OP_READ;
+	b_hdr.rdma_addr = 0x7f0000001000ULL;
+	b_hdr.rdma_phyaddr = 0x1000;
+	b_hdr.rdma_key = 0x1234567800000001ULL;
+	b_hdr.rdma_size = 4096;
+	b_hdr.rdma_vector = 1;
+
+	/* a spread of round trip times, in usecs, over all buckets */
+	srandom(1);
+	for (i = 0; i < 256; i++)
+		b_rtt[i] = random() >> (random() % 31);
+
+	b_rdma_buf = malloc(4096);
+	if (!b_rdma_buf)
+		die("ERROR: failed to alloc memory\n");
+}
+
+static void run_empty(unsigned long iters)
+{
+	while (iters--)
+		barrier();
+}
+
+static void run_get_bucket(unsigned long iters)
+{
+	volatile int sink;
+
+	while (iters--)
+		sink = get_bucket(b_rtt[iters & 255]);
+	(void) sink;
+}
+
+static void run_encode_hdr(unsigned long iters)
+{
+	struct header out;
+
+	while (iters--) {
+		b_hdr.seq = iters;
+		encode_hdr(&out, &b_hdr);
+		barrier();
+	}
+}
+
+static void run_decode_hdr(unsigned long iters)
+{
+	struct header in, out;
+
+	encode_hdr(&in, &b_hdr);
+	while (iters--) {
+		decode_hdr(&out, &in);
+		barrier();
+	}
+}
+
+static void run_fill_hdr(unsigned long iters)
+{
+	opt.verify = 0;
+	while (iters--) {
+		fill_hdr(b_msg, BENCH_MSG_SIZE, &b_hdr);
+		barrier();
+	}
+}
+
+static void run_fill_hdr_verify(unsigned long iters)
+{
+	opt.verify = 1;
+	while (iters--) {
+		fill_hdr(b_msg, BENCH_MSG_SIZE, &b_hdr);
+		barrier();
+	}
+	opt.verify = 0;
+}
+
+static void run_check_hdr(unsigned long iters)
+{
+	volatile int sink;
+
+	opt.verify = 0;
+	fill_hdr(b_msg, BENCH_MSG_SIZE, &b_hdr);
+	while (iters--)
+		sink = check_hdr(b_msg, BENCH_MSG_SIZE, &b_hdr, &opt);
+	(void) sink;
+}
+
+static void run_check_hdr_verify(unsigned long iters)
+{
+	volatile int sink;
+
+	opt.verify = 1;
+	fill_hdr(b_msg, BENCH_MSG_SIZE, &b_hdr);
+	while (iters--)
+		sink = check_hdr(b_msg, BENCH_MSG_SIZE, &b_hdr, &opt);
+	(void) sink;
+	opt.verify = 0;
+}
+
+static void run_stat_inc(unsigned long iters)
+{
+	while (iters--) {
+		stat_inc(&b_ctr, b_rtt[iters & 255]);
+		barrier();
+	}
+}
+
+static void run_init_msg_pattern(unsigned long iters)
+{
+	while (iters--) {
+		free(msg_pattern);
+		init_msg_pattern(&opt);
+		barrier();
+	}
+}
+
+static void run_cmsg_xfer(unsigned long iters)
+{
+	struct msghdr msg;
+
+	while (iters--) {
+		memset(&msg, 0, sizeof(msg));
+		rdma_build_cmsg_xfer(&msg, &b_hdr, iters, b_rdma_buf);
+		barrier();
+	}
+}
+
+static void run_cmsg_async_send(unsigned long iters)
+{
+	struct msghdr msg;
+
+	while (iters--) {
+		memset(&msg, 0, sizeof(msg));
+		build_cmsg_async_send(&msg, iters);
+		barrier();
+	}
+}
+
+static void run_cmsg_dest(unsigned long iters)
+{
+	struct msghdr msg;
+
+	while (iters--) {
+		memset(&msg, 0, sizeof(msg));
+		rdma_build_cmsg_dest(&msg, b_hdr.rdma_key);
+		barrier();
+	}
+}
+
+static void run_cmsg_map(unsigned long iters)
+{
+	rds_rdma_cookie_t cookie;
+	struct msghdr msg;
+
+	while (iters--) {
+		memset(&msg, 0, sizeof(msg));
+		rdma_build_cmsg_map(&msg, b_hdr.rdma_addr, b_hdr.rdma_size,
+				    &cookie);
+		barrier();
+	}
+}
+
+static struct bench benches[] = {
+	{ "empty",		run_empty },
+	{ "get_bucket",		run_get_bucket },
+	{ "encode_hdr",		run_encode_hdr },
+	{ "decode_hdr",		run_decode_hdr },
+	{ "fill_hdr",		run_fill_hdr },
+	{ "fill_hdr/verify",	run_fill_hdr_verify },
+	{ "check_hdr",		run_check_hdr },
+	{ "check_hdr/verify",	run_check_hdr_verify },
+	{ "stat_inc",		run_stat_inc },
+	{ "init_msg_pattern",	run_init_msg_pattern },
+	{ "cmsg_xfer",		run_cmsg_xfer },
+	{ "cmsg_async_send",	run_cmsg_async_send },
+	{ "cmsg_dest",		run_cmsg_dest },
+	{ "cmsg_map",		run_cmsg_map },
+};
+#define NR_BENCHES	(sizeof(benches) / sizeof(benches[0]))
+
+static uint64_t now_nsecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void measure(struct bench *b, unsigned int runs)
+{
+	unsigned long iters = 64;
+	double per_call[runs], sum = 0, sum2 = 0, mean;
+	uint64_t start, stop;
+	unsigned int r;
+
+	/* Calibrate, which doubles as a warm-up */
+	while (1) {
+		start = now_nsecs();
+		b->run(iters);
+		if (now_nsecs() - start >= BENCH_RUN_NSECS)
+			break;
+		iters *= 2;
+	}
+
+	for (r = 0; r < runs; r++) {
+		start = bench_clock();
+		b->run(iters);
+		stop = bench_clock();
+		per_call[r] = (double) (stop - start) / iters;
+		sum += per_call[r];
+		sum2 += per_call[r] * per_call[r];
+	}
+
+	qsort(per_call, runs, sizeof(double), cmp_double);
+	mean = sum / runs;
+	b->median = per_call[runs / 2];
+	b->min = per_call[0];
+	b->rsd = mean > 0 ? sqrt(fmax(sum2 / runs - mean * mean, 0)) / mean * 100 : 0;
+}
+
+static void save_baseline(const char *path, unsigned int selected[])
+{
+	unsigned int i;
+	FILE *fp;
+
+	fp = fopen(path, "w");
+	if (!fp)
+		die_errno("unable to create %s", path);
+	fprintf(fp, "%s\nunit %s\n", BENCH_BASELINE_MAGIC, BENCH_UNIT);
+	for (i = 0; i < NR_BENCHES; i++)
+		if (selected[i])
+			fprintf(fp, "%s %.3f\n", benches[i].name,
+				benches[i].min);
+	if (fclose(fp))
+		die_errno("unable to write %s", path);
+	printf("wrote baseline to %s\n", path);
+}
+
+/* Returns the baseline minimum for each benchmark, or 0 if there is none */
+static void load_baseline(const char *path, double base[])
+{
+	char line[256], name[128], unit[16];
+	double val;
+	unsigned int i;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		die_errno("unable to open %s", path);
+	if (!fgets(line, sizeof(line), fp) ||
+	    strncmp(line, BENCH_BASELINE_MAGIC, strlen(BENCH_BASELINE_MAGIC)))
+		die("%s is not an rds-stress-bench baseline\n", path);
+	if (!fgets(line, sizeof(line), fp) ||
+	    sscanf(line, "unit %15s", unit) != 1 || strcmp(unit, BENCH_UNIT))
+		die("%s was measured in different units\n", path);
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%127s %lf", name, &val) != 2)
+			continue;
+		for (i = 0; i < NR_BENCHES; i++)
+			if (!strcmp(benches[i].name, name))
+				base[i] = val;
+	}
+	fclose(fp);
+}
+
+static void bench_usage(void)
+{
+	fprintf(stderr,
+	"Usage: rds-stress-bench [options] [name...]\n"
+	" -r [runs, 15]     runs per benchmark\n"
+	" -s [file]         save the results as a baseline\n"
+	" -b [file]         compare against a saved baseline\n"
+	" -t [pct, 5]       slowdown of the minimum flagged as a regression\n"
+	" -l                list the benchmarks\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int selected[NR_BENCHES], runs = 15, regressions = 0;
+	double base[NR_BENCHES], threshold = 5.0;
+	const char *save = NULL, *baseline = NULL;
+	unsigned int i;
+	int c, j;
+
+	while ((c = getopt(argc, argv, "b:lr:s:t:")) != -1) {
+		switch (c) {
+		case 'b':
+			baseline = optarg;
+			break;
+		case 'l':
+			for (i = 0; i < NR_BENCHES; i++)
+				printf("%s\n", benches[i].name);
+			return 0;
+		case 'r':
+			runs = parse_ull(optarg, 10000);
+			if (!runs)
+				bench_usage();
+			break;
+		case 's':
+			save = optarg;
+			break;
+		case 't':
+			threshold = strtod(optarg, NULL);
+			break;
+		default:
+			bench_usage();
+		}
+	}
+
+	/* Benchmarks whose name contains one of the arguments, or all */
+	for (i = 0; i < NR_BENCHES; i++) {
+		selected[i] = optind == argc;
+		for (j = optind; j < argc; j++)
+			if (strstr(benches[i].name, argv[j]))
+				selected[i] = 1;
+	}
+
+	memset(base, 0, sizeof(base));
+	if (baseline)
+		load_baseline(baseline, base);
+
+	bench_setup();
+
+	printf("%-18s %10s %10s %6s", "benchmark", BENCH_UNIT "/call", "min",
+	       "rsd%");
+	if (baseline)
+		printf(" %10s %8s", "baseline", "change");
+	printf("\n");
+
+	for (i = 0; i < NR_BENCHES; i++) {
+		struct bench *b = &benches[i];
+
+		if (!selected[i])
+			continue;
+		measure(b, runs);
+		printf("%-18s %10.2f %10.2f %6.1f", b->name, b->median, b->min,
+		       b->rsd);
+		if (baseline && base[i] > 0) {
+			double change = (b->min - base[i]) / base[i] * 100;
+			int regressed = change > threshold;
+
+			printf(" %10.2f %+7.1f%%%s", base[i], change,
+			       regressed ? "  REGRESSION" : "");
+			regressions += regressed;
+		}
+		printf("\n");
+	}
+
+	if (save)
+		save_baseline(save, selected);
+	if (baseline)
+		printf("%u regression%s over %.1f%%\n", regressions,
+		       regressions == 1 ? "" : "s", threshold);
+
+	return !!regressions;
+}
@@ -26,16 +26,17 @@
 #include <string.h>
 #include <stdlib.h>
 
-/* FIXME - this is a hack to getaround RDS not exporting any header files.
- * This is a local copy of the file found at net/rds/
+/*
+ * Socket setup, control messages and batching come from librds, which
+ * is built in the top level directory.  rds.h is a local copy of the
+ * kernel's net/rds header.
  */
-#include "rds.h"
-/* These are defined in rds.h....but that file is not happily included */
+#include "librds.h"
+
 #ifndef SOL_RDS
 #define SOL_RDS		276
 #endif /* SOL_RDS */
 
-
 #ifndef PF_RDS
 #define PF_RDS		21
 #endif /* PF_RDS */
@@ -43,6 +44,7 @@
 
 #define TESTPORT	4000
 #define BUFSIZE		94
+#define BATCH		16
 
 #define NUM_PRINTABLE_CHARS	94
 #define PRINTABLE_CHARS_OFFSET	33
@@ -77,7 +79,7 @@ static void print_orb(int i)
 	case 4:
 		buf = 'O';
 		break;
-	case 5:
+	default:
 		buf = 'o';
 		break;
 	}
@@ -94,326 +96,280 @@ static void create_message(char *buf, uint32_t start)
 		buf[i] = ((i + start) % NUM_PRINTABLE_CHARS) + PRINTABLE_CHARS_OFFSET;
 }
 
-static int do_rdma_read(int sock, struct msghdr *msg, struct rdss_message *buf,
-			uint32_t remote_flags)
+static void rdma_complete(void *arg, uint64_t token, int status)
 {
-	struct rds_rdma_args *args;
-	struct rds_iovec iov;
-	struct cmsghdr *cmsg;
-	int rc;
+	int *done = arg;
 
-	if (remote_flags & RDMA_WRITE_FLAG)
-		create_message(buf->msg, buf->count);
-
-	cmsg = CMSG_FIRSTHDR(msg);
-	args = (struct rds_rdma_args *)CMSG_DATA(cmsg);
+	if (status)
+		printf("RDMA %llu failed with status %d\n",
+		       (unsigned long long) token, status);
+	*done = 1;
+}
 
-	/* Do a sendmsg call to preform the RDMA */
-	cmsg->cmsg_level = SOL_RDS;
-	cmsg->cmsg_type = RDS_CMSG_RDMA_ARGS;
-	cmsg->cmsg_len = CMSG_LEN(sizeof(struct rds_rdma_args));
+/*
+ * The reply to an RDMA request is built from a template whose
+ * arguments are patched with the cookie the client sent.
+ */
+static int do_rdma(struct rds_sock *rs, struct rds_cmsg *tmpl,
+		   struct rds_rdma_args *args, struct sockaddr_in *din,
+		   struct rdss_message *buf, rds_rdma_cookie_t cookie)
+{
+	struct rds_msg wait;
+	struct msghdr msg;
+	struct iovec iov;
+	char ctlbuf[64];
+	int done = 0;
+	int rc;
 
-	iov.addr = (uint64_t) buf;
-	iov.bytes = sizeof(struct rdss_message);
+	if (buf->flags & RDMA_WRITE_FLAG)
+		create_message(buf->msg, buf->count);
 
-	args->remote_vec.addr = 0;
-	args->remote_vec.bytes = sizeof(struct rdss_message);
-	args->local_vec_addr = (uint64_t) &iov;
-	args->nr_local = 1;
-	args->flags = remote_flags ? (RDS_RDMA_READWRITE | RDS_RDMA_FENCE) : 0;
+	args->cookie = cookie;
+	args->flags = buf->flags ? (RDS_RDMA_READWRITE | RDS_RDMA_FENCE) : 0;
 	args->flags |= RDS_RDMA_NOTIFY_ME;
-	args->user_token = 0;
+	args->user_token = buf->count;
 
-	msg->msg_controllen = CMSG_SPACE(sizeof(struct rds_rdma_args));
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(struct rdss_message);
 
-	rc = sendmsg(sock, msg, 0);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = din;
+	msg.msg_namelen = sizeof(*din);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	rds_cmsg_attach(tmpl, &msg);
+
+	rc = sendmsg(rs->fd, &msg, 0);
 	if (rc < 0) {
 		printf("%s: Error sending message: %d %d\n", __func__, rc, errno);
 		return -1;
 	}
 
-	/* Spin waiting for the confirmation that the RDMA operation has completed */
-	do {
-		rc = recvmsg(sock, msg, MSG_DONTWAIT);
-	} while (rc < 0 && errno == EAGAIN);
+	/* Wait for the confirmation that the RDMA operation has completed */
+	rs->complete = rdma_complete;
+	rs->arg = &done;
+	while (!done) {
+		memset(&wait, 0, sizeof(wait));
+		wait.hdr.msg_control = ctlbuf;
+		wait.hdr.msg_controllen = sizeof(ctlbuf);
+		if (rds_recv_batch(rs, &wait, 1, 0) < 0) {
+			printf("%s: Error receiving message: %d\n", __func__, errno);
+			break;
+		}
+	}
+	rs->complete = NULL;
 
-	return 0;
+	return done ? 0 : -1;
 }
 
 static void server(char *address, uint32_t flags)
 {
-	struct sockaddr_in sin, din;
-	struct rdss_message *buf;
-	struct msghdr msg;
-	struct iovec *iov;
-	void *ctlbuf;
-	int rc, sock, count = 0;
-
-	buf = calloc(1, sizeof(struct rdss_message));
-	if (!buf) {
+	struct rdss_message *bufs, *buf;
+	struct sockaddr_in sin, din[BATCH];
+	struct rds_msg msgs[BATCH];
+	struct iovec iov[BATCH];
+	char ctlbuf[BATCH][64];
+	struct rds_rdma_args args, *rdma;
+	struct rds_cmsg tmpl;
+	struct rds_notify notify;
+	struct rds_iovec riov;
+	struct rds_sock rs;
+	int i, rc, count = 0;
+
+	bufs = calloc(BATCH, sizeof(struct rdss_message));
+	if (!bufs) {
 		printf("%s: calloc failed\n", __func__);
 		return;
 	}
 
-	sock = socket(PF_RDS, SOCK_SEQPACKET, 0);
-	if (sock < 0) {
-		printf("%s: Error creating Socket: %d\n", __func__, sock);
-		goto out;
-	}
-
 	memset(&sin, 0, sizeof(sin));
 	sin.sin_family = AF_INET;
 	sin.sin_addr.s_addr = inet_addr(address);
 	sin.sin_port = TESTPORT;
 
-	rc = bind(sock, (struct sockaddr *)&sin, sizeof(sin));
-	if (rc < 0) {
-		printf("%s: Error binding to address: %d %d\n", __func__, rc, errno);
-		goto out;
-	}
-
-	/* The recv iov could contain a regular RDS packet or an RDMA RDS
-	 * packet, so set it up for the worst case for both.
-	 */
-	iov = calloc(1, sizeof(struct iovec));
-	if (!iov) {
-		printf("%s: calloc failed\n", __func__);
+	if (rds_sock_open(&rs, PF_RDS, SOL_RDS, &sin, NULL)) {
+		printf("%s: Error setting up socket: %d\n", __func__, errno);
 		goto out;
 	}
 
-	ctlbuf = calloc(1, CMSG_SPACE(sizeof(struct rds_rdma_args)));
-	if (!ctlbuf) {
-		printf("%s: calloc failed\n", __func__);
-		goto out1;
-	}
+	memset(&args, 0, sizeof(args));
+	args.remote_vec.bytes = sizeof(struct rdss_message);
+	args.local_vec_addr = (uint64_t) &riov;
+	args.nr_local = 1;
+	riov.bytes = sizeof(struct rdss_message);
 
-	iov[0].iov_base = buf;
-	iov[0].iov_len = sizeof(struct rdss_message);
+	rds_cmsg_init(&tmpl, SOL_RDS);
+	rdma = rds_cmsg_rdma_args(&tmpl, &args);
 
-	memset(&msg, 0, sizeof(msg));
-	msg.msg_name = &din;
-	msg.msg_namelen = sizeof(din);
-	msg.msg_iov = iov;
-	msg.msg_iovlen = 1;
-	msg.msg_control = ctlbuf;
-	msg.msg_controllen = CMSG_SPACE(sizeof(struct rds_rdma_args));
+	memset(&notify, 0, sizeof(notify));
 
 	if (flags & VERBOSE_FLAG)
 		printf("server listening on %s\n", inet_ntoa(sin.sin_addr));
 
 	do {
-		rc = recvmsg(sock, &msg, 0);
-		if (rc < 0) {
-			printf("%s: Error receiving message: %d %d\n", __func__, rc, errno);
-			goto out2;
+		/* Each message could be a regular RDS packet or an RDMA request */
+		for (i = 0; i < BATCH; i++) {
+			iov[i].iov_base = &bufs[i];
+			iov[i].iov_len = sizeof(struct rdss_message);
+
+			memset(&msgs[i], 0, sizeof(msgs[i]));
+			msgs[i].hdr.msg_name = &din[i];
+			msgs[i].hdr.msg_namelen = sizeof(din[i]);
+			msgs[i].hdr.msg_iov = &iov[i];
+			msgs[i].hdr.msg_iovlen = 1;
+			msgs[i].hdr.msg_control = ctlbuf[i];
+			msgs[i].hdr.msg_controllen = sizeof(ctlbuf[i]);
 		}
 
-		if (flags & VERBOSE_FLAG)
-			printf("Received %s packet %d of len %d, cmsg len %d, on port %d\n",
-			       msg.msg_controllen ? "RDS RDMA" : "RDS",
-			       count,
-			       (uint32_t) iov[0].iov_len,
-			       (uint32_t) msg.msg_controllen,
-			       din.sin_port);
-
-		if (msg.msg_controllen) {
-			rc = do_rdma_read(sock, &msg, buf, buf->flags);
-			if (rc < 0)
-				goto out2;
+		rc = rds_recv_batch(&rs, msgs, BATCH, MSG_WAITFORONE);
+		if (rc < 0) {
+			printf("%s: Error receiving message: %d\n", __func__, errno);
+			break;
 		}
 
-		count++;
-
-		if (flags & VERBOSE_FLAG && !(buf->flags & RDMA_WRITE_FLAG))
-			printf("payload contains: %d  %s\n", buf->count, buf->msg);
-
-		if (!(flags & VERBOSE_FLAG))
-			print_orb(count);
-
-	} while (buf->count - 1);
-
-out2:
-	free(ctlbuf);
-out1:
-	free(iov);
-out:
-	free(buf);
-
-	printf("\n%d packets received\n", count);
-}
-
-static int build_rds_rdma_packet(int sock, struct msghdr *msg, void *buf,
-				 uint64_t *cookie, uint32_t *flags)
-{
-	struct rds_get_mr_args mr_args;
-	struct cmsghdr *cmsg;
-	void *ctlbuf;
-	struct iovec *iov;
-
-	mr_args.vec.addr = (uint64_t) buf;
-	mr_args.vec.bytes = sizeof(struct rdss_message);
-	mr_args.cookie_addr = (uint64_t) cookie;
-	mr_args.flags = RDS_RDMA_USE_ONCE;
-
-	ctlbuf = calloc(1, CMSG_SPACE(sizeof(mr_args)));
-	if (!ctlbuf) {
-		printf("%s: calloc failed\n", __func__);
-		return -1;
-	}
+		for (i = 0; i < rc; i++) {
+			buf = &bufs[i];
 
-	msg->msg_control = ctlbuf;
-	msg->msg_controllen = CMSG_SPACE(sizeof(mr_args));
-
-	cmsg = CMSG_FIRSTHDR(msg);
-	cmsg->cmsg_level = SOL_RDS;
-	cmsg->cmsg_type = RDS_CMSG_RDMA_MAP;
-	cmsg->cmsg_len = CMSG_LEN(sizeof(mr_args));
-	memcpy(CMSG_DATA(cmsg), &mr_args, sizeof(mr_args));
+			if (msgs[i].hdr.msg_flags & MSG_CTRUNC) {
+				printf("%s: Bad control data, message dropped\n",
+				       __func__);
+				continue;
+			}
 
-	iov = calloc(1, sizeof(struct iovec));
-	if (!iov) {
-		printf("%s: calloc failed\n", __func__);
-		return -1;
-	}
+			if (flags & VERBOSE_FLAG)
+				printf("Received %s packet %d of len %u, cmsg len %d, on port %d\n",
+				       msgs[i].hdr.msg_controllen ? "RDS RDMA" : "RDS",
+				       count, msgs[i].len,
+				       (uint32_t) msgs[i].hdr.msg_controllen,
+				       din[i].sin_port);
+
+			rds_recv_notify(SOL_RDS, &msgs[i].hdr, &notify);
+			if (notify.rdma_dest) {
+				riov.addr = (uint64_t) buf;
+				if (do_rdma(&rs, &tmpl, rdma, &din[i], buf,
+					    notify.rdma_dest) < 0)
+					goto out_close;
+			}
 
-	msg->msg_iov = iov;
-	msg->msg_iovlen = 1;
+			count++;
 
-	iov[0].iov_base = buf;
-	iov[0].iov_len = sizeof(struct rdss_message);
+			if (flags & VERBOSE_FLAG && !(buf->flags & RDMA_WRITE_FLAG))
+				printf("payload contains: %d  %s\n", buf->count, buf->msg);
 
-	return 0;
-}
+			if (!(flags & VERBOSE_FLAG))
+				print_orb(count);
 
-static int build_rds_packet(struct msghdr *msg, void *buf)
-{
-	struct iovec *iov;
-
-	iov = calloc(1, sizeof(struct iovec));
-	if (!iov) {
-		printf("%s: calloc failed\n", __func__);
-		return -1;
-	}
-
-	msg->msg_iov = iov;
-	msg->msg_iovlen = 1;
+			if (buf->count == 1)
+				break;
+		}
+	} while (i == rc);
 
-	iov[0].iov_base = buf;
-	iov[0].iov_len = sizeof(struct rdss_message);
+out_close:
+	rds_sock_close(&rs);
+out:
+	free(bufs);
 
-	return 0;
+	printf("\n%d packets received\n", count);
 }
 
 static void client(char *localaddr, char *remoteaddr, uint32_t flags, int count)
 {
+	struct rdss_message mess[BATCH];
 	struct sockaddr_in sin, din;
-	int rc, sock, num_mess;
-	void *buf;
-
-	buf = calloc(BUFSIZE, sizeof(char));
-	if (!buf) {
-		printf("%s: calloc failed\n", __func__);
-		return;
-	}
-
-	sock = socket(PF_RDS, SOCK_SEQPACKET, 0);
-	if (sock < 0) {
-		printf("%s: Error creating Socket: %d\n", __func__, sock);
-		goto out;
-	}
+	struct rds_msg msgs[BATCH];
+	struct iovec iov[BATCH];
+	rds_rdma_cookie_t cookie;
+	struct rds_cmsg tmpl;
+	struct rds_sock rs;
+	int i, nr, rc, rdma, num_mess = count;
+	char buf[BUFSIZE];
 
 	memset(&sin, 0, sizeof(sin));
 	sin.sin_family = AF_INET;
 	sin.sin_addr.s_addr = inet_addr(localaddr);
 
-	rc = bind(sock, (struct sockaddr *)&sin, sizeof(sin));
-	if (rc < 0) {
-		printf("%s: Error binding to address: %d %d\n", __func__, rc, errno);
-		goto out;
+	if (rds_sock_open(&rs, PF_RDS, SOL_RDS, &sin, NULL)) {
+		printf("%s: Error setting up socket: %d\n", __func__, errno);
+		return;
 	}
 
-	for (num_mess = count; num_mess || count == -1; num_mess--) {
-		struct rdss_message mess;
-		uint64_t cookie = 0;
-		struct msghdr msg;
-
-		/* For an RDMA_WRITE, it is not necessary to write anything to the buf.  As
-		 * this is going to be over-written when the server performs a RDMA_WRITE into
-		 * this buffer
-		 */
-		if (!(flags & RDMA_WRITE_FLAG))
-			create_message((char *)buf, (uint32_t) num_mess);
+	memset(&din, 0, sizeof(din));
+	din.sin_family = AF_INET;
+	din.sin_addr.s_addr = inet_addr(remoteaddr);
+	din.sin_port = TESTPORT;
 
-		memset(&msg, 0, sizeof(msg));
-		msg.msg_name = &din;
-		msg.msg_namelen = sizeof(din);
+	/*
+	 * An RDMA request maps the message for the server, one at a time;
+	 * the mapping never changes, so it is built once.
+	 */
+	rdma = flags & (RDMA_READ_FLAG | RDMA_WRITE_FLAG);
+	rds_cmsg_init(&tmpl, SOL_RDS);
+	if (rdma)
+		rds_cmsg_rdma_map(&tmpl, (uint64_t) &mess[0],
+				  sizeof(struct rdss_message), &cookie,
+				  RDS_RDMA_USE_ONCE);
+
+	while (num_mess || count == -1) {
+		nr = rdma ? 1 : BATCH;
+		if (count != -1 && nr > num_mess)
+			nr = num_mess;
+
+		for (i = 0; i < nr; i++) {
+			/* For an RDMA_WRITE, it is not necessary to write anything to
+			 * the buf.  As this is going to be over-written when the server
+			 * performs a RDMA_WRITE into this buffer
+			 */
+			if (!(flags & RDMA_WRITE_FLAG))
+				create_message(buf, (uint32_t) (num_mess - i));
 
-		memset(&din, 0, sizeof(din));
-		din.sin_family = AF_INET;
-		din.sin_addr.s_addr = inet_addr(remoteaddr);
-		din.sin_port = TESTPORT;
+			mess[i].count = num_mess - i;
+			mess[i].flags = flags;
+			memcpy(&mess[i].msg, buf, sizeof(mess[i].msg));
 
-		mess.count = num_mess;
-		mess.flags = flags;
-		memcpy(&mess.msg, buf, sizeof(mess.msg));
+			iov[i].iov_base = &mess[i];
+			iov[i].iov_len = sizeof(struct rdss_message);
 
-		if (flags & RDMA_READ_FLAG || flags & RDMA_WRITE_FLAG) {
-			rc = build_rds_rdma_packet(sock, &msg, &mess, &cookie, &flags);
-			if (rc < 0)
-				goto out;
+			memset(&msgs[i], 0, sizeof(msgs[i]));
+			msgs[i].hdr.msg_name = &din;
+			msgs[i].hdr.msg_namelen = sizeof(din);
+			msgs[i].hdr.msg_iov = &iov[i];
+			msgs[i].hdr.msg_iovlen = 1;
+			rds_cmsg_attach(&tmpl, &msgs[i].hdr);
 
-			if (flags & VERBOSE_FLAG)
+			if (flags & VERBOSE_FLAG && rdma)
 				printf("Client Sending RDMA message %d from %s to %s\n",
-					count - num_mess, localaddr, remoteaddr);
-		} else {
-			rc = build_rds_packet(&msg, &mess);
-			if (rc < 0)
-				goto out;
-
-			if (flags & VERBOSE_FLAG)
+				       count - num_mess, localaddr, remoteaddr);
+			else if (flags & VERBOSE_FLAG)
 				printf("client sending %d byte message %s from %s to %s\n",
-				       (uint32_t) msg.msg_iov->iov_len,
-				       (char *)buf,
-				       localaddr,
-				       remoteaddr);
+				       (uint32_t) iov[i].iov_len, buf,
+				       localaddr, remoteaddr);
 		}
 
-		rc = sendmsg(sock, &msg, 0);
-		if (rc < 0) {
-			printf("%s: Error sending message: %d %d\n", __func__, rc, errno);
-			goto out1;
+		rc = rds_send_batch(&rs, msgs, nr, 0);
+		if (rc <= 0) {
+			printf("%s: Error sending message: %d\n", __func__, errno);
+			break;
 		}
 
-		if (flags & RDMA_READ_FLAG || flags & RDMA_WRITE_FLAG) {
-			/* reuse the same msg, as it should no longer be necessary and this incoming
-			 * msg should be empty
-			 */
-			rc = recvmsg(sock, &msg, 0);
-			if (rc < 0) {
-				printf("%s: Error receiving message: %d %d\n", __func__, rc, errno);
-			}
+		if (rdma) {
+			/* The server tells us when it is done with the buffer */
+			msgs[0].hdr.msg_control = NULL;
+			msgs[0].hdr.msg_controllen = 0;
+			if (rds_recv_batch(&rs, msgs, 1, 0) < 0)
+				printf("%s: Error receiving message: %d\n", __func__, errno);
+			if (flags & VERBOSE_FLAG && flags & RDMA_WRITE_FLAG)
+				printf("payload contains: %d  %s\n", mess[0].count, mess[0].msg);
 		}
 
-		if (flags & VERBOSE_FLAG && flags & RDMA_WRITE_FLAG)
-			printf("payload contains: %d  %s\n", mess.count, mess.msg);
-
-out1:
-		if (msg.msg_control)
-			free(msg.msg_control);
-		if (msg.msg_iov)
-			free(msg.msg_iov);
-		if (rc < 0)
-			break;
-
-		if (!(flags & VERBOSE_FLAG))
-			print_orb(count - num_mess);
+		for (i = 0; i < rc; i++, num_mess--) {
+			if (!(flags & VERBOSE_FLAG))
+				print_orb(count - num_mess);
+		}
 	}
 
 	printf("\n%d messages sent\n", count - num_mess);
-out:
-	free(buf);
+	rds_sock_close(&rs);
 }
-
 int main(int argc, char **argv)
 {
 	char *serveraddr = NULL, *clientaddr = NULL;
@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2026 Oracle.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * librds.h - RDS socket helpers shared by the tools
+ *
+ * struct rds_sock wraps a bound RDS socket along with what the tools
+ * used to track by hand: whether congestion monitoring took, which
+ * destination ports are congested, a handler for send and RDMA
+ * completions, and a cache of registered memory regions.
+ *
+ * Control messages are built in a struct rds_cmsg. The builders return
+ * a pointer to their arguments inside the buffer, so a template can be
+ * built once and only the fields that change (usually the user token)
+ * patched before each send.
+ *
+ * Functions return 0 (or a count) on success and -1 with errno set on
+ * failure, like the system calls they wrap.
+ */
+
+#ifndef __RDS_LIB_H
+#define __RDS_LIB_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "rds.h"
+
+/* Settings for rds_sock_open(); zero leaves the kernel default */
+struct rds_sock_conf {
+	int		sndbuf;		/* bytes, raised to at least this */
+	int		rcvbuf;
+	uint8_t		tos;
+	unsigned int	mr_cache;	/* MR cache entries, or RDS_MR_CACHE_SIZE */
+	unsigned int	cong_monitor:1,
+			nonblock:1,
+			reuseaddr:1;
+};
+
+#define RDS_MR_CACHE_SIZE	32
+
+struct rds_mr {
+	uint64_t		addr;
+	uint64_t		len;
+	uint64_t		flags;
+	rds_rdma_cookie_t	cookie;
+	unsigned int		refs;	/* handed out and not yet put */
+};
+
+/* Called for each RDS_CMSG_RDMA_SEND_STATUS received */
+typedef void (*rds_complete_fn)(void *arg, uint64_t token, int status);
+
+struct rds_sock {
+	int		fd;
+	int		sol;
+	int		sndbuf;		/* as reported by the kernel */
+	int		rcvbuf;
+	int		cong_monitor;	/* 0 if the kernel refused it */
+	uint64_t	cong_mask;	/* RDS_CONG_MONITOR_MASK of congested ports */
+	rds_complete_fn	complete;
+	void		*arg;		/* passed to complete */
+	struct rds_mr	*mrs;		/* allocated on first use */
+	unsigned int	mr_cache;	/* room in mrs */
+	unsigned int	nr_mrs;
+	unsigned int	mr_victim;	/* where to look for one to evict */
+};
+
+/*
+ * Create an RDS socket of family pf, bind it to sin and apply conf,
+ * which may be NULL. A kernel without congestion monitoring is not an
+ * error; rs->cong_monitor says whether it is on.
+ */
+extern int rds_sock_open(struct rds_sock *rs, int pf, int sol,
+			 const struct sockaddr_in *sin,
+			 const struct rds_sock_conf *conf);
+/* Free the cached MRs and close the socket */
+extern void rds_sock_close(struct rds_sock *rs);
+
+/*
+ * Find the local address the routing table would use to reach dst, for
+ * binding when the user didn't name one.
+ */
+extern int rds_route_source(struct in_addr *src, const struct in_addr *dst);
+
+static inline int rds_sock_congested(const struct rds_sock *rs,
+				     const struct sockaddr_in *dst)
+{
+	return !!(rs->cong_mask & RDS_CONG_MONITOR_MASK(ntohs(dst->sin_port)));
+}
+
+/*
+ * Memory registration. rds_get_mr() and rds_free_mr() are the bare
+ * RDS_GET_MR and RDS_FREE_MR.
+ *
+ * rds_mr_get() hands out the cached cookie when the same region was
+ * registered before with the same flags, and rds_mr_put() gives it back;
+ * cached regions stay registered until they are evicted, which only
+ * happens to regions nobody holds, or the socket is closed. When every
+ * entry is held the region is registered outside the cache and
+ * rds_mr_put() frees it. RDS_RDMA_USE_ONCE regions are consumed by their
+ * first use, so they are never cached and must not be put.
+ */
+extern int rds_get_mr(int fd, int sol, uint64_t addr, uint64_t len,
+		      uint64_t flags, rds_rdma_cookie_t *cookie);
+extern int rds_free_mr(int fd, int sol, rds_rdma_cookie_t cookie,
+		       uint64_t flags);
+extern int rds_mr_get(struct rds_sock *rs, uint64_t addr, uint64_t len,
+		      uint64_t flags, rds_rdma_cookie_t *cookie);
+extern int rds_mr_put(struct rds_sock *rs, rds_rdma_cookie_t cookie);
+
+/*
+ * Room for an RDMA or atomic operation plus a destination or mapping
+ * and an async send request, which is the most any send carries.
+ */
+#define RDS_CMSG_BUF_SIZE	256
+
+struct rds_cmsg {
+	int		sol;
+	size_t		len;
+	union {
+		struct cmsghdr	align;
+		char		buf[RDS_CMSG_BUF_SIZE];
+	} u;
+};
+
+static inline void rds_cmsg_init(struct rds_cmsg *c, int sol)
+{
+	c->sol = sol;
+	c->len = 0;
+}
+
+/* Point msg at the control messages built so far */
+static inline void rds_cmsg_attach(struct rds_cmsg *c, struct msghdr *msg)
+{
+	msg->msg_control = c->len ? c->u.buf : NULL;
+	msg->msg_controllen = c->len;
+}
+
+/*
+ * Append a control message and return its data, or NULL with errno set
+ * to EMSGSIZE when it doesn't fit.
+ */
+extern void *rds_cmsg_put(struct rds_cmsg *c, int type, const void *data,
+			  size_t size);
+extern struct rds_asend_args *rds_cmsg_async_send(struct rds_cmsg *c,
+						  uint64_t token);
+extern struct rds_rdma_args *rds_cmsg_rdma_args(struct rds_cmsg *c,
+					const struct rds_rdma_args *args);
+extern rds_rdma_cookie_t *rds_cmsg_rdma_dest(struct rds_cmsg *c,
+					     rds_rdma_cookie_t cookie);
+extern struct rds_get_mr_args *rds_cmsg_rdma_map(struct rds_cmsg *c,
+						 uint64_t addr, uint64_t len,
+						 rds_rdma_cookie_t *cookie,
+						 uint64_t flags);
+
+/* What the control messages of a received message carried */
+struct rds_notify {
+	uint64_t		cong_update;	/* ports no longer congested */
+	rds_rdma_cookie_t	rdma_dest;	/* 0 if none */
+	unsigned int		nr_status;
+	rds_complete_fn		complete;
+	void			*arg;
+};
+
+/*
+ * Walk the control messages of a received message, calling n->complete
+ * for each completion. n is cleared first except for complete and arg.
+ * Returns -1 with errno set to EPROTO if one is truncated.
+ */
+extern int rds_recv_notify(int sol, struct msghdr *msg, struct rds_notify *n);
+
+/*
+ * Batched I/O. struct rds_msg has the layout of struct mmsghdr, so that
+ * callers don't need _GNU_SOURCE; len is the number of bytes sent or
+ * received.
+ *
+ * rds_send_batch() returns the number of messages queued, stopping at
+ * the first failure, or -1 if the first one failed. The failure behind a
+ * short count is reported when the rest are sent again. With congestion
+ * monitoring on, a send that fails with ENOBUFS marks its destination
+ * port congested until the kernel says otherwise.
+ *
+ * rds_recv_batch() takes MSG_WAITFORONE to block only for the first
+ * message. It returns the number of messages received, having
+ * handled their control messages as rds_recv_notify() does: congestion
+ * updates clear ports in rs->cong_mask and completions go to
+ * rs->complete. Messages that only carried notifications have len 0.
+ * An RDMA destination is left in the control data for the caller. A
+ * message whose control data could not be parsed gets MSG_CTRUNC in its
+ * msg_flags; the notifications before the bad one were still handled.
+ * msg_controllen must be reset before the buffers are reused.
+ */
+struct rds_msg {
+	struct msghdr	hdr;
+	unsigned int	len;
+};
+
+extern int rds_send_batch(struct rds_sock *rs, struct rds_msg *msgs,
+			  unsigned int nr, int flags);
+extern int rds_recv_batch(struct rds_sock *rs, struct rds_msg *msgs,
+			  unsigned int nr, int flags);
+
+#endif  /* __RDS_LIB_H */
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2026 Oracle.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * rdsinfo.h - read the RDS_INFO_* sources
+ *
+ * Each source is read into a struct rds_info_buf, which keeps its buffer
+ * between calls so that polling only reallocates when the kernel needs
+ * more room than it did last time.  Records are copied out with
+ * rds_info_record(), which copes with kernels whose records are smaller
+ * or larger than the structures in rds.h.
+ */
+
+#ifndef __RDS_INFO_H
+#define __RDS_INFO_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "rds.h"
+
+struct rds_info_buf {
+	int		opt;		/* RDS_INFO_* */
+	void		*data;
+	socklen_t	len;		/* bytes of records in data */
+	socklen_t	size;		/* bytes allocated */
+	int		each;		/* record size used by the kernel */
+};
+
+#define RDS_INFO_BUF_INIT(opt_val)	{ .opt = (opt_val) }
+
+/*
+ * Read a snapshot of the source. Returns 0, or -1 with errno set, in
+ * which case the previous contents are left alone.
+ */
+extern int rds_info_get(int fd, int sol, struct rds_info_buf *buf);
+extern void rds_info_free(struct rds_info_buf *buf);
+extern void rds_info_swap(struct rds_info_buf *a, struct rds_info_buf *b);
+
+static inline unsigned int rds_info_count(const struct rds_info_buf *buf)
+{
+	return buf->each ? buf->len / buf->each : 0;
+}
+
+static inline const void *rds_info_raw(const struct rds_info_buf *buf,
+				       unsigned int i)
+{
+	return (const char *)buf->data + i * buf->each;
+}
+
+/*
+ * Copy record i into rec, zero filling what an older kernel doesn't
+ * provide and dropping what a newer one added. Returns 0 past the end.
+ */
+static inline int rds_info_record(const struct rds_info_buf *buf,
+				  unsigned int i, void *rec, size_t size)
+{
+	if (i >= rds_info_count(buf))
+		return 0;
+	memset(rec, 0, size);
+	memcpy(rec, rds_info_raw(buf, i),
+	       (size_t)buf->each < size ? (size_t)buf->each : size);
+	return 1;
+}
+
+#define rds_info_for_each(var, buf, i) \
+	for ((i) = 0; rds_info_record(buf, i, &(var), sizeof(var)); (i)++)
+
+/* Typed accessors, one per source */
+#define RDS_INFO_ACCESSOR(name, type)					\
+static inline int rds_info_##name(const struct rds_info_buf *buf,	\
+				  unsigned int i, type *rec)		\
+{									\
+	return rds_info_record(buf, i, rec, sizeof(*rec));		\
+}
+
+RDS_INFO_ACCESSOR(counter_at, struct rds_info_counter)
+RDS_INFO_ACCESSOR(socket_at, struct rds_info_socket)
+RDS_INFO_ACCESSOR(connection_at, struct rds_info_connection)
+RDS_INFO_ACCESSOR(message_at, struct rds_info_message)
+RDS_INFO_ACCESSOR(tcp_socket_at, struct rds_info_tcp_socket)
+RDS_INFO_ACCESSOR(rdma_connection_at, struct rds_info_rdma_connection)
+
+#undef RDS_INFO_ACCESSOR
+
+#endif  /* __RDS_INFO_H */
@@ -0,0 +1,471 @@
+/*
+ * Copyright (c) 2026 Oracle.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * librds.c - RDS socket helpers shared by the tools
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+
+#include "librds.h"
+
+#define ptr64(p)	((uint64_t)(unsigned long)(p))
+
+/* rds_send_batch() and rds_recv_batch() hand struct rds_msg to the kernel */
+typedef char rds_msg_matches_mmsghdr[
+	(sizeof(struct rds_msg) == sizeof(struct mmsghdr) &&
+	 offsetof(struct rds_msg, len) == offsetof(struct mmsghdr, msg_len))
+	? 1 : -1];
+
+/* Raise a socket buffer to at least bytes and report what it ended up as */
+static int raise_buf(int fd, int opt, int bytes, int *got)
+{
+	socklen_t optlen = sizeof(*got);
+
+	if (getsockopt(fd, SOL_SOCKET, opt, got, &optlen))
+		return -1;
+	/* the kernel doubles what it is given, and reports the doubled size */
+	if (bytes && *got / 2 < bytes) {
+		if (setsockopt(fd, SOL_SOCKET, opt, &bytes, sizeof(bytes)))
+			return -1;
+		optlen = sizeof(*got);
+		if (getsockopt(fd, SOL_SOCKET, opt, got, &optlen))
+			return -1;
+	}
+	return 0;
+}
+
+int rds_sock_open(struct rds_sock *rs, int pf, int sol,
+		  const struct sockaddr_in *sin,
+		  const struct rds_sock_conf *conf)
+{
+	static const struct rds_sock_conf defaults;
+	int saved;
+	int val;
+
+	if (!conf)
+		conf = &defaults;
+
+	memset(rs, 0, sizeof(*rs));
+	rs->sol = sol;
+	rs->mr_cache = conf->mr_cache ? conf->mr_cache : RDS_MR_CACHE_SIZE;
+	rs->fd = socket(pf, SOCK_SEQPACKET, 0);
+	if (rs->fd < 0)
+		return -1;
+
+	val = 1;
+	if (conf->reuseaddr &&
+	    setsockopt(rs->fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val)))
+		goto fail;
+
+	if (bind(rs->fd, (const struct sockaddr *) sin, sizeof(*sin)))
+		goto fail;
+
+	if (raise_buf(rs->fd, SO_SNDBUF, conf->sndbuf, &rs->sndbuf) ||
+	    raise_buf(rs->fd, SO_RCVBUF, conf->rcvbuf, &rs->rcvbuf))
+		goto fail;
+
+	if (conf->cong_monitor) {
+		val = 1;
+		if (setsockopt(rs->fd, sol, RDS_CONG_MONITOR, &val, sizeof(val)) == 0)
+			rs->cong_monitor = 1;
+		else if (errno != ENOPROTOOPT)
+			goto fail;
+	}
+
+	if (conf->nonblock &&
+	    fcntl(rs->fd, F_SETFL, fcntl(rs->fd, F_GETFL) | O_NONBLOCK))
+		goto fail;
+
+	if (conf->tos && ioctl(rs->fd, SIOCRDSSETTOS, &conf->tos))
+		goto fail;
+
+	return 0;
+
+fail:
+	saved = errno;
+	close(rs->fd);
+	rs->fd = -1;
+	errno = saved;
+	return -1;
+}
+
+static void mr_flush(struct rds_sock *rs)
+{
+	while (rs->nr_mrs)
+		rds_free_mr(rs->fd, rs->sol, rs->mrs[--rs->nr_mrs].cookie, 0);
+	free(rs->mrs);
+	rs->mrs = NULL;
+	rs->mr_victim = 0;
+}
+
+void rds_sock_close(struct rds_sock *rs)
+{
+	if (rs->fd < 0)
+		return;
+	mr_flush(rs);
+	close(rs->fd);
+	rs->fd = -1;
+}
+
+int rds_route_source(struct in_addr *src, const struct in_addr *dst)
+{
+	struct sockaddr_in sin;
+	socklen_t alen;
+	int saved;
+	int fd;
+
+	fd = socket(PF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return -1;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr = *dst;
+	sin.sin_port = htons(1);
+
+	alen = sizeof(sin);
+	if (connect(fd, (struct sockaddr *) &sin, sizeof(sin)) ||
+	    getsockname(fd, (struct sockaddr *) &sin, &alen)) {
+		saved = errno;
+		close(fd);
+		errno = saved;
+		return -1;
+	}
+
+	*src = sin.sin_addr;
+	close(fd);
+	return 0;
+}
+
+int rds_get_mr(int fd, int sol, uint64_t addr, uint64_t len, uint64_t flags,
+	       rds_rdma_cookie_t *cookie)
+{
+	struct rds_get_mr_args args;
+
+	args.vec.addr = addr;
+	args.vec.bytes = len;
+	args.cookie_addr = ptr64(cookie);
+	args.flags = flags;
+
+	return setsockopt(fd, sol, RDS_GET_MR, &args, sizeof(args));
+}
+
+int rds_free_mr(int fd, int sol, rds_rdma_cookie_t cookie, uint64_t flags)
+{
+	struct rds_free_mr_args args;
+
+	args.cookie = cookie;
+	args.flags = flags;
+
+	return setsockopt(fd, sol, RDS_FREE_MR, &args, sizeof(args));
+}
+
+/* Free an entry nobody holds to make room, or return 0 */
+static int mr_evict(struct rds_sock *rs)
+{
+	struct rds_mr *mr;
+	unsigned int i;
+
+	for (i = 0; i < rs->nr_mrs; i++) {
+		if (rs->mr_victim >= rs->nr_mrs)
+			rs->mr_victim = 0;
+		mr = &rs->mrs[rs->mr_victim++];
+		if (mr->refs)
+			continue;
+		rds_free_mr(rs->fd, rs->sol, mr->cookie, 0);
+		*mr = rs->mrs[--rs->nr_mrs];
+		return 1;
+	}
+	return 0;
+}
+
+int rds_mr_get(struct rds_sock *rs, uint64_t addr, uint64_t len,
+	       uint64_t flags, rds_rdma_cookie_t *cookie)
+{
+	struct rds_mr *mr;
+	unsigned int i;
+
+	if (flags & RDS_RDMA_USE_ONCE)
+		return rds_get_mr(rs->fd, rs->sol, addr, len, flags, cookie);
+
+	if (!rs->mrs) {
+		rs->mrs = calloc(rs->mr_cache, sizeof(*rs->mrs));
+		if (!rs->mrs)
+			return -1;
+	}
+
+	for (i = 0; i < rs->nr_mrs; i++) {
+		mr = &rs->mrs[i];
+		if (mr->addr == addr && mr->len == len && mr->flags == flags) {
+			mr->refs++;
+			*cookie = mr->cookie;
+			return 0;
+		}
+	}
+
+	if (rs->nr_mrs == rs->mr_cache && !mr_evict(rs))
+		return rds_get_mr(rs->fd, rs->sol, addr, len, flags, cookie);
+
+	mr = &rs->mrs[rs->nr_mrs];
+	if (rds_get_mr(rs->fd, rs->sol, addr, len, flags, &mr->cookie))
+		return -1;
+	mr->addr = addr;
+	mr->len = len;
+	mr->flags = flags;
+	mr->refs = 1;
+	rs->nr_mrs++;
+
+	*cookie = mr->cookie;
+	return 0;
+}
+
+int rds_mr_put(struct rds_sock *rs, rds_rdma_cookie_t cookie)
+{
+	unsigned int i;
+
+	for (i = 0; i < rs->nr_mrs; i++) {
+		if (rs->mrs[i].cookie != cookie)
+			continue;
+		if (!rs->mrs[i].refs) {
+			errno = EINVAL;
+			return -1;
+		}
+		rs->mrs[i].refs--;
+		return 0;
+	}
+
+	/* registered while the cache was full */
+	return rds_free_mr(rs->fd, rs->sol, cookie, 0);
+}
+
+void *rds_cmsg_put(struct rds_cmsg *c, int type, const void *data,
+		   size_t size)
+{
+	struct cmsghdr *cmsg;
+
+	if (c->len + CMSG_SPACE(size) > sizeof(c->u.buf)) {
+		errno = EMSGSIZE;
+		return NULL;
+	}
+
+	cmsg = (struct cmsghdr *)(c->u.buf + c->len);
+	cmsg->cmsg_level = c->sol;
+	cmsg->cmsg_type = type;
+	cmsg->cmsg_len = CMSG_LEN(size);
+	memcpy(CMSG_DATA(cmsg), data, size);
+	c->len += CMSG_SPACE(size);
+
+	return CMSG_DATA(cmsg);
+}
+
+struct rds_asend_args *rds_cmsg_async_send(struct rds_cmsg *c, uint64_t token)
+{
+	struct rds_asend_args args;
+
+	args.user_token = token;
+	args.flags = RDS_SEND_NOTIFY_ME;
+	return rds_cmsg_put(c, RDS_CMSG_ASYNC_SEND, &args, sizeof(args));
+}
+
+struct rds_rdma_args *rds_cmsg_rdma_args(struct rds_cmsg *c,
+					 const struct rds_rdma_args *args)
+{
+	return rds_cmsg_put(c, RDS_CMSG_RDMA_ARGS, args, sizeof(*args));
+}
+
+rds_rdma_cookie_t *rds_cmsg_rdma_dest(struct rds_cmsg *c,
+				      rds_rdma_cookie_t cookie)
+{
+	return rds_cmsg_put(c, RDS_CMSG_RDMA_DEST, &cookie, sizeof(cookie));
+}
+
+struct rds_get_mr_args *rds_cmsg_rdma_map(struct rds_cmsg *c,
+					  uint64_t addr, uint64_t len,
+					  rds_rdma_cookie_t *cookie,
+					  uint64_t flags)
+{
+	struct rds_get_mr_args args;
+
+	args.vec.addr = addr;
+	args.vec.bytes = len;
+	args.cookie_addr = ptr64(cookie);
+	args.flags = flags;
+	return rds_cmsg_put(c, RDS_CMSG_RDMA_MAP, &args, sizeof(args));
+}
+
+int rds_recv_notify(int sol, struct msghdr *msg, struct rds_notify *n)
+{
+	struct rds_rdma_send_notify notify;
+	struct cmsghdr *cmsg;
+	uint64_t mask;
+
+	n->cong_update = 0;
+	n->rdma_dest = 0;
+	n->nr_status = 0;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != sol)
+			continue;
+		switch (cmsg->cmsg_type) {
+		case RDS_CMSG_CONG_UPDATE:
+			if (cmsg->cmsg_len < CMSG_LEN(sizeof(mask)))
+				goto short_cmsg;
+			memcpy(&mask, CMSG_DATA(cmsg), sizeof(mask));
+			n->cong_update |= mask;
+			break;
+
+		case RDS_CMSG_RDMA_DEST:
+			if (cmsg->cmsg_len < CMSG_LEN(sizeof(n->rdma_dest)))
+				goto short_cmsg;
+			memcpy(&n->rdma_dest, CMSG_DATA(cmsg),
+			       sizeof(n->rdma_dest));
+			break;
+
+		case RDS_CMSG_RDMA_SEND_STATUS:
+			if (cmsg->cmsg_len < CMSG_LEN(sizeof(notify)))
+				goto short_cmsg;
+			memcpy(&notify, CMSG_DATA(cmsg), sizeof(notify));
+			n->nr_status++;
+			if (n->complete)
+				n->complete(n->arg, notify.user_token,
+					    notify.status);
+			break;
+		}
+	}
+	return 0;
+
+short_cmsg:
+	errno = EPROTO;
+	return -1;
+}
+
+/* For kernels or C libraries without the mmsg calls */
+static int send_each(int fd, struct mmsghdr *mm, unsigned int nr, int flags)
+{
+	unsigned int i;
+	ssize_t ret;
+
+	for (i = 0; i < nr; i++) {
+		ret = sendmsg(fd, &mm[i].msg_hdr, flags);
+		if (ret < 0)
+			return i ? (int) i : -1;
+		mm[i].msg_len = ret;
+	}
+	return i;
+}
+
+static int recv_each(int fd, struct mmsghdr *mm, unsigned int nr, int flags)
+{
+	unsigned int i;
+	ssize_t ret;
+
+	flags &= ~MSG_WAITFORONE;
+	for (i = 0; i < nr; i++) {
+		ret = recvmsg(fd, &mm[i].msg_hdr, i ? flags | MSG_DONTWAIT : flags);
+		if (ret < 0)
+			return i ? (int) i : -1;
+		mm[i].msg_len = ret;
+	}
+	return i;
+}
+
+static int no_mmsg;
+
+int rds_send_batch(struct rds_sock *rs, struct rds_msg *msgs,
+		   unsigned int nr, int flags)
+{
+	struct mmsghdr *mm = (struct mmsghdr *) msgs;
+	const struct sockaddr_in *dst;
+	int ret = -1;
+
+	if (!no_mmsg) {
+		ret = sendmmsg(rs->fd, mm, nr, flags);
+		if (ret < 0 && errno == ENOSYS)
+			no_mmsg = 1;
+	}
+	if (no_mmsg)
+		ret = send_each(rs->fd, mm, nr, flags);
+
+	/*
+	 * After a short count the error is reported by the next call,
+	 * which starts with the message that failed. Without congestion
+	 * monitoring no update would ever clear the port again.
+	 */
+	if (ret < 0 && errno == ENOBUFS && rs->cong_monitor) {
+		dst = mm[0].msg_hdr.msg_name;
+		if (dst)
+			rs->cong_mask |= RDS_CONG_MONITOR_MASK(ntohs(dst->sin_port));
+	}
+	return ret;
+}
+
+int rds_recv_batch(struct rds_sock *rs, struct rds_msg *msgs,
+		   unsigned int nr, int flags)
+{
+	struct mmsghdr *mm = (struct mmsghdr *) msgs;
+	struct rds_notify n;
+	int ret = -1;
+	int i;
+
+	if (!no_mmsg) {
+		ret = recvmmsg(rs->fd, mm, nr, flags, NULL);
+		if (ret < 0 && errno == ENOSYS)
+			no_mmsg = 1;
+	}
+	if (no_mmsg)
+		ret = recv_each(rs->fd, mm, nr, flags);
+
+	n.complete = rs->complete;
+	n.arg = rs->arg;
+	for (i = 0; i < ret; i++) {
+		if (!mm[i].msg_hdr.msg_controllen)
+			continue;
+		/* the messages are off the socket, so flag this one and go on */
+		if (rds_recv_notify(rs->sol, &mm[i].msg_hdr, &n))
+			mm[i].msg_hdr.msg_flags |= MSG_CTRUNC;
+		rs->cong_mask &= ~n.cong_update;
+	}
+	return ret;
+}
@@ -44,10 +44,19 @@
 #include <errno.h>
 #include <string.h>
 #include <inttypes.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
 
 #include "rds.h"
+#include "rdsinfo.h"
 #include "pfhack.h"
 
 /* WHUPS changed the struct rds_info_connection definition b/w rds in 1.4 & 1.5. gotta support both
@@ -59,229 +68,2522 @@
 #define min(a, b) (a < b ? a : b)
 #define array_size(foo) (sizeof(foo) / sizeof(foo[0]))
 
-#define copy_into(var, data, each) ({			\
-	int __ret = 1;					\
-	memset(&var, 0, sizeof(var));			\
-	memcpy(&var, data, min(each, sizeof(var)));	\
-	__ret;						\
-})
+#define verbosef(lvl, f, fmt, a...) do { \
+        if (opt_verbose >= (lvl)) \
+                fprintf((f), fmt, ##a); \
+} while (0)
+
+static int	opt_verbose = 0;
+static double	opt_interval = 0;
+
+char *progname = "rds-info";
+
+/* Like inet_ntoa, but can be re-entered several times without clobbering
+ * the previously returned string. */
+static const char *paddr(int af, const void *addrp)
+{
+	static char nbuf[8][INET6_ADDRSTRLEN];
+	static int which = 0;
+	char *string;
+
+	string = nbuf[which];
+	which = (which + 1) % 8;
+
+	inet_ntop(af, addrp, string, INET6_ADDRSTRLEN);
+	return string;
+}
+
+static const char *ipv4addr(uint32_t addr)
+{
+	return paddr(AF_INET, &addr);
+}
+
+static const char *ipv6addr(const void *addr)
+{
+	return paddr(AF_INET6, addr);
+}
+
+/*
+ * All sources are printed through a small table writer so that the same
+ * print function can produce the fixed-width text tables, JSON (one object
+ * per record and line) or CSV. Records are written out as they are
+ * decoded; nothing is accumulated in memory.
+ */
+enum {
+	FORMAT_TEXT = 0,
+	FORMAT_JSON,
+	FORMAT_CSV,
+};
+
+static int	opt_format = FORMAT_TEXT;
+
+#define COL_VERBOSE	0x01	/* text: only with -v, as name=value */
+#define COL_NOTEXT	0x02	/* not shown in text tables */
+
+struct column {
+	const char *name;	/* stable field name used by json and csv */
+	const char *title;	/* text table heading */
+	int width;
+	int flags;
+};
+
+static struct {
+	const char *source;
+	const struct column *cols;
+	int nr_cols;
+	int col;
+	int nr_text;
+	int nr_verbose;
+} table;
+
+/*
+ * CSV gets one header per source and run, so that watch mode output
+ * stays one table per source that a reader can split on the first
+ * column.
+ */
+static int csv_header_done(const char *source)
+{
+	static char **done;
+	static int nr_done;
+	char **grown;
+	int i;
+
+	for (i = 0; i < nr_done; i++) {
+		if (!strcmp(done[i], source))
+			return 1;
+	}
+	grown = realloc(done, (nr_done + 1) * sizeof(*done));
+	if (grown == NULL || (grown[nr_done] = strdup(source)) == NULL) {
+		verbosef(0, stderr, "%s: Unable to allocate memory\n",
+			 progname);
+		exit(1);
+	}
+	done = grown;
+	nr_done++;
+	return 0;
+}
+
+static void table_begin(const char *source, const char *caption,
+			const struct column *cols, int nr_cols)
+{
+	int i, n = 0;
+
+	table.source = source;
+	table.cols = cols;
+	table.nr_cols = nr_cols;
+	table.col = 0;
+	table.nr_text = 0;
+	table.nr_verbose = 0;
+
+	switch (opt_format) {
+	case FORMAT_TEXT:
+		printf("\n%s:\n", caption);
+		for (i = 0; i < nr_cols; i++) {
+			if (cols[i].flags & (COL_VERBOSE|COL_NOTEXT))
+				continue;
+			printf("%s%*s", n++ ? " " : "", cols[i].width,
+				cols[i].title);
+		}
+		printf("\n");
+		break;
+	case FORMAT_CSV:
+		if (csv_header_done(source))
+			break;
+		printf("source");
+		for (i = 0; i < nr_cols; i++)
+			printf(",%s", cols[i].name);
+		printf("\n");
+		break;
+	}
+}
+
+static void json_string(const char *str)
+{
+	const unsigned char *p;
+
+	putchar('"');
+	for (p = (const unsigned char *)str; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			printf("\\%c", *p);
+		else if (*p < 0x20)
+			printf("\\u%04x", *p);
+		else
+			putchar(*p);
+	}
+	putchar('"');
+}
+
+static void csv_string(const char *str)
+{
+	const char *p;
+
+	if (!strpbrk(str, ",\"\n")) {
+		fputs(str, stdout);
+		return;
+	}
+	putchar('"');
+	for (p = str; *p; p++) {
+		if (*p == '"')
+			putchar('"');
+		putchar(*p);
+	}
+	putchar('"');
+}
+
+static void table_field(const char *value, int quote)
+{
+	const struct column *c = &table.cols[table.col++];
+
+	switch (opt_format) {
+	case FORMAT_TEXT:
+		if (c->flags & COL_NOTEXT)
+			break;
+		if (c->flags & COL_VERBOSE) {
+			if (opt_verbose)
+				printf("%s%s=%s", table.nr_verbose++ ?
+					", " : "  ", c->name, value);
+			break;
+		}
+		printf("%s%*s", table.nr_text++ ? " " : "", c->width, value);
+		break;
+	case FORMAT_JSON:
+		if (table.col == 1) {
+			printf("{\"source\":");
+			json_string(table.source);
+		}
+		printf(",\"%s\":", c->name);
+		if (quote)
+			json_string(value);
+		else
+			fputs(value, stdout);
+		break;
+	case FORMAT_CSV:
+		if (table.col == 1)
+			printf("%s", table.source);
+		putchar(',');
+		csv_string(value);
+		break;
+	}
+}
+
+static void table_str(const char *value)
+{
+	table_field(value, 1);
+}
+
+static void table_fmt(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+
+/* A numeric field; printed without quotes in json */
+static void table_fmt(const char *fmt, ...)
+{
+	char buf[64];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	table_field(buf, 0);
+}
+
+static void table_u64(uint64_t value)
+{
+	table_fmt("%"PRIu64, value);
+}
+
+/* A signed change; text tables show the sign explicitly */
+static void table_s64(int64_t value)
+{
+	table_fmt(opt_format == FORMAT_TEXT ? "%+"PRId64 : "%"PRId64, value);
+}
+
+static void table_end_row(void)
+{
+	if (opt_format == FORMAT_JSON)
+		putchar('}');
+	putchar('\n');
+	table.col = 0;
+	table.nr_text = 0;
+	table.nr_verbose = 0;
+}
+
+/* Build a source name, e.g. "Send" becomes "send_messages" */
+static const char *source_name(const char *prefix, const char *suffix)
+{
+	static char source[32];
+	int i;
+
+	for (i = 0; prefix[i] && i < 16; i++)
+		source[i] = tolower(prefix[i]);
+	snprintf(source + i, sizeof(source) - i, "%s", suffix);
+	return source;
+}
+
+/*
+ * Record filters, given as a comma separated list of terms with -F:
+ *
+ *	laddr=ADDR[/BITS]  faddr=ADDR[/BITS]
+ *	lport=N[-M]  fport=N[-M]  port=N[-M] (either end)
+ *	tos=N  flags=[scCE]  max=N
+ *
+ * All terms must match. Terms which don't apply to a source, such as
+ * flags for the message queues, are ignored for it. Filters are evaluated
+ * while walking the snapshot so that non-matching records are never
+ * formatted, and the walk stops as soon as no further record can match.
+ */
+struct port_range {
+	int		given;
+	uint16_t	lo, hi;
+};
+
+static struct filter {
+	int		active;
+	uint32_t	laddr, laddr_mask;	/* network byte order */
+	uint32_t	faddr, faddr_mask;
+	struct port_range lport, fport, port;
+	int		tos;			/* -1 if not given */
+	int		flags;			/* required connection flags */
+	unsigned long	max;
+
+	/* per table */
+	unsigned long	matched;
+	int		stopped;
+} filter = { .tos = -1 };
+
+/* What makes a record unique within its source */
+enum {
+	FKEY_NONE,
+	FKEY_CONN,	/* laddr, faddr, tos */
+	FKEY_TCP,	/* laddr, lport, faddr, fport */
+};
+
+static int parse_filter_addr(const char *str, uint32_t *addr, uint32_t *mask)
+{
+	char buf[INET_ADDRSTRLEN + 4], *slash, *endptr;
+	unsigned long bits = 32;
+
+	snprintf(buf, sizeof(buf), "%s", str);
+	slash = strchr(buf, '/');
+	if (slash) {
+		*slash++ = '\0';
+		bits = strtoul(slash, &endptr, 10);
+		if (*endptr || !*slash || bits > 32)
+			return 0;
+	}
+	if (inet_pton(AF_INET, buf, addr) != 1)
+		return 0;
+	*mask = bits ? htonl(~0U << (32 - bits)) : 0;
+	*addr &= *mask;
+	return 1;
+}
+
+static int parse_port_range(const char *str, struct port_range *range)
+{
+	unsigned long lo, hi;
+	char *endptr;
+
+	lo = hi = strtoul(str, &endptr, 0);
+	if (*endptr == '-')
+		hi = strtoul(endptr + 1, &endptr, 0);
+	if (*endptr || !*str || lo > hi || hi > 65535)
+		return 0;
+	range->given = 1;
+	range->lo = lo;
+	range->hi = hi;
+	return 1;
+}
+
+static int parse_filter(const char *arg)
+{
+	char expr[256], *term, *value, *endptr;
+
+	if (strlen(arg) >= sizeof(expr))
+		return 0;
+	strcpy(expr, arg);
+
+	for (term = strtok(expr, ","); term; term = strtok(NULL, ",")) {
+		value = strchr(term, '=');
+		if (value == NULL)
+			return 0;
+		*value++ = '\0';
+
+		if (!strcmp(term, "laddr")) {
+			if (!parse_filter_addr(value, &filter.laddr,
+					       &filter.laddr_mask))
+				return 0;
+		} else if (!strcmp(term, "faddr")) {
+			if (!parse_filter_addr(value, &filter.faddr,
+					       &filter.faddr_mask))
+				return 0;
+		} else if (!strcmp(term, "lport")) {
+			if (!parse_port_range(value, &filter.lport))
+				return 0;
+		} else if (!strcmp(term, "fport")) {
+			if (!parse_port_range(value, &filter.fport))
+				return 0;
+		} else if (!strcmp(term, "port")) {
+			if (!parse_port_range(value, &filter.port))
+				return 0;
+		} else if (!strcmp(term, "tos")) {
+			filter.tos = strtoul(value, &endptr, 0);
+			if (*endptr || !*value || filter.tos > 255)
+				return 0;
+		} else if (!strcmp(term, "flags")) {
+			for (; *value; value++) {
+				switch (*value) {
+				case 's': filter.flags |= RDS_INFO_CONNECTION_FLAG_SENDING; break;
+				case 'c': filter.flags |= RDS_INFO_CONNECTION_FLAG_CONNECTING; break;
+				case 'C': filter.flags |= RDS_INFO_CONNECTION_FLAG_CONNECTED; break;
+				case 'E': filter.flags |= RDS_INFO_CONNECTION_FLAG_ERROR; break;
+				default: return 0;
+				}
+			}
+		} else if (!strcmp(term, "max")) {
+			filter.max = strtoul(value, &endptr, 0);
+			if (*endptr || !*value)
+				return 0;
+		} else
+			return 0;
+	}
+	filter.active = 1;
+	return 1;
+}
+
+static int in_range(const struct port_range *range, int port)
+{
+	return port < 0 || !range->given ||
+	       (port >= range->lo && port <= range->hi);
+}
+
+/*
+ * Check a record against the filter. Ports are in host byte order and
+ * -1, like tos and flags, when the source doesn't have them.
+ */
+static int filter_match(uint32_t laddr, uint32_t faddr, int lport, int fport,
+			int tos, int flags)
+{
+	if (!filter.active)
+		return 1;
+	if ((laddr & filter.laddr_mask) != filter.laddr ||
+	    (faddr & filter.faddr_mask) != filter.faddr)
+		return 0;
+	if (!in_range(&filter.lport, lport) || !in_range(&filter.fport, fport))
+		return 0;
+	if (filter.port.given && lport >= 0 &&
+	    !in_range(&filter.port, lport) && !in_range(&filter.port, fport))
+		return 0;
+	if (filter.tos >= 0 && tos >= 0 && tos != filter.tos)
+		return 0;
+	if (flags >= 0 && (flags & filter.flags) != filter.flags)
+		return 0;
+
+	filter.matched++;
+	return 1;
+}
+
+static int single_port(const struct port_range *range)
+{
+	return range->given && range->lo == range->hi;
+}
+
+/*
+ * Called after a match: can another record still match? Not if we have
+ * as many as were asked for, or if the filter names the record's key
+ * exactly.
+ */
+static int filter_done(int key)
+{
+	int exact = filter.laddr_mask == ~0U && filter.faddr_mask == ~0U;
+
+	if (filter.max && filter.matched >= filter.max)
+		filter.stopped = 1;
+	else if (key == FKEY_CONN && exact && filter.tos >= 0)
+		filter.stopped = 1;
+	else if (key == FKEY_TCP && exact && single_port(&filter.lport) &&
+		 single_port(&filter.fport))
+		filter.stopped = 1;
+	return filter.stopped;
+}
+
+static void filter_begin(void)
+{
+	filter.matched = 0;
+	filter.stopped = 0;
+}
+
+static void filter_report(const struct rds_info_buf *buf)
+{
+	if (!filter.active || opt_format != FORMAT_TEXT)
+		return;
+	printf("%lu of %u records matched%s\n", filter.matched,
+		rds_info_count(buf),
+		filter.stopped ? ", stopped early" : "");
+}
+
+static const struct column counter_cols[] = {
+	{ "name",		"CounterName",	25 },
+	{ "value",		"Value",	16 },
+};
+
+static void print_counters(const struct rds_info_buf *buf, void *extra)
+{
+	struct rds_info_counter ctr;
+	unsigned int i;
+
+	table_begin("counters", "Counters", counter_cols,
+		    array_size(counter_cols));
+
+	rds_info_for_each(ctr, buf, i) {
+		table_str((char *)ctr.name);
+		table_u64(ctr.value);
+		table_end_row();
+	}
+}
+
+static const struct column socket_cols[] = {
+	{ "bound_addr",		"BoundAddr",	15 },
+	{ "bound_port",		"BPort",	5 },
+	{ "connected_addr",	"ConnAddr",	15 },
+	{ "connected_port",	"CPort",	5 },
+	{ "sndbuf",		"SndBuf",	10 },
+	{ "rcvbuf",		"RcvBuf",	10 },
+	{ "inode",		"Inode",	8 },
+};
+
+static void print_sockets(const struct rds_info_buf *buf, void *extra)
+{
+	struct rds_info_socket sk;
+	unsigned int i;
+
+	table_begin("sockets", "RDS Sockets", socket_cols,
+		    array_size(socket_cols));
+	filter_begin();
+
+	rds_info_for_each(sk, buf, i) {
+		if (!filter_match(sk.bound_addr, sk.connected_addr,
+				  ntohs(sk.bound_port), ntohs(sk.connected_port),
+				  -1, -1))
+			continue;
+		table_str(ipv4addr(sk.bound_addr));
+		table_u64(ntohs(sk.bound_port));
+		table_str(ipv4addr(sk.connected_addr));
+		table_u64(ntohs(sk.connected_port));
+		table_u64(sk.sndbuf);
+		table_u64(sk.rcvbuf);
+		table_u64(sk.inum);
+		table_end_row();
+		if (filter_done(FKEY_NONE))
+			break;
+	}
+	filter_report(buf);
+}
+
+static const struct column conn_cols[] = {
+	{ "laddr",		"LocalAddr",	15 },
+	{ "faddr",		"RemoteAddr",	15 },
+	{ "tos",		"Tos",		4 },
+	{ "next_tx_seq",	"NextTX",	16 },
+	{ "next_rx_seq",	"NextRX",	16 },
+	{ "flags",		"Flgs",		4 },
+};
+
+static void print_conns(const struct rds_info_buf *buf, void *extra)
+{
+	struct rds_info_connection conn;
+	char flags[5];
+	unsigned int i;
+
+	table_begin("connections", "RDS Connections", conn_cols,
+		    array_size(conn_cols));
+	filter_begin();
+	
+	rds_info_for_each(conn, buf, i) {
+		if (!filter_match(conn.laddr, conn.faddr, -1, -1, conn.tos,
+				  conn.flags | conn.transport[15]))
+			continue;
+		table_str(ipv4addr(conn.laddr));
+		table_str(ipv4addr(conn.faddr));
+		table_u64(conn.tos);
+		table_u64(conn.next_tx_seq);
+		table_u64(conn.next_rx_seq);
+		snprintf(flags, sizeof(flags), "%c%c%c%c",
+			rds_conn_flag(conn, SENDING, 's'),
+			rds_conn_flag(conn, CONNECTING, 'c'),
+			rds_conn_flag(conn, CONNECTED, 'C'),
+			rds_conn_flag(conn, ERROR, 'E'));
+		table_str(flags);
+		table_end_row();
+		if (filter_done(FKEY_CONN))
+			break;
+	}
+	filter_report(buf);
+}
+
+/*
+ * No kernel defines a record layout for RDS_INFO_CONNECTION_STATS, so
+ * its records are shown as they come, in hex.
+ */
+static const struct column raw_cols[] = {
+	{ "index",		"Index",	6 },
+	{ "record",		"Record",	0 },
+};
+
+static void print_conn_stats(const struct rds_info_buf *buf, void *extra)
+{
+	const unsigned char *rec;
+	char *hex;
+	unsigned int i, j;
+
+	hex = malloc(2 * buf->each + 1);
+	if (hex == NULL) {
+		verbosef(0, stderr, "%s: Unable to allocate memory "
+			 "for records\n", progname);
+		exit(1);
+	}
+
+	table_begin("connection_stats", "RDS Connection Statistics (raw)",
+		    raw_cols, array_size(raw_cols));
+	for (i = 0; i < rds_info_count(buf); i++) {
+		rec = rds_info_raw(buf, i);
+		for (j = 0; j < buf->each; j++)
+			sprintf(hex + 2 * j, "%02x", rec[j]);
+		hex[2 * buf->each] = '\0';
+		table_u64(i);
+		table_str(hex);
+		table_end_row();
+	}
+	free(hex);
+}
+
+static const struct column msg_cols[] = {
+	{ "laddr",		"LocalAddr",	15 },
+	{ "lport",		"LPort",	5 },
+	{ "faddr",		"RemoteAddr",	15 },
+	{ "fport",		"RPort",	5 },
+	{ "tos",		"Tos",		4 },
+	{ "seq",		"Seq",		16 },
+	{ "bytes",		"Bytes",	10 },
+};
+
+/*
+ * Aggregated queue views. Instead of one line per queued message, the
+ * messages are grouped by connection (laddr, faddr, tos) or by local
+ * port in a single pass over the snapshot, using an open addressing
+ * hash table that is kept across calls and grows with the number of
+ * groups rather than the number of messages.
+ */
+enum {
+	GROUP_NONE = 0,
+	GROUP_CONN,
+	GROUP_PORT,
+};
+
+static int		opt_group = GROUP_NONE;
+static unsigned int	opt_top = 0;
+
+struct msg_group {
+	uint32_t	laddr;
+	uint32_t	faddr;
+	uint16_t	lport;
+	uint8_t		tos;
+	uint8_t		used;
+	uint64_t	msgs;
+	uint64_t	bytes;
+};
+
+static struct msg_group	*groups;
+static unsigned int	groups_size;	/* always a power of two */
+static unsigned int	groups_used;
+
+static unsigned int group_hash(uint32_t laddr, uint32_t faddr, uint16_t lport,
+			       uint8_t tos)
+{
+	uint64_t h;
+
+	h = ((uint64_t)laddr << 32 | faddr) ^ ((uint64_t)lport << 8 | tos);
+	h *= 0x9e3779b97f4a7c15ULL;
+	return (unsigned int)(h >> 32);
+}
+
+static struct msg_group *group_slot(struct msg_group *tbl, unsigned int size,
+				    uint32_t laddr, uint32_t faddr,
+				    uint16_t lport, uint8_t tos)
+{
+	unsigned int i = group_hash(laddr, faddr, lport, tos) & (size - 1);
+
+	while (tbl[i].used && (tbl[i].laddr != laddr || tbl[i].faddr != faddr ||
+			       tbl[i].lport != lport || tbl[i].tos != tos))
+		i = (i + 1) & (size - 1);
+	return &tbl[i];
+}
+
+static void groups_grow(void)
+{
+	unsigned int i, size = groups_size ? groups_size * 2 : 256;
+	struct msg_group *tbl, *g;
+
+	tbl = calloc(size, sizeof(*tbl));
+	if (tbl == NULL) {
+		verbosef(0, stderr, "%s: Unable to allocate memory for "
+			 "%u message groups\n", progname, size);
+		exit(1);
+	}
+	for (i = 0; i < groups_size; i++) {
+		if (!groups[i].used)
+			continue;
+		g = group_slot(tbl, size, groups[i].laddr, groups[i].faddr,
+			       groups[i].lport, groups[i].tos);
+		*g = groups[i];
+	}
+	free(groups);
+	groups = tbl;
+	groups_size = size;
+}
+
+static void group_add(const struct rds_info_message *msg)
+{
+	struct msg_group *g;
+	uint32_t laddr = 0, faddr = 0;
+	uint16_t lport = 0;
+	uint8_t tos = 0;
+
+	if (opt_group == GROUP_CONN) {
+		laddr = msg->laddr;
+		faddr = msg->faddr;
+		tos = msg->tos;
+	} else
+		lport = msg->lport;
+
+	/* keep the load factor at or below one half */
+	if ((groups_used + 1) * 2 > groups_size)
+		groups_grow();
+
+	g = group_slot(groups, groups_size, laddr, faddr, lport, tos);
+	if (!g->used) {
+		g->used = 1;
+		g->laddr = laddr;
+		g->faddr = faddr;
+		g->lport = lport;
+		g->tos = tos;
+		groups_used++;
+	}
+	g->msgs++;
+	g->bytes += msg->len;
+}
+
+/* largest queues first */
+static int group_cmp(const void *a, const void *b)
+{
+	const struct msg_group *x = a, *y = b;
+
+	if (x->bytes != y->bytes)
+		return x->bytes < y->bytes ? 1 : -1;
+	if (x->msgs != y->msgs)
+		return x->msgs < y->msgs ? 1 : -1;
+	return 0;
+}
+
+static const struct column msg_conn_group_cols[] = {
+	{ "laddr",		"LocalAddr",	15 },
+	{ "faddr",		"RemoteAddr",	15 },
+	{ "tos",		"Tos",		4 },
+	{ "messages",		"Messages",	10 },
+	{ "bytes",		"Bytes",	14 },
+};
+
+static const struct column msg_port_group_cols[] = {
+	{ "lport",		"LPort",	5 },
+	{ "messages",		"Messages",	10 },
+	{ "bytes",		"Bytes",	14 },
+};
+
+static void print_msg_groups(const struct rds_info_buf *buf, void *extra)
+{
+	struct rds_info_message msg;
+	uint64_t total_msgs = 0, total_bytes = 0;
+	unsigned int i, n, shown;
+	char caption[96];
+
+	rds_info_for_each(msg, buf, i) {
+		if (filter_match(msg.laddr, msg.faddr, ntohs(msg.lport),
+				 ntohs(msg.fport), msg.tos, -1))
+			group_add(&msg);
+	}
+
+	/* squeeze the used slots to the front and rank them */
+	for (i = 0, n = 0; i < groups_size; i++) {
+		if (groups[i].used)
+			groups[n++] = groups[i];
+	}
+	qsort(groups, n, sizeof(*groups), group_cmp);
+	shown = opt_top && opt_top < n ? opt_top : n;
+
+	snprintf(caption, sizeof(caption), "%s Message Queue by %s",
+		 (char *)extra,
+		 opt_group == GROUP_CONN ? "Connection" : "Local Port");
+	if (opt_group == GROUP_CONN)
+		table_begin(source_name(extra, "_queue_by_conn"), caption,
+			    msg_conn_group_cols, array_size(msg_conn_group_cols));
+	else
+		table_begin(source_name(extra, "_queue_by_port"), caption,
+			    msg_port_group_cols, array_size(msg_port_group_cols));
+
+	for (i = 0; i < n; i++) {
+		total_msgs += groups[i].msgs;
+		total_bytes += groups[i].bytes;
+		if (i >= shown)
+			continue;
+
+		if (opt_group == GROUP_CONN) {
+			table_str(ipv4addr(groups[i].laddr));
+			table_str(ipv4addr(groups[i].faddr));
+			table_u64(groups[i].tos);
+		} else
+			table_u64(ntohs(groups[i].lport));
+		table_u64(groups[i].msgs);
+		table_u64(groups[i].bytes);
+		table_end_row();
+	}
+
+	/* the compacted table no longer hashes; start over next time */
+	memset(groups, 0, groups_size * sizeof(*groups));
+	groups_used = 0;
+
+	if (opt_format == FORMAT_TEXT)
+		printf("%u groups (%u shown), %"PRIu64" messages, "
+			"%"PRIu64" bytes\n", n, shown, total_msgs, total_bytes);
+}
+
+static void print_msgs(const struct rds_info_buf *buf, void *extra)
+{
+	struct rds_info_message msg;
+	char caption[64];
+	unsigned int i;
+
+	if (opt_group) {
+		print_msg_groups(buf, extra);
+		return;
+	}
+
+	snprintf(caption, sizeof(caption), "%s Message Queue", (char *)extra);
+	table_begin(source_name(extra, "_messages"), caption, msg_cols,
+		    array_size(msg_cols));
+	filter_begin();
+	
+	rds_info_for_each(msg, buf, i) {
+		if (!filter_match(msg.laddr, msg.faddr, ntohs(msg.lport),
+				  ntohs(msg.fport), msg.tos, -1))
+			continue;
+		table_str(ipv4addr(msg.laddr));
+		table_u64(ntohs(msg.lport));
+		table_str(ipv4addr(msg.faddr));
+		table_u64(ntohs(msg.fport));
+		table_u64(msg.tos);
+		table_u64(msg.seq);
+		table_u64(msg.len);
+		table_end_row();
+		if (filter_done(FKEY_NONE))
+			break;
+	}
+	filter_report(buf);
+}
+
+static const struct column tcp_sock_cols[] = {
+	{ "local_addr",		"LocalAddr",	15 },
+	{ "local_port",		"LPort",	5 },
+	{ "peer_addr",		"RemoteAddr",	15 },
+	{ "peer_port",		"RPort",	5 },
+	{ "hdr_rem",		"HdrRemain",	10 },
+	{ "data_rem",		"DataRemain",	10 },
+	{ "last_sent_nxt",	"SentNxt",	10 },
+	{ "last_expected_una",	"ExpectUna",	10 },
+	{ "last_seen_una",	"SeenUna",	10 },
+};
+
+static void print_tcp_socks(const struct rds_info_buf *buf, void *extra)
+{		
+	struct rds_info_tcp_socket ts;
+	unsigned int i;
+
+	table_begin("tcp_sockets", "TCP Connections", tcp_sock_cols,
+		    array_size(tcp_sock_cols));
+	filter_begin();
+	
+	rds_info_for_each(ts, buf, i) {
+		if (!filter_match(ts.local_addr, ts.peer_addr,
+				  ntohs(ts.local_port), ntohs(ts.peer_port),
+				  -1, -1))
+			continue;
+		table_str(ipv4addr(ts.local_addr));
+		table_u64(ntohs(ts.local_port));
+		table_str(ipv4addr(ts.peer_addr));
+		table_u64(ntohs(ts.peer_port));
+		table_u64(ts.hdr_rem);
+		table_u64(ts.data_rem);
+		table_u64(ts.last_sent_nxt);
+		table_u64(ts.last_expected_una);
+		table_u64(ts.last_seen_una);
+		table_end_row();
+		if (filter_done(FKEY_TCP))
+			break;
+	}
+	filter_report(buf);
+}
+
+static const struct column ib_conn_cols[] = {
+	{ "src_addr",		"LocalAddr",	15 },
+	{ "dst_addr",		"RemoteAddr",	15 },
+	{ "tos",		"Tos",		4 },
+	{ "sl",			"SL",		3 },
+	{ "src_gid",		"LocalDev",	32 },
+	{ "dst_gid",		"RemoteDev",	32 },
+	{ "send_wr",		NULL, 0, COL_VERBOSE },
+	{ "recv_wr",		NULL, 0, COL_VERBOSE },
+	{ "send_sge",		NULL, 0, COL_VERBOSE },
+	{ "rdma_mr_max",	NULL, 0, COL_VERBOSE },
+	{ "rdma_mr_size",	NULL, 0, COL_VERBOSE },
+	{ "cache_allocs",	NULL, 0, COL_VERBOSE },
+};
+
+/*
+ * Resource view of the IB and iWARP connections: work requests and MR
+ * pool use totalled per local and remote GID pair, with cache_allocs
+ * taken as the share of rdma_mr_max in use. Connections at or above
+ * opt_mr_warn percent of their pool are listed on their own.
+ */
+static unsigned int	opt_resources = 0;
+static unsigned int	opt_mr_warn = 80;
+
+static int gid_pair_cmp(const void *a, const void *b)
+{
+	const struct rds_info_rdma_connection *x = a, *y = b;
+	int ret;
+
+	ret = memcmp(x->src_gid, y->src_gid, RDS_IB_GID_LEN);
+	if (ret == 0)
+		ret = memcmp(x->dst_gid, y->dst_gid, RDS_IB_GID_LEN);
+	return ret;
+}
+
+static double mr_util(uint64_t allocs, uint64_t max)
+{
+	return max ? allocs * 100.0 / max : 0;
+}
+
+static const struct column ib_resource_cols[] = {
+	{ "src_gid",		"LocalDev",	32 },
+	{ "dst_gid",		"RemoteDev",	32 },
+	{ "conns",		"Conns",	6 },
+	{ "send_wr",		"SendWR",	8 },
+	{ "recv_wr",		"RecvWR",	8 },
+	{ "rdma_mr_max",	"MRMax",	8 },
+	{ "cache_allocs",	"Allocs",	8 },
+	{ "mr_util",		"Util%",	6 },
+	{ "near_limit",		"Near",		5 },
+};
+
+static const struct column ib_near_limit_cols[] = {
+	{ "src_addr",		"LocalAddr",	15 },
+	{ "dst_addr",		"RemoteAddr",	15 },
+	{ "tos",		"Tos",		4 },
+	{ "src_gid",		"LocalDev",	32 },
+	{ "dst_gid",		"RemoteDev",	32 },
+	{ "rdma_mr_max",	"MRMax",	8 },
+	{ "cache_allocs",	"Allocs",	8 },
+	{ "mr_util",		"Util%",	6 },
+};
+
+static void print_ib_resources(const struct rds_info_buf *buf, void *extra)
+{
+	struct rds_info_rdma_connection *conns, *c, *first;
+	uint64_t send_wr, recv_wr, mr_max, allocs;
+	unsigned int i, n = 0, nr_conns, near, total_near = 0;
+	char caption[96];
+
+	conns = malloc((rds_info_count(buf) + 1) * sizeof(*conns));
+	if (conns == NULL) {
+		verbosef(0, stderr, "%s: Unable to allocate memory "
+			 "for %u connections\n", progname, rds_info_count(buf));
+		exit(1);
+	}
+	rds_info_for_each(conns[n], buf, i) {
+		if (filter_match(conns[n].src_addr, conns[n].dst_addr, -1, -1,
+				 conns[n].tos, -1))
+			n++;
+	}
+	qsort(conns, n, sizeof(*conns), gid_pair_cmp);
+
+	snprintf(caption, sizeof(caption), "RDS %s Resources by Device",
+		 (char *)extra);
+	table_begin(source_name(extra, "_resources"), caption,
+		    ib_resource_cols, array_size(ib_resource_cols));
+
+	for (i = 0; i < n; ) {
+		first = &conns[i];
+		send_wr = recv_wr = mr_max = allocs = 0;
+		nr_conns = near = 0;
+		for (c = first; i < n && !gid_pair_cmp(first, c); c = &conns[++i]) {
+			nr_conns++;
+			send_wr += c->max_send_wr;
+			recv_wr += c->max_recv_wr;
+			mr_max += c->rdma_mr_max;
+			allocs += c->cache_allocs;
+			if (mr_util(c->cache_allocs, c->rdma_mr_max) >= opt_mr_warn)
+				near++;
+		}
+		total_near += near;
+
+		table_str(ipv6addr(first->src_gid));
+		table_str(ipv6addr(first->dst_gid));
+		table_u64(nr_conns);
+		table_u64(send_wr);
+		table_u64(recv_wr);
+		table_u64(mr_max);
+		table_u64(allocs);
+		table_fmt("%.1f", mr_util(allocs, mr_max));
+		table_u64(near);
+		table_end_row();
+	}
+
+	if (total_near) {
+		snprintf(caption, sizeof(caption), "RDS %s Connections at %u%% "
+			 "or More of Their MR Pool", (char *)extra, opt_mr_warn);
+		table_begin(source_name(extra, "_near_mr_limit"), caption,
+			    ib_near_limit_cols, array_size(ib_near_limit_cols));
+		for (i = 0; i < n; i++) {
+			c = &conns[i];
+			if (mr_util(c->cache_allocs, c->rdma_mr_max) < opt_mr_warn)
+				continue;
+			table_str(ipv4addr(c->src_addr));
+			table_str(ipv4addr(c->dst_addr));
+			table_u64(c->tos);
+			table_str(ipv6addr(c->src_gid));
+			table_str(ipv6addr(c->dst_gid));
+			table_u64(c->rdma_mr_max);
+			table_u64(c->cache_allocs);
+			table_fmt("%.1f", mr_util(c->cache_allocs, c->rdma_mr_max));
+			table_end_row();
+		}
+	}
+
+	free(conns);
+}
+
+/* Shared by the IB and iWARP transports; extra names the transport */
+static void print_ib_conns(const struct rds_info_buf *buf, void *extra)
+{
+	struct rds_info_rdma_connection ic;
+	char caption[64];
+	unsigned int i;
+
+	if (opt_resources) {
+		print_ib_resources(buf, extra);
+		return;
+	}
+
+	snprintf(caption, sizeof(caption), "RDS %s Connections", (char *)extra);
+	table_begin(source_name(extra, "_connections"), caption, ib_conn_cols,
+		    array_size(ib_conn_cols));
+	filter_begin();
+
+	rds_info_for_each(ic, buf, i) {
+		if (!filter_match(ic.src_addr, ic.dst_addr, -1, -1, ic.tos, -1))
+			continue;
+		table_str(ipv4addr(ic.src_addr));
+		table_str(ipv4addr(ic.dst_addr));
+		table_u64(ic.tos);
+		table_u64(ic.sl);
+		table_str(ipv6addr(ic.src_gid));
+		table_str(ipv6addr(ic.dst_gid));
+		table_u64(ic.max_send_wr);
+		table_u64(ic.max_recv_wr);
+		table_u64(ic.max_send_sge);
+		table_u64(ic.rdma_mr_max);
+		table_u64(ic.rdma_mr_size);
+		table_u64(ic.cache_allocs);
+		table_end_row();
+		if (filter_done(FKEY_CONN))
+			break;
+	}
+	filter_report(buf);
+}
+
+struct info {
+	int opt_val;
+	char *description;
+	void (*print)(const struct rds_info_buf *buf, void *extra);
+	void *extra;
+	int option_given;
+	void (*watch)(struct info *info, double elapsed);
+	/* compares snapshots, defaults to the watch function */
+	void (*diff)(struct info *info, double elapsed);
+	/* only used when asked for, current kernels don't answer */
+	int opt_in;
+
+	/* The last two snapshots of this source. The buffers are kept
+	 * across iterations in watch mode, and only grow when the kernel
+	 * asks for more room. */
+	struct rds_info_buf buf;
+	struct rds_info_buf prev;
+	/* the source as recorded in the file given with --load */
+	struct rds_info_buf replay;
+};
+
+static uint64_t prev_counter_value(struct info *info, int index,
+				   const struct rds_info_counter *ctr)
+{
+	struct rds_info_counter old;
+	unsigned int i;
+
+	/* counters normally keep their position; try that first */
+	if (rds_info_counter_at(&info->prev, index, &old) &&
+	    !strcmp((char *)old.name, (char *)ctr->name))
+		return old.value;
+
+	rds_info_for_each(old, &info->prev, i) {
+		if (!strcmp((char *)old.name, (char *)ctr->name))
+			return old.value;
+	}
+	return ctr->value;
+}
+
+/* wall clock time of the current watch round */
+static time_t	watch_time;
+
+static const struct column watch_counter_cols[] = {
+	{ "time",		NULL,		0, COL_NOTEXT },
+	{ "name",		"CounterName",	25 },
+	{ "value",		"Value",	16 },
+	{ "delta",		"Delta",	12 },
+	{ "rate",		"Rate/s",	14 },
+};
+
+static void watch_counters(struct info *info, double elapsed)
+{
+	struct rds_info_counter ctr;
+	unsigned int i;
+
+	table_begin("counter_deltas", "Counters", watch_counter_cols,
+		    array_size(watch_counter_cols));
+
+	rds_info_for_each(ctr, &info->buf, i) {
+		uint64_t prev = prev_counter_value(info, i, &ctr);
+		uint64_t delta;
+
+		/* counters only go backwards when the module was reloaded */
+		delta = ctr.value >= prev ? ctr.value - prev : ctr.value;
+
+		/* only show the counters that moved, unless asked to */
+		if (delta == 0 && !opt_verbose)
+			continue;
+		table_u64(watch_time);
+		table_str((char *)ctr.name);
+		table_u64(ctr.value);
+		table_u64(delta);
+		table_fmt("%.2f", delta / elapsed);
+		table_end_row();
+	}
+}
+
+static void queue_depth(const struct rds_info_buf *buf,
+			uint64_t *nr, uint64_t *bytes)
+{
+	struct rds_info_message msg;
+	unsigned int i;
+
+	*nr = *bytes = 0;
+	rds_info_for_each(msg, buf, i) {
+		if (!filter_match(msg.laddr, msg.faddr, ntohs(msg.lport),
+				  ntohs(msg.fport), msg.tos, -1))
+			continue;
+		(*nr)++;
+		*bytes += msg.len;
+	}
+}
+
+static const struct column watch_msg_cols[] = {
+	{ "time",		NULL,		0, COL_NOTEXT },
+	{ "messages",		"Messages",	10 },
+	{ "messages_change",	"Change",	10 },
+	{ "bytes",		"Bytes",	14 },
+	{ "bytes_change",	"Change",	14 },
+};
+
+static void watch_msgs(struct info *info, double elapsed)
+{
+	uint64_t nr, bytes, prev_nr, prev_bytes;
+	char caption[64];
+
+	/* the grouped view is more useful than totals when asked for */
+	if (opt_group) {
+		print_msg_groups(&info->buf, info->extra);
+		return;
+	}
+
+	queue_depth(&info->buf, &nr, &bytes);
+	queue_depth(&info->prev, &prev_nr, &prev_bytes);
+
+	snprintf(caption, sizeof(caption), "%s Message Queue",
+		 (char *)info->extra);
+	table_begin(source_name(info->extra, "_queue_depth"), caption,
+		    watch_msg_cols, array_size(watch_msg_cols));
+	table_u64(watch_time);
+	table_u64(nr);
+	table_s64(nr - prev_nr);
+	table_u64(bytes);
+	table_s64(bytes - prev_bytes);
+	table_end_row();
+}
+
+/*
+ * Connections are matched between snapshots by (laddr, faddr, tos).
+ * Both sides are sorted and walked together so that connections which
+ * only exist on one side show up as added or removed.
+ */
+static int conn_key_cmp(const void *a, const void *b)
+{
+	const struct rds_info_connection *x = a, *y = b;
+
+	if (x->laddr != y->laddr)
+		return ntohl(x->laddr) < ntohl(y->laddr) ? -1 : 1;
+	if (x->faddr != y->faddr)
+		return ntohl(x->faddr) < ntohl(y->faddr) ? -1 : 1;
+	return x->tos - y->tos;
+}
+
+static struct rds_info_connection *sorted_conns(const struct rds_info_buf *buf,
+						size_t *nr)
+{
+	struct rds_info_connection *conns;
+	unsigned int i;
+
+	*nr = rds_info_count(buf);
+	conns = malloc((*nr + 1) * sizeof(*conns));
+	if (conns == NULL) {
+		verbosef(0, stderr, "%s: Unable to allocate memory "
+			 "for %zu connections\n", progname, *nr);
+		exit(1);
+	}
+	for (i = 0; i < *nr; i++)
+		rds_info_connection_at(buf, i, &conns[i]);
+	qsort(conns, *nr, sizeof(*conns), conn_key_cmp);
+	return conns;
+}
+
+/*
+ * The connections with messages in the given send and retransmit queues,
+ * sorted and without duplicates for bsearch() with conn_key_cmp(). Only
+ * the key fields are filled in.
+ */
+static struct rds_info_connection *queued_conns(const struct rds_info_buf *send,
+						const struct rds_info_buf *rexmit,
+						size_t *nr)
+{
+	const struct rds_info_buf *bufs[] = { send, rexmit };
+	struct rds_info_connection *conns;
+	struct rds_info_message msg;
+	size_t total = 0, i, n;
+	unsigned int b, j;
+
+	for (b = 0; b < array_size(bufs); b++)
+		total += rds_info_count(bufs[b]);
+	conns = calloc(total + 1, sizeof(*conns));
+	if (conns == NULL) {
+		verbosef(0, stderr, "%s: Unable to allocate memory "
+			 "for %zu connections\n", progname, total);
+		exit(1);
+	}
+	n = 0;
+	for (b = 0; b < array_size(bufs); b++) {
+		rds_info_for_each(msg, bufs[b], j) {
+			conns[n].laddr = msg.laddr;
+			conns[n].faddr = msg.faddr;
+			conns[n].tos = msg.tos;
+			n++;
+		}
+	}
+	qsort(conns, n, sizeof(*conns), conn_key_cmp);
+	for (i = 0, *nr = 0; i < n; i++) {
+		if (*nr && conn_key_cmp(&conns[*nr - 1], &conns[i]) == 0)
+			continue;
+		conns[(*nr)++] = conns[i];
+	}
+	return conns;
+}
+
+static void conn_flags(const struct rds_info_connection *c, char *flags)
+{
+	struct rds_info_connection conn = *c;
+
+	sprintf(flags, "%c%c%c%c",
+		rds_conn_flag(conn, SENDING, 's'),
+		rds_conn_flag(conn, CONNECTING, 'c'),
+		rds_conn_flag(conn, CONNECTED, 'C'),
+		rds_conn_flag(conn, ERROR, 'E'));
+}
+
+static const struct column diff_conn_cols[] = {
+	{ "time",		NULL,		0, COL_NOTEXT },
+	{ "laddr",		"LocalAddr",	15 },
+	{ "faddr",		"RemoteAddr",	15 },
+	{ "tos",		"Tos",		4 },
+	{ "change",		"Change",	8 },
+	{ "next_tx_seq",	"NextTX",	16 },
+	{ "tx_progress",	"TXProgress",	12 },
+	{ "next_rx_seq",	"NextRX",	16 },
+	{ "rx_progress",	"RXProgress",	12 },
+	{ "old_flags",		"Was",		4 },
+	{ "flags",		"Flgs",		4 },
+};
+
+static struct info *info_by_opt_val(uint32_t opt_val);
+
+static void diff_conns(struct info *info, double elapsed)
+{
+	struct rds_info_connection *old, *cur, *queued, *o, *c, *k;
+	size_t nr_old, nr_cur, nr_queued, i = 0, j = 0;
+	char old_flags[5], flags[5];
+	const char *change;
+
+	if (info->buf.each == 0 || info->prev.each == 0)
+		return;
+
+	old = sorted_conns(&info->prev, &nr_old);
+	cur = sorted_conns(&info->buf, &nr_cur);
+	/* without the newer queues no connection is known to be stalled */
+	queued = queued_conns(&info_by_opt_val(RDS_INFO_SEND_MESSAGES)->buf,
+			      &info_by_opt_val(RDS_INFO_RETRANS_MESSAGES)->buf,
+			      &nr_queued);
+
+	table_begin("connection_changes", "RDS Connection Changes",
+		    diff_conn_cols, array_size(diff_conn_cols));
+	filter_begin();
+
+	while (i < nr_old || j < nr_cur) {
+		int cmp;
+
+		if (i == nr_old)
+			cmp = 1;
+		else if (j == nr_cur)
+			cmp = -1;
+		else
+			cmp = conn_key_cmp(&old[i], &cur[j]);
+
+		o = cmp <= 0 ? &old[i++] : NULL;
+		c = cmp >= 0 ? &cur[j++] : NULL;
+
+		if (!o)
+			change = "added";
+		else if (!c)
+			change = "removed";
+		else if (c->next_tx_seq < o->next_tx_seq ||
+			 c->next_rx_seq < o->next_rx_seq)
+			change = "reset";
+		else if (c->next_tx_seq == o->next_tx_seq &&
+			 bsearch(c, queued, nr_queued, sizeof(*queued),
+				 conn_key_cmp))
+			change = "stalled";
+		else
+			change = "";
+
+		k = c ? c : o;
+		if (!filter_match(k->laddr, k->faddr, -1, -1, k->tos,
+				  c ? c->flags | c->transport[15] : -1))
+			continue;
+
+		if (o)
+			conn_flags(o, old_flags);
+		else
+			strcpy(old_flags, "");
+		if (c)
+			conn_flags(c, flags);
+		else
+			strcpy(flags, "");
+
+		table_u64(watch_time);
+		table_str(ipv4addr(k->laddr));
+		table_str(ipv4addr(k->faddr));
+		table_u64(k->tos);
+		table_str(change);
+		if (c)
+			table_u64(c->next_tx_seq);
+		else
+			table_str("");
+		if (o && c)
+			table_s64(c->next_tx_seq - o->next_tx_seq);
+		else
+			table_str("");
+		if (c)
+			table_u64(c->next_rx_seq);
+		else
+			table_str("");
+		if (o && c)
+			table_s64(c->next_rx_seq - o->next_rx_seq);
+		else
+			table_str("");
+		table_str(old_flags);
+		table_str(flags);
+		table_end_row();
+		if (filter_done(FKEY_CONN))
+			break;
+	}
+	filter_report(&info->buf);
+
+	free(queued);
+	free(old);
+	free(cur);
+}
+
+static const struct column watch_conn_cols[] = {
+	{ "time",		NULL,		0, COL_NOTEXT },
+	{ "laddr",		"LocalAddr",	15 },
+	{ "faddr",		"RemoteAddr",	15 },
+	{ "tos",		"Tos",		4 },
+	{ "next_tx_seq",	"NextTX",	16 },
+	{ "tx_rate",		"TX/s",		12 },
+	{ "next_rx_seq",	"NextRX",	16 },
+	{ "rx_rate",		"RX/s",		12 },
+	{ "flags",		"Flgs",		4 },
+};
+
+/*
+ * Connections with the rate their sequence numbers advanced since the
+ * previous round. New and reset connections have no rate.
+ */
+static void watch_conns(struct info *info, double elapsed)
+{
+	struct rds_info_connection *old, *cur, *o, *c;
+	size_t nr_old, nr_cur, i = 0, j;
+	char flags[5];
+
+	old = sorted_conns(&info->prev, &nr_old);
+	cur = sorted_conns(&info->buf, &nr_cur);
+
+	table_begin("connection_rates", "RDS Connections",
+		    watch_conn_cols, array_size(watch_conn_cols));
+	filter_begin();
+
+	for (j = 0; j < nr_cur; j++) {
+		c = &cur[j];
+		while (i < nr_old && conn_key_cmp(&old[i], c) < 0)
+			i++;
+		o = i < nr_old && conn_key_cmp(&old[i], c) == 0 ? &old[i] : NULL;
+
+		if (!filter_match(c->laddr, c->faddr, -1, -1, c->tos,
+				  c->flags | c->transport[15]))
+			continue;
+		conn_flags(c, flags);
+
+		table_u64(watch_time);
+		table_str(ipv4addr(c->laddr));
+		table_str(ipv4addr(c->faddr));
+		table_u64(c->tos);
+		table_u64(c->next_tx_seq);
+		if (o && c->next_tx_seq >= o->next_tx_seq)
+			table_fmt("%.2f", (c->next_tx_seq - o->next_tx_seq) /
+					  elapsed);
+		else
+			table_str("");
+		table_u64(c->next_rx_seq);
+		if (o && c->next_rx_seq >= o->next_rx_seq)
+			table_fmt("%.2f", (c->next_rx_seq - o->next_rx_seq) /
+					  elapsed);
+		else
+			table_str("");
+		table_str(flags);
+		table_end_row();
+		if (filter_done(FKEY_CONN))
+			break;
+	}
+	filter_report(&info->buf);
+
+	free(old);
+	free(cur);
+}
+
+struct info infos[] = {
+	['c'] = { RDS_INFO_COUNTERS, "statistic counters",
+		print_counters, NULL, 0, watch_counters },
+	['k'] = { RDS_INFO_SOCKETS, "sockets", 
+		print_sockets, NULL, 0 },
+	['n'] = { RDS_INFO_CONNECTIONS, "connections",
+		print_conns, NULL, 0, watch_conns, diff_conns },
+	['r'] = { RDS_INFO_RECV_MESSAGES, "recv queue messages",
+		print_msgs, "Receive", 0, watch_msgs },
+	['s'] = { RDS_INFO_SEND_MESSAGES, "send queue messages",
+		print_msgs, "Send", 0, watch_msgs },
+	['t'] = { RDS_INFO_RETRANS_MESSAGES, "retransmit queue messages",
+		  print_msgs, "Retransmit", 0, watch_msgs },
+	['T'] = { RDS_INFO_TCP_SOCKETS, "TCP transport sockets",
+		  print_tcp_socks, NULL, 0 },
+	['I'] = { RDS_INFO_IB_CONNECTIONS, "IB transport connections",
+		  print_ib_conns, "IB", 0 },
+	['N'] = { RDS_INFO_CONNECTION_STATS, "connection statistics (raw)",
+		  print_conn_stats, NULL, 0, NULL, NULL, 1 },
+	['W'] = { RDS_INFO_IWARP_CONNECTIONS, "iWARP transport connections",
+		  print_ib_conns, "iWARP", 0, NULL, NULL, 1 },
+};
+
+static void print_usage(int rc)
+{
+	FILE *output = rc ? stderr : stdout;
+	int i;
+
+	fprintf(stderr, "rds-info version %s\n", RDS_VERSION);
+
+	verbosef(0, output, "The following options limit output to the given "
+		 "sources:\n");
+
+	for (i = 0; i < array_size(infos); i++) {
+		if (!infos[i].opt_val)
+			continue;
+		printf("    -%c %s\n", i, infos[i].description);
+	}
+
+	verbosef(0, output,
+		"\n\nIf no options are given then all sources but -N and -W "
+		"are used.\n");
+	verbosef(0, output,
+		"\nOther options:\n"
+		"    -v              verbose output\n"
+		"    -w, --interval [seconds]\n"
+		"                    poll the sources and print changes\n"
+		"    --format=text|json|csv\n"
+		"                    output format, json is one object per line\n"
+		"    --group=conn|port\n"
+		"                    summarize message queues per connection or port\n"
+		"    --top [n]       only show the n largest groups\n"
+		"    -F, --filter [term,...]\n"
+		"                    only show matching records; terms are\n"
+		"                    laddr=addr[/bits] faddr=addr[/bits]\n"
+		"                    lport=n[-m] fport=n[-m] port=n[-m]\n"
+		"                    tos=n flags=[scCE] max=n\n"
+		"    --save=file     save a snapshot of the sources to file\n"
+		"    --diff=old [--diff=new]\n"
+		"                    compare a snapshot with a later one or\n"
+		"                    with the live state\n"
+		"    --resources[=pct]\n"
+		"                    total IB/iWARP resources per device pair and\n"
+		"                    list connections using pct%% of their MR pool\n"
+		"    -P, --peers     rank peers in a full screen view, refreshed\n"
+		"                    every -w seconds\n"
+		"    --rank=queued|growth|retrans|stalled\n"
+		"                    what to rank peers by\n"
+		"    --load=file     read the sources from a saved snapshot\n"
+		"    --synthetic=conns=n,msgs=n[,seed=n]\n"
+		"                    generate the sources instead of asking RDS\n");
+	exit(rc);
+}
+
+/* long options without a short equivalent; above the infos[] letters */
+enum {
+	OPT_FORMAT = 0x100,
+	OPT_GROUP,
+	OPT_TOP,
+	OPT_SAVE,
+	OPT_DIFF,
+	OPT_LOAD,
+	OPT_SYNTHETIC,
+	OPT_RANK,
+	OPT_RESOURCES,
+};
+
+static struct option long_options[] = {
+	{ "interval",	required_argument,	NULL,	'w' },
+	{ "filter",	required_argument,	NULL,	'F' },
+	{ "format",	required_argument,	NULL,	OPT_FORMAT },
+	{ "group",	required_argument,	NULL,	OPT_GROUP },
+	{ "top",	required_argument,	NULL,	OPT_TOP },
+	{ "save",	required_argument,	NULL,	OPT_SAVE },
+	{ "diff",	required_argument,	NULL,	OPT_DIFF },
+	{ "load",	required_argument,	NULL,	OPT_LOAD },
+	{ "synthetic",	required_argument,	NULL,	OPT_SYNTHETIC },
+	{ "peers",	no_argument,		NULL,	'P' },
+	{ "rank",	required_argument,	NULL,	OPT_RANK },
+	{ "resources",	optional_argument,	NULL,	OPT_RESOURCES },
+	{ NULL }
+};
+
+/*
+ * Providers produce the snapshots that everything else formats: the
+ * live kernel, a recorded snapshot file given with --load, or synthetic
+ * records from --synthetic. The latter two let the output paths run,
+ * and be timed, on machines without RDS.
+ */
+static int (*provider)(struct info *info);
+static const char *provider_name = "live state";
+
+static int live_fd = -1;
+static int live_sol;
+
+static int live_fetch(struct info *info)
+{
+	return rds_info_get(live_fd, live_sol, &info->buf);
+}
+
+static void live_open(void)
+{
+	int pf;
+
+#ifdef DYNAMIC_PF_RDS
+	pf = discover_pf_rds();
+	live_sol = discover_sol_rds();
+#else
+	pf = PF_RDS;
+	live_sol = SOL_RDS;
+#endif
+	live_fd = socket(pf, SOCK_SEQPACKET, 0);
+	if (live_fd < 0) {
+		verbosef(0, stderr, "%s: Unable to create socket: %s\n",
+			 progname, strerror(errno));
+		exit(1);
+	}
+	provider = live_fetch;
+}
+
+static int buf_reserve(struct rds_info_buf *buf, socklen_t len)
+{
+	void *data;
+
+	if (len <= buf->size)
+		return 0;
+	data = realloc(buf->data, len);
+	if (data == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	buf->data = data;
+	buf->size = len;
+	return 0;
+}
+
+/* every round hands out the recorded snapshot again */
+static int replay_fetch(struct info *info)
+{
+	if (!info->replay.each) {
+		errno = ENOPROTOOPT;
+		return -1;
+	}
+	if (buf_reserve(&info->buf, info->replay.len))
+		return -1;
+	memcpy(info->buf.data, info->replay.data, info->replay.len);
+	info->buf.len = info->replay.len;
+	info->buf.each = info->replay.each;
+	return 0;
+}
+
+/*
+ * Synthetic snapshots: conns connections from 10.0.0.1-4 to peers in
+ * 10.128/9, each with a TCP socket and an IB and iWARP connection, and
+ * msgs messages spread over the connections and 64 local ports in the
+ * send queue, with a tenth of that in the receive and retransmit queues.
+ * Records are derived from the seed, and counters and sequence numbers
+ * advance with every round so watch mode has deltas to show.
+ */
+static struct {
+	unsigned long	conns;
+	unsigned long	msgs;
+	unsigned long	seed;
+	unsigned long	round[256];
+} synth = { 1000, 10000, 1 };
+
+#define SYNTH_PORTS	64
+
+static const char *synth_counters[] = {
+	"conn_reset", "recv_drop_bad_checksum", "recv_drop_old_seq",
+	"recv_drop_no_sock", "recv_drop_dead_sock", "recv_deliver_raced",
+	"recv_delivered", "recv_queued", "recv_immediate_retry",
+	"recv_delayed_retry", "recv_ack_required", "recv_rdma_bytes",
+	"recv_ping", "send_queue_empty", "send_queue_full",
+	"send_lock_contention", "send_lock_queue_raced", "send_immediate_retry",
+	"send_delayed_retry", "send_drop_acked", "send_ack_required",
+	"send_queued", "send_rdma", "send_rdma_bytes", "send_pong",
+	"page_remainder_hit", "page_remainder_miss", "copy_to_user",
+	"copy_from_user", "cong_update_queued", "cong_update_received",
+	"cong_send_error", "cong_send_blocked",
+};
+
+static uint32_t synth_laddr(unsigned long conn)
+{
+	return htonl(0x0a000001 + conn % 4);
+}
+
+static uint32_t synth_faddr(unsigned long conn)
+{
+	return htonl(0x0a800001 + conn / 4);
+}
+
+static int parse_synthetic(const char *arg)
+{
+	char spec[256], *term, *value, *endptr;
+	unsigned long val;
+
+	if (strlen(arg) >= sizeof(spec))
+		return 0;
+	strcpy(spec, arg);
+
+	for (term = strtok(spec, ","); term; term = strtok(NULL, ",")) {
+		value = strchr(term, '=');
+		if (value == NULL)
+			return 0;
+		*value++ = '\0';
+		val = strtoul(value, &endptr, 0);
+		if (*endptr || !*value)
+			return 0;
+
+		if (!strcmp(term, "conns") && val)
+			synth.conns = val;
+		else if (!strcmp(term, "msgs"))
+			synth.msgs = val;
+		else if (!strcmp(term, "seed"))
+			synth.seed = val;
+		else
+			return 0;
+	}
+	return 1;
+}
+
+static void synth_msgs(struct rds_info_message *msg, unsigned long nr,
+		       unsigned long round)
+{
+	unsigned long i, c;
+
+	for (i = 0; i < nr; i++) {
+		c = random() % synth.conns;
+		memset(&msg[i], 0, sizeof(msg[i]));
+		msg[i].laddr = synth_laddr(c);
+		msg[i].faddr = synth_faddr(c);
+		msg[i].lport = htons(4000 + random() % SYNTH_PORTS);
+		msg[i].fport = htons(4000 + random() % SYNTH_PORTS);
+		msg[i].seq = round * nr + i;
+		msg[i].len = 64 << (random() % 11);
+	}
+}
+
+static int synth_fetch(struct info *info)
+{
+	struct rds_info_buf *buf = &info->buf;
+	unsigned long round = synth.round[info - infos]++;
+	unsigned long nr, i;
+	size_t each;
+
+	srandom(synth.seed + info->opt_val);
+
+	switch (info->opt_val) {
+	case RDS_INFO_COUNTERS:
+		each = sizeof(struct rds_info_counter);
+		nr = array_size(synth_counters);
+		break;
+	case RDS_INFO_SOCKETS:
+		each = sizeof(struct rds_info_socket);
+		nr = SYNTH_PORTS;
+		break;
+	case RDS_INFO_CONNECTIONS:
+		each = sizeof(struct rds_info_connection);
+		nr = synth.conns;
+		break;
+	case RDS_INFO_SEND_MESSAGES:
+		each = sizeof(struct rds_info_message);
+		nr = synth.msgs;
+		break;
+	case RDS_INFO_RECV_MESSAGES:
+	case RDS_INFO_RETRANS_MESSAGES:
+		each = sizeof(struct rds_info_message);
+		nr = synth.msgs / 10;
+		break;
+	case RDS_INFO_TCP_SOCKETS:
+		each = sizeof(struct rds_info_tcp_socket);
+		nr = synth.conns;
+		break;
+	case RDS_INFO_IB_CONNECTIONS:
+	case RDS_INFO_IWARP_CONNECTIONS:
+		each = sizeof(struct rds_info_rdma_connection);
+		nr = synth.conns;
+		break;
+	default:
+		errno = ENOPROTOOPT;
+		return -1;
+	}
+
+	/* the snapshot length is a socklen_t, as it is from the kernel */
+	if (nr > INT_MAX / each) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if (buf_reserve(buf, nr * each))
+		return -1;
+	buf->len = nr * each;
+	buf->each = each;
+
+	if (each == sizeof(struct rds_info_message)) {
+		synth_msgs(buf->data, nr, round);
+		return 0;
+	}
+
+	for (i = 0; i < nr; i++) {
+		void *rec = buf->data + i * each;
+
+		memset(rec, 0, each);
+		switch (info->opt_val) {
+		case RDS_INFO_COUNTERS: {
+			struct rds_info_counter *ctr = rec;
+
+			strcpy((char *)ctr->name, synth_counters[i]);
+			ctr->value = (random() % 1000) * (round + 1);
+			break;
+		}
+		case RDS_INFO_SOCKETS: {
+			struct rds_info_socket *sk = rec;
+
+			sk->bound_addr = htonl(0x0a000001 + i % 4);
+			sk->bound_port = htons(4000 + i);
+			sk->sndbuf = sk->rcvbuf = 1 << 20;
+			sk->inum = 100000 + i;
+			break;
+		}
+		case RDS_INFO_CONNECTIONS: {
+			struct rds_info_connection *conn = rec;
+
+			conn->laddr = synth_laddr(i);
+			conn->faddr = synth_faddr(i);
+			strcpy((char *)conn->transport, "ib");
+			conn->flags = RDS_INFO_CONNECTION_FLAG_CONNECTED;
+			/* one in a hundred connections makes no progress */
+			conn->next_tx_seq = random() % 100000;
+			if (i % 100)
+				conn->next_tx_seq += round * (random() % 1000);
+			conn->next_rx_seq = random() % 100000 +
+					    round * (random() % 1000);
+			break;
+		}
+		case RDS_INFO_TCP_SOCKETS: {
+			struct rds_info_tcp_socket *ts = rec;
+
+			ts->local_addr = synth_laddr(i);
+			ts->peer_addr = synth_faddr(i);
+			ts->local_port = htons(16385);	/* RDS over TCP */
+			ts->peer_port = htons(32768 + i % 28000);
+			ts->last_sent_nxt = random();
+			ts->last_expected_una = ts->last_sent_nxt;
+			ts->last_seen_una = ts->last_sent_nxt;
+			break;
+		}
+		case RDS_INFO_IB_CONNECTIONS:
+		case RDS_INFO_IWARP_CONNECTIONS: {
+			struct rds_info_rdma_connection *ic = rec;
+
+			ic->src_addr = synth_laddr(i);
+			ic->dst_addr = synth_faddr(i);
+			ic->src_gid[0] = ic->dst_gid[0] = 0xfe;
+			ic->src_gid[1] = ic->dst_gid[1] = 0x80;
+			memcpy(&ic->src_gid[12], &ic->src_addr, 4);
+			memcpy(&ic->dst_gid[12], &ic->dst_addr, 4);
+			ic->max_send_wr = 256;
+			ic->max_recv_wr = 1024;
+			ic->max_send_sge = 8;
+			ic->rdma_mr_max = 8192;
+			ic->rdma_mr_size = 256;
+			ic->cache_allocs = random() % (ic->rdma_mr_max + 1);
+			break;
+		}
+		}
+	}
+	return 0;
+}
 
-#define for_each(var, data, each, len) 			\
-	for (;len > 0 && copy_into(var, data, each);	\
-	     data += each, len -= min(len, each))
+static int fetch_info(struct info *info)
+{
+	info->buf.opt = info->opt_val;
+	if (provider(info)) {
+		if (errno == ENOMEM) {
+			verbosef(0, stderr,
+				 "%s: Unable to allocate memory "
+				 "for info: %s\n", progname, strerror(errno));
+			exit(1);
+		}
+		verbosef(0, stderr,
+			 "%s: Unable get statistics: %s\n",
+			 progname, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
 
-#define verbosef(lvl, f, fmt, a...) do { \
-        if (opt_verbose >= (lvl)) \
-                fprintf((f), fmt, ##a); \
-} while (0)
+/* Keep the current snapshot around as the previous one, and recycle
+ * the previous buffer for the next snapshot. */
+static void rotate_info(struct info *info)
+{
+	rds_info_swap(&info->buf, &info->prev);
+}
 
-static int	opt_verbose = 0;
+static double now_secs(void)
+{
+	struct timespec ts;
 
-char *progname = "rds-info";
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-/* Like inet_ntoa, but can be re-entered several times without clobbering
- * the previously returned string. */
-static const char *paddr(int af, const void *addrp)
+static void sleep_until(double deadline)
 {
-	static char nbuf[8][INET6_ADDRSTRLEN];
-	static int which = 0;
-	char *string;
+	double delta = deadline - now_secs();
+	struct timespec ts;
 
-	string = nbuf[which];
-	which = (which + 1) % 8;
+	if (delta <= 0)
+		return;
+	ts.tv_sec = (time_t) delta;
+	ts.tv_nsec = (long) ((delta - ts.tv_sec) * 1e9);
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
 
-	inet_ntop(af, addrp, string, INET6_ADDRSTRLEN);
-	return string;
+static int selected(struct info *info, int given_options)
+{
+	if (given_options)
+		return info->opt_val && info->option_given;
+	return info->opt_val && !info->opt_in;
 }
 
-static const char *ipv4addr(uint32_t addr)
+/*
+ * Snapshot files hold the raw getsockopt() output of each source so that
+ * they can be printed or compared later, possibly on another machine of
+ * the same byte order:
+ *
+ *	struct snapshot_header
+ *	nr_sources * { struct snapshot_source, len bytes of records }
+ */
+#define SNAPSHOT_MAGIC		"RDSSNAP"
+#define SNAPSHOT_VERSION	1
+
+struct snapshot_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	nr_sources;
+	uint64_t	sec;
+	uint32_t	usec;
+	uint32_t	reserved;
+};
+
+struct snapshot_source {
+	uint32_t	opt_val;
+	uint32_t	each;
+	uint32_t	len;
+	uint32_t	reserved;
+};
+
+static void save_snapshot(const char *path, int given_options)
 {
-	return paddr(AF_INET, &addr);
+	struct snapshot_header hdr = { SNAPSHOT_MAGIC, SNAPSHOT_VERSION };
+	struct snapshot_source src;
+	struct timeval tv;
+	FILE *file;
+	int i;
+
+	file = fopen(path, "w");
+	if (file == NULL) {
+		verbosef(0, stderr, "%s: Unable to create %s: %s\n",
+			 progname, path, strerror(errno));
+		exit(1);
+	}
+
+	gettimeofday(&tv, NULL);
+	hdr.sec = tv.tv_sec;
+	hdr.usec = tv.tv_usec;
+	for (i = 0; i < array_size(infos); i++) {
+		if (selected(&infos[i], given_options) &&
+		    fetch_info(&infos[i]) == 0)
+			hdr.nr_sources++;
+		else
+			infos[i].buf.each = 0;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, file) != 1)
+		goto failed;
+
+	for (i = 0; i < array_size(infos); i++) {
+		if (!infos[i].buf.each)
+			continue;
+		memset(&src, 0, sizeof(src));
+		src.opt_val = infos[i].opt_val;
+		src.each = infos[i].buf.each;
+		src.len = infos[i].buf.len;
+		if (fwrite(&src, sizeof(src), 1, file) != 1 ||
+		    fwrite(infos[i].buf.data, 1, src.len, file) != src.len)
+			goto failed;
+		verbosef(1, stderr, "%s: saved %u %s\n", progname,
+			 src.len / src.each, infos[i].description);
+	}
+
+	if (fclose(file))
+		goto failed;
+	return;
+
+failed:
+	verbosef(0, stderr, "%s: Unable to write %s: %s\n",
+		 progname, path, strerror(errno));
+	exit(1);
 }
 
-static const char *ipv6addr(const void *addr)
+static struct info *info_by_opt_val(uint32_t opt_val)
 {
-	return paddr(AF_INET6, addr);
+	int i;
+
+	for (i = 0; i < array_size(infos); i++) {
+		if (infos[i].opt_val && infos[i].opt_val == opt_val)
+			return &infos[i];
+	}
+	return NULL;
 }
 
-static void print_counters(void *data, int each, socklen_t len, void *extra)
+enum {
+	SNAP_CURRENT,
+	SNAP_PREVIOUS,
+	SNAP_REPLAY,
+};
+
+static struct rds_info_buf *snapshot_buf(struct info *info, int slot)
 {
-	struct rds_info_counter ctr;
+	switch (slot) {
+	case SNAP_PREVIOUS:
+		return &info->prev;
+	case SNAP_REPLAY:
+		return &info->replay;
+	default:
+		return &info->buf;
+	}
+}
+
+/*
+ * Read a snapshot into the given buffer of each source and return the
+ * time it was taken. Sources missing from the file are left empty.
+ */
+static double load_snapshot(const char *path, int slot)
+{
+	struct snapshot_header hdr;
+	struct snapshot_source src;
+	struct info *info;
+	struct rds_info_buf *buf;
+	void *data;
+	FILE *file;
+	uint32_t i;
+
+	file = fopen(path, "r");
+	if (file == NULL) {
+		verbosef(0, stderr, "%s: Unable to open %s: %s\n",
+			 progname, path, strerror(errno));
+		exit(1);
+	}
+	if (fread(&hdr, sizeof(hdr), 1, file) != 1 ||
+	    memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) ||
+	    hdr.version != SNAPSHOT_VERSION) {
+		verbosef(0, stderr, "%s: %s is not an rds-info snapshot\n",
+			 progname, path);
+		exit(1);
+	}
+
+	for (i = 0; i < array_size(infos); i++) {
+		buf = snapshot_buf(&infos[i], slot);
+		buf->each = buf->len = 0;
+	}
+
+	for (i = 0; i < hdr.nr_sources; i++) {
+		if (fread(&src, sizeof(src), 1, file) != 1)
+			goto truncated;
+
+		info = info_by_opt_val(src.opt_val);
+		if (src.each && src.len % src.each) {
+			verbosef(0, stderr, "%s: %s has a partial record in "
+				 "source %u\n", progname, path, src.opt_val);
+			exit(1);
+		}
+		if (info == NULL || src.each == 0) {
+			verbosef(1, stderr, "%s: skipping unknown source %u "
+				 "in %s\n", progname, src.opt_val, path);
+			if (fseek(file, src.len, SEEK_CUR))
+				goto truncated;
+			continue;
+		}
 
-	printf("\nCounters:\n%25s %16s\n", "CounterName", "Value");
+		buf = snapshot_buf(info, slot);
+		if (src.len > buf->size) {
+			data = realloc(buf->data, src.len);
+			if (data == NULL) {
+				verbosef(0, stderr, "%s: Unable to allocate "
+					 "memory for %u bytes of info: %s\n",
+					 progname, src.len, strerror(errno));
+				exit(1);
+			}
+			buf->data = data;
+			buf->size = src.len;
+		}
+		if (fread(buf->data, 1, src.len, file) != src.len)
+			goto truncated;
+		buf->len = src.len;
+		buf->each = src.each;
+	}
 
-	for_each(ctr, data, each, len)
-		printf("%25s %16"PRIu64"\n", ctr.name, ctr.value);
+	fclose(file);
+	return hdr.sec + hdr.usec / 1000000.0;
+
+truncated:
+	verbosef(0, stderr, "%s: %s is truncated\n", progname, path);
+	exit(1);
 }
 
-static void print_sockets(void *data, int each, socklen_t len, void *extra)
+/*
+ * Compare two snapshots, or one snapshot with the live state when only
+ * one file is given. Sources are compared with their watch mode
+ * functions, using the time between the snapshots for rates.
+ */
+static void diff_snapshots(char **paths, int given_options)
 {
-	struct rds_info_socket sk;
+	struct timeval tv;
+	double then, now;
+	int i;
+
+	then = load_snapshot(paths[0], SNAP_PREVIOUS);
+	if (paths[1])
+		now = load_snapshot(paths[1], SNAP_CURRENT);
+	else {
+		/*
+		 * Everything in the snapshot is read, the queues are needed
+		 * to tell stalled connections from idle ones
+		 */
+		for (i = 0; i < array_size(infos); i++) {
+			if (!infos[i].prev.each || fetch_info(&infos[i]))
+				infos[i].buf.each = 0;
+		}
+		gettimeofday(&tv, NULL);
+		now = tv.tv_sec + tv.tv_usec / 1000000.0;
+	}
 
-	printf("\nRDS Sockets:\n%15s %5s %15s %5s %10s %10s %8s\n",
-		"BoundAddr", "BPort", "ConnAddr", "CPort", "SndBuf",
-		"RcvBuf", "Inode");
+	watch_time = now;
+	if (opt_format == FORMAT_TEXT)
+		printf("--- %s against %s, %.2fs later ---\n", paths[0],
+		       paths[1] ? paths[1] : provider_name, now - then);
+	if (now <= then)
+		now = then + 1;
 
-	for_each(sk, data, each, len) {
-		printf("%15s %5u %15s %5u %10u %10u %8Lu\n",
-			ipv4addr(sk.bound_addr),
-			ntohs(sk.bound_port),
-			ipv4addr(sk.connected_addr),
-			ntohs(sk.connected_port),
-			sk.sndbuf, sk.rcvbuf,
-			(unsigned long long) sk.inum);
+	for (i = 0; i < array_size(infos); i++) {
+		struct info *info = &infos[i];
+		void (*diff)(struct info *info, double elapsed);
+
+		diff = info->diff ? info->diff : info->watch;
+		if (!diff || !selected(info, given_options))
+			continue;
+		if (!info->buf.each || !info->prev.each) {
+			verbosef(1, stderr, "%s: no %s in both snapshots\n",
+				 progname, info->description);
+			continue;
+		}
+		diff(info, now - then);
 	}
 }
 
-static void print_conns(void *data, int each, socklen_t len, void *extra)
+static void watch(int given_options)
 {
-	struct rds_info_connection conn;
+	double last, now, next;
+	int i;
 
-	printf("\nRDS Connections:\n%15s %15s %4s %16s %16s %4s\n",
-		"LocalAddr", "RemoteAddr", "Tos", "NextTX", "NextRX", "Flgs");
-	
-	for_each(conn, data, each, len) {
-		printf("%15s %15s %4u %16"PRIu64" %16"PRIu64" %c%c%c%c\n",
-			ipv4addr(conn.laddr),
-			ipv4addr(conn.faddr),
-			conn.tos,
-			conn.next_tx_seq,
-			conn.next_rx_seq,
-			rds_conn_flag(conn, SENDING, 's'),
-			rds_conn_flag(conn, CONNECTING, 'c'),
-			rds_conn_flag(conn, CONNECTED, 'C'),
-			rds_conn_flag(conn, ERROR, 'E'));
+	/* the first round is a plain snapshot */
+	last = now_secs();
+	for (i = 0; i < array_size(infos); i++) {
+		if (!selected(&infos[i], given_options))
+			continue;
+		if (fetch_info(&infos[i]))
+			infos[i].opt_val = 0;
+		else
+			infos[i].print(&infos[i].buf, infos[i].extra);
+	}
+	fflush(stdout);
+
+	next = last + opt_interval;
+	while (1) {
+		sleep_until(next);
+		now = now_secs();
+		next += opt_interval;
+		if (next < now)
+			next = now + opt_interval;
+
+		watch_time = time(NULL);
+		if (opt_format == FORMAT_TEXT)
+			printf("\n--- %.24s, interval %.2fs ---\n",
+				ctime(&watch_time), now - last);
+
+		for (i = 0; i < array_size(infos); i++) {
+			struct info *info = &infos[i];
+
+			if (!selected(info, given_options))
+				continue;
+
+			rotate_info(info);
+			if (fetch_info(info))
+				continue;
+
+			if (info->watch)
+				info->watch(info, now - last);
+			else
+				info->print(&info->buf, info->extra);
+		}
+		last = now;
+		fflush(stdout);
 	}
 }
 
-static void print_msgs(void *data, int each, socklen_t len, void *extra)
+/*
+ * Top mode: a full screen ranking of peers, refreshed every interval.
+ * Each round reads the connections and the three message queues and
+ * folds them into one entry per remote address, kept in an open
+ * addressing table across rounds like the queue groups.
+ */
+enum {
+	RANK_RETRANS = 0,
+	RANK_QUEUED,
+	RANK_GROWTH,
+	RANK_STALLED,
+};
+
+static int		opt_rank = RANK_QUEUED;
+
+struct peer {
+	uint32_t	faddr;
+	uint8_t		used;
+	unsigned long	round;		/* last round the peer was seen */
+	unsigned int	conns;
+	unsigned int	stalled;	/* conns with queued data and no tx */
+	uint64_t	tx_msgs;	/* send sequence advance of its conns */
+	uint64_t	send_msgs, send_bytes;
+	uint64_t	rexmit_msgs, rexmit_bytes;
+	uint64_t	recv_msgs, recv_bytes;
+	/* the previous round, if the peer was seen in it */
+	unsigned long	prev_round;
+	uint64_t	prev_send_bytes, prev_rexmit_bytes;
+	/* per second since the previous round */
+	double		tx_rate, send_rate, rexmit_rate;
+};
+
+static struct peer	*peers;
+static unsigned int	peers_size;	/* always a power of two */
+static unsigned int	peers_used;
+static unsigned long	peers_round;
+
+#define PEERS_EXPIRE	60	/* rounds a gone peer is remembered */
+
+static struct peer *peer_slot(struct peer *tbl, unsigned int size,
+			      uint32_t faddr)
 {
-	struct rds_info_message msg;
+	unsigned int i = group_hash(0, faddr, 0, 0) & (size - 1);
 
-	printf("\n%s Message Queue:\n%15s %5s %15s %5s %4s %16s %10s\n",
-		(char *)extra,
-		"LocalAddr", "LPort", "RemoteAddr", "RPort", "Tos","Seq", "Bytes");
-	
-	for_each(msg, data, each, len) {
-		printf("%15s %5u %15s %5u %4u %16"PRIu64" %10u\n",
-			ipv4addr(msg.laddr),
-			ntohs(msg.lport),
-			ipv4addr(msg.faddr),
-			ntohs(msg.fport),
-			msg.tos,
-			msg.seq, msg.len);
+	while (tbl[i].used && tbl[i].faddr != faddr)
+		i = (i + 1) & (size - 1);
+	return &tbl[i];
+}
+
+/*
+ * Move the peers seen since the given round to a new table of the given
+ * size, dropping the rest.
+ */
+static void peers_rehash(unsigned int size, unsigned long since)
+{
+	struct peer *tbl;
+	unsigned int i;
+
+	tbl = calloc(size, sizeof(*tbl));
+	if (tbl == NULL) {
+		verbosef(0, stderr, "%s: Unable to allocate memory "
+			 "for %u peers\n", progname, size);
+		exit(1);
 	}
+	peers_used = 0;
+	for (i = 0; i < peers_size; i++) {
+		if (peers[i].used && peers[i].round >= since) {
+			*peer_slot(tbl, size, peers[i].faddr) = peers[i];
+			peers_used++;
+		}
+	}
+	free(peers);
+	peers = tbl;
+	peers_size = size;
 }
 
-static void print_tcp_socks(void *data, int each, socklen_t len, void *extra)
-{		
-	struct rds_info_tcp_socket ts;
+/* forget the peers which have been gone for PEERS_EXPIRE rounds */
+static void peers_prune(void)
+{
+	unsigned int size = peers_size;
+	unsigned long since;
 
-	printf("\nTCP Connections:\n"
-		"%15s %5s %15s %5s %10s %10s %10s %10s %10s\n",
-		"LocalAddr", "LPort", "RemoteAddr", "RPort",
-		"HdrRemain", "DataRemain", "SentNxt", "ExpectUna", "SeenUna");
-	
-	for_each(ts, data, each, len) {
-		printf("%15s %5u %15s %5u %10"PRIu64" %10"PRIu64" %10u %10u %10u\n",
-			ipv4addr(ts.local_addr),
-			ntohs(ts.local_port),
-			ipv4addr(ts.peer_addr),
-			ntohs(ts.peer_port),
-			ts.hdr_rem, ts.data_rem, ts.last_sent_nxt,
-			ts.last_expected_una, ts.last_seen_una);
+	if (peers_round <= PEERS_EXPIRE)
+		return;
+	since = peers_round - PEERS_EXPIRE;
+	peers_rehash(size, since);
+	while (size > 256 && peers_used * 8 < size)
+		size /= 2;
+	if (size != peers_size)
+		peers_rehash(size, since);
+}
+
+static struct peer *peer_get(uint32_t faddr)
+{
+	struct peer *p;
+
+	if ((peers_used + 1) * 2 > peers_size)
+		peers_rehash(peers_size ? peers_size * 2 : 256, 0);
+
+	p = peer_slot(peers, peers_size, faddr);
+	if (!p->used) {
+		memset(p, 0, sizeof(*p));
+		p->used = 1;
+		p->faddr = faddr;
+		peers_used++;
+	}
+	if (p->round != peers_round) {
+		/* first record of the peer this round */
+		p->prev_round = p->round;
+		p->prev_send_bytes = p->send_bytes;
+		p->prev_rexmit_bytes = p->rexmit_bytes;
+		p->round = peers_round;
+		p->conns = p->stalled = 0;
+		p->tx_msgs = 0;
+		p->send_msgs = p->send_bytes = 0;
+		p->rexmit_msgs = p->rexmit_bytes = 0;
+		p->recv_msgs = p->recv_bytes = 0;
 	}
+	return p;
 }
 
-static void print_ib_conns(void *data, int each, socklen_t len, void *extra)
+static void top_queue(struct info *info, int which)
 {
-	struct rds_info_rdma_connection ic;
+	struct rds_info_message msg;
+	struct peer *p;
+	unsigned int i;
 
-	printf("\nRDS IB Connections:\n%15s %15s %4s %3s %32s %32s\n",
-		"LocalAddr", "RemoteAddr", "Tos", "SL", "LocalDev", "RemoteDev");
-
-	for_each(ic, data, each, len) {
-		printf("%15s %15s %4u %3u %32s %32s",
-			ipv4addr(ic.src_addr),
-			ipv4addr(ic.dst_addr),
-			ic.tos,ic.sl,
-			ipv6addr(ic.src_gid),
-			ipv6addr(ic.dst_gid));
-
-		if (opt_verbose) {
-			printf("  send_wr=%u", ic.max_send_wr);
-			printf(", recv_wr=%u", ic.max_recv_wr);
-			printf(", send_sge=%u", ic.max_send_sge);
-			printf(", rdma_mr_max=%u", ic.rdma_mr_max);
-			printf(", rdma_mr_size=%u", ic.rdma_mr_size);
-			printf(", cache_allocs=%u", ic.cache_allocs);
+	rds_info_for_each(msg, &info->buf, i) {
+		if (!filter_match(msg.laddr, msg.faddr, ntohs(msg.lport),
+				  ntohs(msg.fport), msg.tos, -1))
+			continue;
+		p = peer_get(msg.faddr);
+		switch (which) {
+		case RDS_INFO_SEND_MESSAGES:
+			p->send_msgs++;
+			p->send_bytes += msg.len;
+			break;
+		case RDS_INFO_RETRANS_MESSAGES:
+			p->rexmit_msgs++;
+			p->rexmit_bytes += msg.len;
+			break;
+		default:
+			p->recv_msgs++;
+			p->recv_bytes += msg.len;
+			break;
 		}
+	}
+}
 
-		printf("\n");
+/* Queue growth and tx rates over dt seconds, 0 for peers new this round */
+static void peer_rates(struct peer *p, double dt)
+{
+	if (p->prev_round != peers_round - 1 || dt <= 0) {
+		p->tx_rate = p->send_rate = p->rexmit_rate = 0;
+		return;
 	}
+	p->tx_rate = p->tx_msgs / dt;
+	p->send_rate = ((double)p->send_bytes - p->prev_send_bytes) / dt;
+	p->rexmit_rate = ((double)p->rexmit_bytes - p->prev_rexmit_bytes) / dt;
 }
 
-struct info {
-	int opt_val;
-	char *description;
-	void (*print)(void *data, int each, socklen_t len, void *extra);
-	void *extra;
-	int option_given;
-};
+static double peer_key(const struct peer *p)
+{
+	switch (opt_rank) {
+	case RANK_RETRANS:
+		return p->rexmit_rate;
+	case RANK_GROWTH:
+		return p->send_rate + p->rexmit_rate;
+	case RANK_STALLED:
+		return p->stalled;
+	default:
+		return p->send_bytes + p->rexmit_bytes;
+	}
+}
 
-struct info infos[] = {
-	['c'] = { RDS_INFO_COUNTERS, "statistic counters",
-		print_counters, NULL, 0 },
-	['k'] = { RDS_INFO_SOCKETS, "sockets", 
-		print_sockets, NULL, 0 },
-	['n'] = { RDS_INFO_CONNECTIONS, "connections",
-		print_conns, NULL, 0 },
-	['r'] = { RDS_INFO_RECV_MESSAGES, "recv queue messages",
-		print_msgs, "Receive", 0 },
-	['s'] = { RDS_INFO_SEND_MESSAGES, "send queue messages",
-		print_msgs, "Send", 0 },
-	['t'] = { RDS_INFO_RETRANS_MESSAGES, "retransmit queue messages",
-		  print_msgs, "Retransmit", 0 },
-	['T'] = { RDS_INFO_TCP_SOCKETS, "TCP transport sockets",
-		  print_tcp_socks, NULL, 0 },
-	['I'] = { RDS_INFO_IB_CONNECTIONS, "IB transport connections",
-		  print_ib_conns, NULL, 0 },
+static int peer_cmp(const void *a, const void *b)
+{
+	const struct peer *x = *(const struct peer * const *)a;
+	const struct peer *y = *(const struct peer * const *)b;
+	double kx = peer_key(x), ky = peer_key(y);
+
+	if (kx != ky)
+		return kx < ky ? 1 : -1;
+	if (x->send_bytes + x->rexmit_bytes != y->send_bytes + y->rexmit_bytes)
+		return x->send_bytes + x->rexmit_bytes <
+		       y->send_bytes + y->rexmit_bytes ? 1 : -1;
+	return ntohl(x->faddr) < ntohl(y->faddr) ? -1 : 1;
+}
+
+static unsigned int screen_rows(void)
+{
+	struct winsize ws;
+
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0)
+		return ws.ws_row;
+	return 24;
+}
+
+static const struct column top_cols[] = {
+	{ "time",		NULL,		0, COL_NOTEXT },
+	{ "faddr",		"RemoteAddr",	15 },
+	{ "conns",		"Conns",	6 },
+	{ "stalled",		"Stall",	6 },
+	{ "tx_rate",		"Tx/s",		8 },
+	{ "send_msgs",		"SendQ",	8 },
+	{ "send_bytes",		"SendBytes",	12 },
+	{ "send_bytes_rate",	"SendB/s",	10 },
+	{ "rexmit_msgs",	"RexmitQ",	8 },
+	{ "rexmit_bytes",	"RexmitBytes",	12 },
+	{ "rexmit_bytes_rate",	"RexmitB/s",	10 },
+	{ "recv_msgs",		"RecvQ",	8 },
+	{ "recv_bytes",		"RecvBytes",	12 },
 };
 
-static void print_usage(int rc)
+static void top(void)
 {
-	FILE *output = rc ? stderr : stdout;
-	int i;
+	static const int queues[] = {
+		RDS_INFO_SEND_MESSAGES,
+		RDS_INFO_RETRANS_MESSAGES,
+		RDS_INFO_RECV_MESSAGES,
+	};
+	static const struct rds_info_buf none;
+	const struct rds_info_buf *bufs[array_size(queues)];
+	struct info *conns = &infos['n'];
+	struct rds_info_connection *cur = NULL, *old = NULL, *queued;
+	struct peer **rank = NULL, *p;
+	size_t nr_cur, nr_old = 0, nr_queued, j, k;
+	unsigned int i, n, rows, shown;
+	double now, next, last = 0;
+	char caption[128];
 
-	fprintf(stderr, "rds-info version %s\n", RDS_VERSION);
+	if (!opt_interval)
+		opt_interval = 1;
+	next = now_secs();
 
-	verbosef(0, output, "The following options limit output to the given "
-		 "sources:\n");
+	while (1) {
+		sleep_until(next);
+		now = now_secs();
+		next += opt_interval;
+		if (next < now)
+			next = now + opt_interval;
+		peers_round++;
+		watch_time = time(NULL);
 
-	for (i = 0; i < array_size(infos); i++) {
-		if (!infos[i].opt_val)
-			continue;
-		printf("    -%c %s\n", i, infos[i].description);
-	}
+		for (i = 0; i < array_size(queues); i++) {
+			struct info *info = info_by_opt_val(queues[i]);
 
-	verbosef(0, output,
-		"\n\nIf no options are given then all sources are used.\n");
-	exit(rc);
+			if (fetch_info(info) == 0) {
+				top_queue(info, queues[i]);
+				bufs[i] = &info->buf;
+			} else
+				bufs[i] = &none;
+		}
+		queued = queued_conns(bufs[0], bufs[1], &nr_queued);
+
+		/*
+		 * connections, and whether those with queued data moved
+		 * their send sequence
+		 */
+		if (fetch_info(conns))
+			exit(1);
+		cur = sorted_conns(&conns->buf, &nr_cur);
+		for (j = 0, k = 0; j < nr_cur; j++) {
+			if (!filter_match(cur[j].laddr, cur[j].faddr, -1, -1,
+					  cur[j].tos, cur[j].flags |
+					  cur[j].transport[15]))
+				continue;
+			p = peer_get(cur[j].faddr);
+			p->conns++;
+			while (k < nr_old && conn_key_cmp(&old[k], &cur[j]) < 0)
+				k++;
+			if (k == nr_old || conn_key_cmp(&old[k], &cur[j]))
+				continue;
+			/* a sequence going backwards is a reset, not traffic */
+			if (cur[j].next_tx_seq > old[k].next_tx_seq)
+				p->tx_msgs += cur[j].next_tx_seq -
+					      old[k].next_tx_seq;
+			else if (old[k].next_tx_seq == cur[j].next_tx_seq &&
+				 bsearch(&cur[j], queued, nr_queued,
+					 sizeof(*queued), conn_key_cmp))
+				p->stalled++;
+		}
+		free(queued);
+		free(old);
+		old = cur;
+		nr_old = nr_cur;
+
+		/* rank the peers seen this round */
+		rank = realloc(rank, peers_size * sizeof(*rank));
+		if (rank == NULL) {
+			verbosef(0, stderr, "%s: Unable to allocate memory "
+				 "for %u peers\n", progname, peers_size);
+			exit(1);
+		}
+		for (i = 0, n = 0; i < peers_size; i++) {
+			p = &peers[i];
+			if (!p->used || p->round != peers_round)
+				continue;
+			peer_rates(p, last ? now - last : 0);
+			rank[n++] = p;
+		}
+		qsort(rank, n, sizeof(*rank), peer_cmp);
+		last = now;
+
+		/* the caption and header take five lines */
+		if (opt_top)
+			rows = opt_top;
+		else {
+			rows = screen_rows();
+			rows = rows > 6 ? rows - 5 : 1;
+		}
+		shown = rows < n ? rows : n;
+
+		if (opt_format == FORMAT_TEXT)
+			printf("\033[H\033[2J");
+		snprintf(caption, sizeof(caption),
+			 "%.24s, %u peers, %zu connections",
+			 ctime(&watch_time), n, nr_cur);
+		table_begin("peers", caption, top_cols, array_size(top_cols));
+		for (i = 0; i < shown; i++) {
+			p = rank[i];
+			table_u64(watch_time);
+			table_str(ipv4addr(p->faddr));
+			table_u64(p->conns);
+			table_u64(p->stalled);
+			table_u64((uint64_t)p->tx_rate);
+			table_u64(p->send_msgs);
+			table_u64(p->send_bytes);
+			table_s64((int64_t)p->send_rate);
+			table_u64(p->rexmit_msgs);
+			table_u64(p->rexmit_bytes);
+			table_s64((int64_t)p->rexmit_rate);
+			table_u64(p->recv_msgs);
+			table_u64(p->recv_bytes);
+			table_end_row();
+		}
+		fflush(stdout);
+
+		/* the ranking points into the table, prune after printing */
+		if (peers_round % PEERS_EXPIRE == 0)
+			peers_prune();
+	}
 }
 
 int main(int argc, char **argv)
 {
-	char optstring[258] = "v+";
+	char optstring[258] = "v+w:F:P";
 	int given_options = 0;
-	socklen_t len = 0;
-	void *data = NULL;
-	int fd;
-	int each;
+	int opt_peers = 0;
+	char *save_path = NULL;
+	char *diff_paths[2] = { NULL, NULL };
+	char *load_path = NULL;
 	int c;
 	char *last;
 	int i;
-	int pf;
-	int sol;
 
 	/* quickly append all our info options to the optstring */
 	last = &optstring[strlen(optstring)];
@@ -293,11 +2595,120 @@ int main(int argc, char **argv)
 		*last = '\0';
 	}
 
-	while ((c = getopt(argc, argv, optstring)) != EOF) {
+	while ((c = getopt_long(argc, argv, optstring, long_options,
+				NULL)) != EOF) {
 		switch (c) {
 		case 'v':
 			opt_verbose++;
 			continue;
+		case 'w': {
+			char *endptr;
+
+			opt_interval = strtod(optarg, &endptr);
+			if (*endptr || opt_interval <= 0) {
+				verbosef(0, stderr, "%s: Invalid interval "
+					 "'%s'\n", progname, optarg);
+				print_usage(1);
+			}
+			continue;
+		}
+		case 'F':
+			if (!parse_filter(optarg)) {
+				verbosef(0, stderr, "%s: Invalid filter "
+					 "\'%s\'\n", progname, optarg);
+				print_usage(1);
+			}
+			continue;
+		case OPT_FORMAT:
+			if (!strcmp(optarg, "text"))
+				opt_format = FORMAT_TEXT;
+			else if (!strcmp(optarg, "json"))
+				opt_format = FORMAT_JSON;
+			else if (!strcmp(optarg, "csv"))
+				opt_format = FORMAT_CSV;
+			else {
+				verbosef(0, stderr, "%s: Unknown format "
+					 "\'%s\'\n", progname, optarg);
+				print_usage(1);
+			}
+			continue;
+		case OPT_GROUP:
+			if (!strcmp(optarg, "conn"))
+				opt_group = GROUP_CONN;
+			else if (!strcmp(optarg, "port"))
+				opt_group = GROUP_PORT;
+			else {
+				verbosef(0, stderr, "%s: Unknown grouping "
+					 "\'%s\'\n", progname, optarg);
+				print_usage(1);
+			}
+			continue;
+		case 'P':
+			opt_peers = 1;
+			continue;
+		case OPT_RANK:
+			if (!strcmp(optarg, "retrans"))
+				opt_rank = RANK_RETRANS;
+			else if (!strcmp(optarg, "queued"))
+				opt_rank = RANK_QUEUED;
+			else if (!strcmp(optarg, "growth"))
+				opt_rank = RANK_GROWTH;
+			else if (!strcmp(optarg, "stalled"))
+				opt_rank = RANK_STALLED;
+			else {
+				verbosef(0, stderr, "%s: Unknown ranking "
+					 "\'%s\'\n", progname, optarg);
+				print_usage(1);
+			}
+			continue;
+		case OPT_RESOURCES:
+			opt_resources = 1;
+			if (optarg) {
+				char *endptr;
+
+				opt_mr_warn = strtoul(optarg, &endptr, 0);
+				if (*endptr || !*optarg) {
+					verbosef(0, stderr, "%s: Invalid "
+						 "percentage \'%s\'\n",
+						 progname, optarg);
+					print_usage(1);
+				}
+			}
+			continue;
+		case OPT_LOAD:
+			load_path = optarg;
+			continue;
+		case OPT_SYNTHETIC:
+			if (!parse_synthetic(optarg)) {
+				verbosef(0, stderr, "%s: Invalid synthetic "
+					 "snapshot \'%s\'\n", progname, optarg);
+				print_usage(1);
+			}
+			provider = synth_fetch;
+			provider_name = "synthetic state";
+			continue;
+		case OPT_SAVE:
+			save_path = optarg;
+			continue;
+		case OPT_DIFF:
+			if (diff_paths[1]) {
+				verbosef(0, stderr, "%s: --diff takes at most "
+					 "two snapshots\n", progname);
+				print_usage(1);
+			}
+			diff_paths[diff_paths[0] ? 1 : 0] = optarg;
+			continue;
+		case OPT_TOP: {
+			char *endptr;
+
+			opt_top = strtoul(optarg, &endptr, 0);
+			if (*endptr || !*optarg) {
+				verbosef(0, stderr, "%s: Invalid count "
+					 "\'%s\'\n", progname, optarg);
+				print_usage(1);
+			}
+			continue;
+		}
 		}
 
 		if (c >= array_size(infos) || !infos[c].opt_val) {
@@ -310,54 +2721,44 @@ int main(int argc, char **argv)
 		given_options++;
 	}
 
-#ifdef DYNAMIC_PF_RDS
-	pf = discover_pf_rds();
-	sol = discover_sol_rds();
-#else
-	pf = PF_RDS;
-	sol = SOL_RDS;
-#endif
-	fd = socket(pf, SOCK_SEQPACKET, 0);
-	if (fd < 0) {
-		verbosef(0, stderr, "%s: Unable to create socket: %s\n",
-			 progname, strerror(errno));
-		return 1;
+	/* two snapshots can be compared without RDS loaded */
+	if (diff_paths[1]) {
+		diff_snapshots(diff_paths, given_options);
+		return 0;
+	}
+
+	if (load_path) {
+		load_snapshot(load_path, SNAP_REPLAY);
+		provider = replay_fetch;
+		provider_name = load_path;
+	} else if (!provider)
+		live_open();
+
+	if (save_path) {
+		save_snapshot(save_path, given_options);
+		return 0;
+	}
+
+	if (diff_paths[0]) {
+		diff_snapshots(diff_paths, given_options);
+		return 0;
 	}
 
+	if (opt_peers)
+		top();
+
+	if (opt_interval)
+		watch(given_options);
+
 	for (i = 0; i < array_size(infos); i++) {
-		int invalid_opt = 0;
-		if (!infos[i].opt_val ||
-		    (given_options && !infos[i].option_given))
+		if (!selected(&infos[i], given_options))
 			continue;
 
 		/* read in the info until we get a full snapshot */
-		while ((each = getsockopt(fd, sol, infos[i].opt_val, data,
-				   &len)) < 0) {
-			if (errno != ENOSPC) {
-				verbosef(0, stderr,
-					 "%s: Unable get statistics: %s\n",
-					 progname, strerror(errno));
-				invalid_opt = 1;
-				break;
-			}
-			if (data)
-				data = realloc(data, len);
-			else
-				data = malloc(len);
-
-			if (data == NULL) {
-				verbosef(0, stderr,
-					 "%s: Unable to allocate memory "
-					 "for %u bytes of info: %s\n",
-					 progname, len, strerror(errno));
-				return 1;
-			}
-		}
-
-		if (invalid_opt)
+		if (fetch_info(&infos[i]))
 			continue;
 
-		infos[i].print(data, each, len, infos[i].extra);
+		infos[i].print(&infos[i].buf, infos[i].extra);
 
 		if (given_options && --given_options == 0)
 			break;
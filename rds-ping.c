@@ -49,7 +49,13 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
 #include "rds.h"
+#include "librds.h"
 
 #include "pfhack.h"
 
@@ -69,27 +75,106 @@ static unsigned long	opt_count;
 static struct in_addr	opt_srcaddr;
 static struct in_addr	opt_dstaddr;
 static unsigned long	opt_tos = 0;
+static unsigned long	tos_list[256] = { 0 };		/* -Q a,b,... */
+static unsigned int	ntos = 1;
+static int		opt_flood;
+static unsigned long	opt_outstanding;		/* window, 0: default */
+static struct timeval	opt_timeout = { 1, 0 };		/* flood only */
+static unsigned long	opt_size;
+static unsigned long	opt_size_max;			/* size sweep */
+static unsigned long	opt_size_step;			/* 0: double */
+static const char	*opt_monitor;			/* output file */
+static struct timeval	opt_window = { 60, 0 };		/* monitor only */
+static struct timeval	opt_period = { 10, 0 };		/* monitor only */
+static double		opt_max_loss = -1;		/* percent */
+static double		opt_max_p99 = -1;		/* usec */
 
 /* For reasons of simplicity, RDS ping does not use a packet
  * payload that is being echoed, the way ICMP does.
  * Instead, we open a number of sockets on different ports, and
  * match packet sequence numbers with ports.
+ *
+ * Each packet in flight thus needs a port of its own: the window of
+ * outstanding packets (-l) sets the size of the port pool.
  */
 #define NSOCKETS	8	
+#define MAX_OUTSTANDING	8192
+#define MAX_SIZE	(1024 * 1024)
+
+/* Pings may carry a payload, which is discarded by the peer; the pong
+ * is always empty. */
+static char		*payload;
 
 struct socket {
 	int fd;
 	unsigned int sent_id;
-	struct timeval sent_ts;
+	uint64_t sent_ns;
 	unsigned int nreplies;
+	int pending;
+};
+
+/* Round trip times of all replies, in nanoseconds, for the summary */
+struct rtt_stats {
+	uint64_t	*ns;
+	unsigned long	nr, size;
+	unsigned long	sent;
+};
+
+static struct rtt_stats	rtt;
+static uint64_t		start_ns;
+
+/* A sweep probes many destinations over one pool of sockets per source
+ * address and TOS. Replies are matched by the socket they arrive on and
+ * their source address. With several TOS values, there is a dest per
+ * destination and TOS, grouped by destination. */
+struct dest {
+	struct in_addr	addr;
+	const char	*name;
+	unsigned int	tos;		/* index into tos_list */
+	unsigned int	pool;		/* source address * ntos + tos */
+	uint64_t	*sent_ns;	/* per socket, 0: no reply pending */
+	struct rtt_stats rtt;
+	uint32_t	*window;	/* rtt in ns by round, 0: no reply */
+	int		alert;		/* monitor thresholds exceeded */
 };
 
+static struct dest	*dests;
+static unsigned int	ndests;
+
+/* In monitor mode the sweep runs until interrupted, and every period
+ * reports on the rounds within the window that are done waiting for
+ * their replies. */
+static struct {
+	FILE		*file;
+	unsigned long	nslots;		/* rounds kept */
+	uint64_t	*round_ns;	/* send time by round */
+	uint64_t	*scratch;
+} mon;
+
+static volatile sig_atomic_t	interrupted;
+static volatile sig_atomic_t	reopen;
 
+
+static unsigned int ping_loop(void);
 static int	do_ping(void);
-static void	report_packet(struct socket *sp, const struct timeval *now,
+static int	do_sweep(void);
+static int	do_size_sweep(void);
+static int	parse_size(const char *ptr);
+static int	parse_thresholds(const char *ptr);
+static int	parse_tos_list(const char *ptr);
+static void	expand_tos(void);
+static void	monitor_open(void);
+static void	monitor_report(unsigned long round, uint64_t now);
+static void	add_dest(const char *name);
+static void	read_dests(const char *path);
+static void	report_packet(struct socket *sp, uint64_t now,
 			const struct in_addr *from, int err);
+static void	report_summary(void);
+static void	print_stats_header(const char *what);
+static int	print_stats(const char *label, struct rtt_stats *st);
 static void	usage(const char *complaint);
 static int	rds_socket(struct in_addr *src, struct in_addr *dst);
+static void	reserve_fds(unsigned int nr);
 static int	parse_timeval(const char *, struct timeval *);
 static int	parse_long(const char *ptr, unsigned long *);
 static int	parse_addr(const char *ptr, struct in_addr *);
@@ -99,7 +184,7 @@ main(int argc, char **argv)
 {
 	int c;
 
-	while ((c = getopt(argc, argv, "c:i:I:Q:")) != -1) {
+	while ((c = getopt(argc, argv, "c:fF:i:I:l:M:Q:r:s:T:w:W:")) != -1) {
 		switch (c) {
 		case 'c':
 			if (!parse_long(optarg, &opt_count))
@@ -117,41 +202,185 @@ main(int argc, char **argv)
 			break;
 
 		case 'Q':
-			if (!parse_long(optarg, &opt_tos))
+			if (!parse_tos_list(optarg))
 				die("Bad tos <%s>\n", optarg);
 			break;
+
+		case 'f':
+			opt_flood = 1;
+			break;
+
+		case 'l':
+			if (!parse_long(optarg, &opt_outstanding) ||
+			    opt_outstanding == 0 ||
+			    opt_outstanding > MAX_OUTSTANDING)
+				die("Bad number of outstanding packets <%s>\n",
+				    optarg);
+			break;
+
+		case 'W':
+			if (!parse_timeval(optarg, &opt_timeout))
+				die("Bad timeout <%s>\n", optarg);
+			break;
+
+		case 'F':
+			read_dests(optarg);
+			break;
+
+		case 's':
+			if (!parse_size(optarg))
+				die("Bad payload size <%s>\n", optarg);
+			break;
+
+		case 'M':
+			opt_monitor = optarg;
+			break;
+
+		case 'w':
+			if (!parse_timeval(optarg, &opt_window) ||
+			    (!opt_window.tv_sec && !opt_window.tv_usec))
+				die("Bad window <%s>\n", optarg);
+			break;
+
+		case 'r':
+			if (!parse_timeval(optarg, &opt_period) ||
+			    (!opt_period.tv_sec && !opt_period.tv_usec))
+				die("Bad report period <%s>\n", optarg);
+			break;
+
+		case 'T':
+			if (!parse_thresholds(optarg))
+				die("Bad thresholds <%s>\n", optarg);
+			break;
 		default:
 			usage("Unknown option");
 		}
 	}
 
-	if (optind + 1 != argc)
+	for (; optind < argc; optind++)
+		add_dest(argv[optind]);
+	if (ndests == 0)
 		usage("Missing destination address");
-	if (!parse_addr(argv[optind], &opt_dstaddr))
-		die("Cannot parse destination address <%s>\n", argv[optind]);
 
+	payload = malloc(opt_size_max > opt_size ? opt_size_max : opt_size);
+	if (!payload)
+		die_errno("Cannot allocate payload");
+	memset(payload, 0xa5, opt_size_max > opt_size ? opt_size_max : opt_size);
+
+	if (ndests > 1 || ntos > 1 || opt_monitor) {
+		if (opt_flood)
+			die("Flood mode takes a single destination and tos\n");
+		if (opt_size_max)
+			die("A size sweep takes a single destination and tos\n");
+		if (ntos > 1)
+			expand_tos();
+		return do_sweep();
+	}
+
+	opt_dstaddr = dests[0].addr;
+	if (opt_size_max)
+		return do_size_sweep();
 	return do_ping();
 }
 
-/* returns a - b in usecs */
-static inline long
-usec_sub(const struct timeval *a, const struct timeval *b)
+static inline uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t
+tv_ns(const struct timeval *tv)
+{
+	return (uint64_t) tv->tv_sec * 1000000000ULL + tv->tv_usec * 1000ULL;
+}
+
+static void
+sigint_handler(int sig)
+{
+	interrupted = 1;
+}
+
+static void
+sighup_handler(int sig)
+{
+	reopen = 1;
+}
+
+static void
+record_rtt(struct rtt_stats *st, uint64_t ns)
 {
-	return ((long)(a->tv_sec - b->tv_sec) * 1000000UL) + a->tv_usec - b->tv_usec;
+	if (st->nr == st->size) {
+		st->size = st->size ? st->size * 2 : 16;
+		st->ns = realloc(st->ns, st->size * sizeof(*st->ns));
+		if (!st->ns)
+			die_errno("Cannot allocate memory for round trip times");
+	}
+	st->ns[st->nr++] = ns;
 }
 
 static int
-do_ping(void)
+send_probe(struct socket *sp, const struct sockaddr_in *sin, uint64_t now)
+{
+	int err = 0;
+
+	if (sendto(sp->fd, payload, opt_size, 0,
+		   (struct sockaddr *) sin, sizeof(*sin)) < 0)
+		err = errno;
+	sp->sent_id = ++rtt.sent;
+	sp->sent_ns = now;
+	sp->nreplies = 0;
+	if (!err)
+		sp->pending = 1;
+
+	if (err) {
+		static unsigned int nerrs = 0;
+
+		report_packet(sp, 0, NULL, err);
+		if (err == EINVAL && nerrs++ == 0)
+			printf("      Maybe your kernel does not support rds ping yet\n");
+	}
+	return err;
+}
+
+/* Send packets of opt_size bytes until the count is reached or we are
+ * interrupted, collecting round trip times in rtt. Returns the number
+ * of replies. */
+static unsigned int
+ping_loop(void)
 {
 	struct sockaddr_in sin;
-	unsigned int	sent = 0, recv = 0;
-	struct timeval	next_ts;
-	struct socket	socket[NSOCKETS];
-	struct pollfd	pfd[NSOCKETS];
-	int             pending[NSOCKETS];
+	unsigned int	recv = 0, outstanding = 0;
+	unsigned int	nsockets = NSOCKETS;
+	unsigned int	window;
+	uint64_t	next_ns, now;
+	uint64_t	wait_ns = tv_ns(&opt_wait);
+	uint64_t	timeout_ns = tv_ns(&opt_timeout);
+	struct socket	*socket;
+	struct pollfd	*pfd;
 	int		i, next = 0;
 
-	for (i = 0; i < NSOCKETS; ++i) {
+	/* A socket per packet in flight. Flood mode sends one packet at
+	 * a time by default, but keeps a few spare sockets so that
+	 * duplicate replies can be told apart. */
+	if (opt_flood) {
+		window = opt_outstanding ? opt_outstanding : 1;
+		if (window > nsockets)
+			nsockets = window;
+	} else {
+		window = nsockets = opt_outstanding ? opt_outstanding : NSOCKETS;
+	}
+	reserve_fds(nsockets);
+
+	socket = calloc(nsockets, sizeof(*socket));
+	pfd = calloc(nsockets, sizeof(*pfd));
+	if (!socket || !pfd)
+		die_errno("Cannot allocate sockets");
+
+	for (i = 0; i < nsockets; ++i) {
 		int fd;
 
 		fd = rds_socket(&opt_srcaddr, &opt_dstaddr);
@@ -159,19 +388,19 @@ do_ping(void)
 		socket[i].fd = fd;
 		pfd[i].fd = fd;
 		pfd[i].events = POLLIN;
-		pending[i] = 0;
 	}
 
 	memset(&sin, 0, sizeof(sin));
 	sin.sin_family = AF_INET;
 	sin.sin_addr = opt_dstaddr;
 
-	gettimeofday(&next_ts, NULL);
-	while (1) {
-		struct timeval	now;
+	signal(SIGINT, sigint_handler);
+
+	start_ns = next_ns = now_ns();
+	while (!interrupted) {
 		struct sockaddr_in from;
 		socklen_t	alen = sizeof(from);
-		long		deadline;
+		uint64_t	deadline;
 		int		ret;
 
 		/* Fast way out - if we have received all packets, bail now.
@@ -180,41 +409,68 @@ do_ping(void)
 		if (opt_count && recv >= opt_count)
 			break;
 
-		gettimeofday(&now, NULL);
-		if (timercmp(&now, &next_ts, >=)) {
-			struct socket *sp = &socket[next];
-			int err = 0;
-
-			if (opt_count && sent >= opt_count)
-				break;
-
-			timeradd(&now, &opt_wait, &next_ts);
-			if (!pending[next]) {
-				memset(&sin, 0, sizeof(sin));
-				sin.sin_family = AF_INET;
-				sin.sin_addr = opt_dstaddr;
-
-				if (sendto(sp->fd, NULL, 0, 0, (struct sockaddr *) &sin, sizeof(sin)))
-					err = errno;
-				sp->sent_id = ++sent;
-				sp->sent_ts = now;
-				sp->nreplies = 0;
-				if (!err)
-					pending[next] = 1;
-				next = (next + 1) % NSOCKETS;
+		now = now_ns();
+		if (opt_flood) {
+			/* Give up on packets that took too long. Their
+			 * socket is replaced so that a late reply can't be
+			 * taken for the reply to a later packet. */
+			deadline = timeout_ns;
+			for (i = 0; i < nsockets; ++i) {
+				struct socket *sp = &socket[i];
+
+				if (!sp->pending)
+					continue;
+				if (now - sp->sent_ns < timeout_ns) {
+					if (sp->sent_ns + timeout_ns - now < deadline)
+						deadline = sp->sent_ns + timeout_ns - now;
+					continue;
+				}
+				close(sp->fd);
+				sp->fd = pfd[i].fd = rds_socket(&opt_srcaddr,
+								&opt_dstaddr);
+				sp->pending = 0;
+				outstanding--;
 			}
 
-			if (err) {
-				static unsigned int nerrs = 0;
+			while (outstanding < window &&
+			       !(opt_count && rtt.sent >= opt_count)) {
+				while (socket[next].pending)
+					next = (next + 1) % nsockets;
+				if (send_probe(&socket[next], &sin, now))
+					break;
+				next = (next + 1) % nsockets;
+				outstanding++;
+			}
 
-				report_packet(sp, NULL, NULL, err);
-				if (err == EINVAL && nerrs++ == 0)
-					printf("      Maybe your kernel does not support rds ping yet\n");
+			if (opt_count && rtt.sent >= opt_count && !outstanding)
+				break;
+		} else {
+			if (now >= next_ns) {
+				struct socket *sp = &socket[next];
+
+				if (opt_count && rtt.sent >= opt_count)
+					break;
+
+				/* Sockets are used round robin, so this one
+				 * carries the oldest packet. Rather than
+				 * stall behind it, give it up and replace the
+				 * socket, as flood mode does on timeout. */
+				if (sp->pending) {
+					close(sp->fd);
+					sp->fd = pfd[next].fd =
+						rds_socket(&opt_srcaddr,
+							   &opt_dstaddr);
+					sp->pending = 0;
+				}
+
+				next_ns = now + wait_ns;
+				send_probe(sp, &sin, now);
+				next = (next + 1) % nsockets;
 			}
+			deadline = next_ns - now;
 		}
 
-		deadline = usec_sub(&next_ts, &now);
-		ret = poll(pfd, NSOCKETS, deadline / 1000);
+		ret = poll(pfd, nsockets, deadline / 1000000);
 		if (ret < 0) {
 			if (errno == EINTR)
 				continue;
@@ -223,7 +479,7 @@ do_ping(void)
 		if (ret == 0)
 			continue;
 
-		for (i = 0; i < NSOCKETS; ++i) {
+		for (i = 0; i < nsockets; ++i) {
 			struct socket *sp = &socket[i];
 
 			if (!(pfd[i].revents & POLLIN))
@@ -231,31 +487,97 @@ do_ping(void)
 
 			ret = recvfrom(sp->fd, NULL, 0, MSG_DONTWAIT,
 					(struct sockaddr *) &from, &alen);
-			gettimeofday(&now, NULL);
+			now = now_ns();
 
 			if (ret < 0) {
 				if (errno != EAGAIN &&
 				    errno != EINTR)
-					report_packet(sp, &now, NULL, errno);
-			} else {
-				report_packet(sp, &now, &from.sin_addr, 0);
-				pending[i] = 0;
-				recv++;
+					report_packet(sp, now, NULL, errno);
+				continue;
 			}
+
+			/* duplicates are shown, but only count once */
+			if (!sp->pending) {
+				if (!opt_flood && !opt_size_max)
+					report_packet(sp, now, &from.sin_addr, 0);
+				continue;
+			}
+
+			record_rtt(&rtt, now - sp->sent_ns);
+			if (!opt_flood && !opt_size_max)
+				report_packet(sp, now, &from.sin_addr, 0);
+			else
+				sp->nreplies++;
+			outstanding--;
+			sp->pending = 0;
+			recv++;
 		}
 	}
 
+	for (i = 0; i < nsockets; ++i)
+		close(socket[i].fd);
+	free(socket);
+	free(pfd);
+
+	return recv;
+}
+
+static int
+do_ping(void)
+{
+	unsigned int recv;
+
+	recv = ping_loop();
+	report_summary();
+
 	/* Program exit code: signal success if we received any response. */
 	return recv == 0;
 }
 
+/*
+ * Ping with each payload size from opt_size to opt_size_max in turn,
+ * quietly, and print a line of statistics per size.
+ */
+static int
+do_size_sweep(void)
+{
+	unsigned long	size, last = opt_size_max;
+	unsigned int	sizes = 0, answered = 0;
+	uint64_t	sweep_ns = now_ns();
+
+	if (!opt_count)
+		opt_count = 10;
+
+	print_stats_header("Size");
+	for (size = opt_size; size <= last && !interrupted; ) {
+		char label[16];
+
+		rtt.nr = rtt.sent = 0;
+		opt_size = size;
+		ping_loop();
+
+		snprintf(label, sizeof(label), "%lu", size);
+		answered += print_stats(label, &rtt);
+		sizes++;
+
+		if (opt_size_step)
+			size += opt_size_step;
+		else
+			size = size ? size * 2 : 1;
+	}
+	printf("\n%u sizes, %u answered, times in usec, sweep took %.0fms\n",
+	       sizes, answered, (now_ns() - sweep_ns) / 1e6);
+
+	return answered != sizes;
+}
+
 static void
-report_packet(struct socket *sp, const struct timeval *now,
+report_packet(struct socket *sp, uint64_t now,
 		const struct in_addr *from_addr, int err)
 {
 	printf(" %3u:", sp->sent_id);
 	if (now)
-		printf(" %ld usec", usec_sub(now, &sp->sent_ts));
+		printf(" %lu usec", (unsigned long) ((now - sp->sent_ns) / 1000));
 	if (from_addr && from_addr->s_addr != opt_dstaddr.s_addr)
 		printf(" (%s)", inet_ntoa(*from_addr));
 	if (sp->nreplies)
@@ -268,56 +590,647 @@ report_packet(struct socket *sp, const struct timeval *now,
 }
 
 static int
-rds_socket(struct in_addr *src, struct in_addr *dst)
+cmp_u64(const void *a, const void *b)
 {
-	struct sockaddr_in sin;
-	int fd;
-	int pf;
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Sort the round trip times and return their mean and mean deviation,
+ * in usec. */
+static void
+rtt_finish(struct rtt_stats *st, double *avg, double *mdev)
+{
+	double sum = 0, sum2 = 0, var;
+	unsigned long i;
+
+	for (i = 0; i < st->nr; ++i) {
+		double us = st->ns[i] / 1e3;
+
+		sum += us;
+		sum2 += us * us;
+	}
+	*avg = sum / st->nr;
+	var = sum2 / st->nr - *avg * *avg;
+	*mdev = var > 0 ? sqrt(var) : 0;
+
+	qsort(st->ns, st->nr, sizeof(*st->ns), cmp_u64);
+}
+
+/* nearest rank percentile of the sorted round trip times, in usec */
+static double
+rtt_percentile(const struct rtt_stats *st, double pct)
+{
+	unsigned long rank = (unsigned long) ceil(pct / 100 * st->nr);
+
+	return st->ns[rank ? rank - 1 : 0] / 1e3;
+}
+
+static void
+report_summary(void)
+{
+	double avg, mdev;
+
+	printf("\n--- %s rds-ping statistics ---\n", inet_ntoa(opt_dstaddr));
+	printf("%lu packets transmitted, %lu received, %.1f%% packet loss, "
+	       "time %.0fms\n", rtt.sent, rtt.nr,
+	       rtt.sent ? (rtt.sent - rtt.nr) * 100.0 / rtt.sent : 0,
+	       (now_ns() - start_ns) / 1e6);
+	if (!rtt.nr)
+		return;
+
+	rtt_finish(&rtt, &avg, &mdev);
+	printf("rtt min/avg/max/mdev = %.3f/%.3f/%.3f/%.3f usec\n",
+	       rtt.ns[0] / 1e3, avg, rtt.ns[rtt.nr - 1] / 1e3, mdev);
+	printf("rtt p50/p99/p99.9 = %.3f/%.3f/%.3f usec\n",
+	       rtt_percentile(&rtt, 50), rtt_percentile(&rtt, 99),
+	       rtt_percentile(&rtt, 99.9));
+}
+
+static void
+add_dest(const char *name)
+{
+	struct in_addr addr;
+	unsigned int i;
+
+	if (!parse_addr(name, &addr))
+		die("Cannot parse destination address <%s>\n", name);
+
+	for (i = 0; i < ndests; ++i) {
+		if (dests[i].addr.s_addr == addr.s_addr)
+			return;
+	}
+
+	if ((ndests & (ndests - 1)) == 0) {
+		dests = realloc(dests, (ndests ? ndests * 2 : 1) * sizeof(*dests));
+		if (!dests)
+			die_errno("Cannot allocate memory for destinations");
+	}
+	memset(&dests[ndests], 0, sizeof(dests[ndests]));
+	dests[ndests].addr = addr;
+	dests[ndests].name = strdup(name);
+	ndests++;
+}
+
+/* One destination per line; blank lines and # comments are skipped */
+static void
+read_dests(const char *path)
+{
+	char line[256], *p, *end;
+	FILE *file;
+
+	file = fopen(path, "r");
+	if (!file)
+		die_errno("Cannot open %s", path);
+
+	while (fgets(line, sizeof(line), file)) {
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+		for (p = line; *p == ' ' || *p == '\t'; p++)
+			;
+		for (end = p; *end && *end != ' ' && *end != '\t' &&
+			      *end != '\n'; end++)
+			;
+		*end = '\0';
+		if (*p)
+			add_dest(p);
+	}
+	fclose(file);
+}
+
+/* Probe every destination with every TOS */
+static void
+expand_tos(void)
+{
+	struct dest *targets;
+	unsigned int i, t;
+
+	targets = calloc(ndests * ntos, sizeof(*targets));
+	if (!targets)
+		die_errno("Cannot allocate memory for destinations");
+	for (i = 0; i < ndests; ++i) {
+		for (t = 0; t < ntos; ++t) {
+			targets[i * ntos + t] = dests[i];
+			targets[i * ntos + t].tos = t;
+		}
+	}
+	free(dests);
+	dests = targets;
+	ndests *= ntos;
+}
+
+static int
+dest_cmp(const void *a, const void *b)
+{
+	const struct dest *x = *(const struct dest * const *) a;
+	const struct dest *y = *(const struct dest * const *) b;
+
+	if (x->addr.s_addr != y->addr.s_addr)
+		return ntohl(x->addr.s_addr) < ntohl(y->addr.s_addr) ? -1 : 1;
+	return x->tos < y->tos ? -1 : x->tos > y->tos;
+}
+
+static void
+print_stats_header(const char *what)
+{
+	printf("%-15s %6s %6s %6s %10s %10s %10s %10s %10s %10s\n",
+	       what, "Sent", "Recv", "Loss%", "Min", "Avg", "Max",
+	       "Mdev", "P50", "P99");
+}
+
+/* One row of a sweep table; returns whether there were any replies */
+static int
+print_stats(const char *label, struct rtt_stats *st)
+{
+	double avg, mdev;
+
+	printf("%-15s %6lu %6lu %6.1f", label, st->sent, st->nr, st->sent ?
+	       (st->sent - st->nr) * 100.0 / st->sent : 0);
+	if (!st->nr) {
+		printf("\n");
+		return 0;
+	}
+	rtt_finish(st, &avg, &mdev);
+	printf(" %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+	       st->ns[0] / 1e3, avg, st->ns[st->nr - 1] / 1e3, mdev,
+	       rtt_percentile(st, 50), rtt_percentile(st, 99));
+	return 1;
+}
+
+/* Median round trip time and loss per destination and TOS */
+static unsigned int
+report_tos_matrix(void)
+{
+	unsigned int i, t, reachable = 0;
+	double avg, mdev;
+
+	printf("%-15s", "");
+	for (t = 0; t < ntos; ++t)
+		printf("  %9s %-6lu", "tos", tos_list[t]);
+	printf("\n%-15s", "Destination");
+	for (t = 0; t < ntos; ++t)
+		printf("  %9s %6s", "P50", "Loss%");
+	printf("\n");
+
+	for (i = 0; i < ndests; i += ntos) {
+		printf("%-15s", inet_ntoa(dests[i].addr));
+		for (t = 0; t < ntos; ++t) {
+			struct rtt_stats *st = &dests[i + t].rtt;
+			double loss = st->sent ?
+				(st->sent - st->nr) * 100.0 / st->sent : 0;
+
+			if (!st->nr) {
+				printf("  %9s %6.1f", "-", loss);
+				continue;
+			}
+			reachable++;
+			rtt_finish(st, &avg, &mdev);
+			printf("  %9.1f %6.1f", rtt_percentile(st, 50), loss);
+		}
+		printf("\n");
+	}
+	return reachable;
+}
+
+static void
+report_sweep(void)
+{
+	unsigned int i, reachable = 0;
+
+	if (ntos > 1) {
+		reachable = report_tos_matrix();
+		printf("\n%u destinations, %u tos values, %u of %u pairs "
+		       "reachable, times in usec, sweep took %.0fms\n",
+		       ndests / ntos, ntos, reachable, ndests,
+		       (now_ns() - start_ns) / 1e6);
+		return;
+	}
+
+	print_stats_header("Destination");
+	for (i = 0; i < ndests; ++i)
+		reachable += print_stats(inet_ntoa(dests[i].addr),
+					 &dests[i].rtt);
+	printf("\n%u destinations, %u reachable, times in usec, "
+	       "sweep took %.0fms\n", ndests, reachable,
+	       (now_ns() - start_ns) / 1e6);
+}
+
+/* A socket of the pool for the given source address and TOS index */
+static int
+pool_socket(struct in_addr *src, unsigned int tos)
+{
+	opt_tos = tos_list[tos];
+	/* the source is known, so there is no route to look up */
+	return rds_socket(src, src);
+}
+
+/*
+ * Probe every destination once per interval, count times, sending all
+ * of a round's probes from one socket of its pool, whose size is the
+ * window (-l). Destinations are grouped into pools by the source
+ * address of their route, or -I, and TOS. A destination can thus have
+ * a window's worth of probes in flight; a probe still unanswered when
+ * its socket comes round again is counted as lost, and the socket is
+ * replaced so that its reply can't be taken for the newer probe's.
+ */
+static int
+do_sweep(void)
+{
+	struct sockaddr_in sin, from;
+	struct pollfd	*pfd;
+	struct in_addr	*srcs;
+	struct dest	**by_addr, key, *kp = &key, **found, *d;
+	uint64_t	now, next_ns, end_ns = 0, deadline;
+	uint64_t	wait_ns = tv_ns(&opt_wait);
+	uint64_t	timeout_ns = tv_ns(&opt_timeout);
+	uint64_t	period_ns = tv_ns(&opt_period), report_ns = 0;
+	unsigned long	count = opt_count ? opt_count : 3, round = 0;
+	unsigned long	*sock_round;
+	unsigned int	nsockets = opt_outstanding ? opt_outstanding : NSOCKETS;
+	unsigned int	*sock_pending;	/* probes waiting, per pool socket */
+	unsigned int	nsrcs = 0, npools;
+	unsigned int	i, p, pending = 0, answered = 0;
+	int		ret;
+
+	if (opt_monitor) {
+		if (!opt_count)
+			count = ~0UL;
+		monitor_open();
+	}
+
+	/* The source addresses in use, each with a pool per TOS */
+	srcs = calloc(ndests, sizeof(*srcs));
+	if (!srcs)
+		die_errno("Cannot allocate memory for destinations");
+	for (i = 0; i < ndests; ++i) {
+		struct in_addr src = opt_srcaddr;
+
+		d = &dests[i];
+		if (src.s_addr == 0 && rds_route_source(&src, &d->addr))
+			die_errno("unable to find a route to %s",
+				  inet_ntoa(d->addr));
+		for (p = 0; p < nsrcs; ++p) {
+			if (srcs[p].s_addr == src.s_addr)
+				break;
+		}
+		if (p == nsrcs)
+			srcs[nsrcs++] = src;
+		d->pool = p * ntos + d->tos;
+	}
+	npools = nsrcs * ntos;
+
+	/* nsockets apart */
+	pfd = calloc(npools * nsockets, sizeof(*pfd));
+	sock_pending = calloc(npools * nsockets, sizeof(*sock_pending));
+	sock_round = calloc(nsockets, sizeof(*sock_round));
+	if (!pfd || !sock_pending || !sock_round)
+		die_errno("Cannot allocate sockets");
+	reserve_fds(npools * nsockets);
+	for (i = 0; i < npools * nsockets; ++i) {
+		p = i / nsockets;
+		pfd[i].fd = pool_socket(&srcs[p / ntos], p % ntos);
+		pfd[i].events = POLLIN;
+	}
+	for (i = 0; i < ndests; ++i) {
+		dests[i].sent_ns = calloc(nsockets, sizeof(*dests[i].sent_ns));
+		if (!dests[i].sent_ns)
+			die_errno("Cannot allocate memory for destinations");
+	}
+
+	by_addr = malloc(ndests * sizeof(*by_addr));
+	if (!by_addr)
+		die_errno("Cannot allocate memory for destinations");
+	for (i = 0; i < ndests; ++i)
+		by_addr[i] = &dests[i];
+	qsort(by_addr, ndests, sizeof(*by_addr), dest_cmp);
 
 	memset(&sin, 0, sizeof(sin));
 	sin.sin_family = AF_INET;
 
+	signal(SIGINT, sigint_handler);
+	if (opt_monitor) {
+		signal(SIGTERM, sigint_handler);
+		signal(SIGHUP, sighup_handler);
+	}
+
+	start_ns = next_ns = now_ns();
+	report_ns = start_ns + period_ns;
+	while (!interrupted) {
+		now = now_ns();
+		if (opt_monitor && now >= report_ns) {
+			monitor_report(round, now);
+			report_ns += period_ns;
+			if (report_ns < now)
+				report_ns = now + period_ns;
+		}
+
+		if (round < count && now >= next_ns) {
+			unsigned int sock = round % nsockets;
+
+			sock_round[sock] = round;
+			if (opt_monitor)
+				mon.round_ns[round % mon.nslots] = now;
+
+			/* replies to the probes it still waits for are late */
+			for (p = 0; p < npools; ++p) {
+				struct pollfd *pp = &pfd[p * nsockets + sock];
+
+				if (!sock_pending[p * nsockets + sock])
+					continue;
+				close(pp->fd);
+				pp->fd = pool_socket(&srcs[p / ntos], p % ntos);
+				sock_pending[p * nsockets + sock] = 0;
+			}
+
+			for (i = 0; i < ndests; ++i) {
+				d = &dests[i];
+				if (d->sent_ns[sock]) {
+					d->sent_ns[sock] = 0;
+					pending--;
+				}
+
+				sin.sin_addr = d->addr;
+				d->rtt.sent++;
+				if (opt_monitor)
+					d->window[round % mon.nslots] = 0;
+				if (sendto(pfd[d->pool * nsockets + sock].fd,
+					   payload, opt_size, 0,
+					   (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+					if (d->rtt.sent == 1)
+						printf("%s: ERROR: %s\n", d->name,
+						       strerror(errno));
+					continue;
+				}
+				d->sent_ns[sock] = now_ns();
+				sock_pending[d->pool * nsockets + sock]++;
+				pending++;
+			}
+
+			next_ns += wait_ns;
+			if (next_ns < now)
+				next_ns = now + wait_ns;
+			if (++round == count)
+				end_ns = now_ns() + timeout_ns;
+			continue;
+		}
+
+		if (round == count && (!pending || now >= end_ns))
+			break;
+
+		deadline = round < count ? next_ns : end_ns;
+		if (opt_monitor && report_ns < deadline)
+			deadline = report_ns;
+		deadline = deadline > now ? deadline - now : 0;
+		ret = poll(pfd, npools * nsockets, (deadline + 999999) / 1000000);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			die_errno("poll");
+		}
+
+		for (i = 0; ret > 0 && i < npools * nsockets; ++i) {
+			unsigned int sock = i % nsockets;
+
+			if (!(pfd[i].revents & POLLIN))
+				continue;
+
+			while (1) {
+				socklen_t alen = sizeof(from);
+				uint64_t ns;
+
+				if (recvfrom(pfd[i].fd, NULL, 0, MSG_DONTWAIT,
+					     (struct sockaddr *) &from,
+					     &alen) < 0)
+					break;
+				now = now_ns();
+
+				/* late replies and duplicates are dropped */
+				key.addr = from.sin_addr;
+				key.tos = i / nsockets % ntos;
+				found = bsearch(&kp, by_addr, ndests,
+						sizeof(*by_addr), dest_cmp);
+				if (!found || (*found)->pool != i / nsockets ||
+				    !(*found)->sent_ns[sock])
+					continue;
+				d = *found;
+				ns = now - d->sent_ns[sock];
+				d->sent_ns[sock] = 0;
+				sock_pending[i]--;
+				pending--;
+				if (opt_monitor) {
+					/*
+					 * Past the timeout the round may have
+					 * been reported, or its slot handed to
+					 * a newer round: count it as lost.
+					 */
+					if (ns > timeout_ns ||
+					    round - sock_round[sock] > mon.nslots)
+						continue;
+					d->rtt.nr++;
+					d->window[sock_round[sock] % mon.nslots] =
+						ns < 1 ? 1 : ns > UINT32_MAX ?
+						UINT32_MAX : ns;
+				} else
+					record_rtt(&d->rtt, ns);
+			}
+		}
+	}
+
+	if (opt_monitor) {
+		monitor_report(round, now_ns());
+		return 0;
+	}
+
+	report_sweep();
+
+	/* Succeed only if every destination answered */
+	for (i = 0; i < ndests; ++i)
+		answered += dests[i].rtt.nr > 0;
+	return answered != ndests;
+}
+
+/* Monitor output goes to a file, "-" being stdout, reopened on SIGHUP
+ * for log rotation. Slots are allocated for the rounds in the window
+ * plus those still waiting for replies. */
+static void
+monitor_open(void)
+{
+	uint64_t wait_ns = tv_ns(&opt_wait);
+	unsigned int i;
+
+	if (!strcmp(opt_monitor, "-"))
+		mon.file = stdout;
+	else if (!(mon.file = fopen(opt_monitor, "a")))
+		die_errno("Cannot open %s", opt_monitor);
+	setvbuf(mon.file, NULL, _IOLBF, 0);
+
+	mon.nslots = (tv_ns(&opt_window) + tv_ns(&opt_timeout)) / wait_ns + 2;
+	mon.round_ns = calloc(mon.nslots, sizeof(*mon.round_ns));
+	mon.scratch = calloc(mon.nslots, sizeof(*mon.scratch));
+	if (!mon.round_ns || !mon.scratch)
+		die_errno("Cannot allocate monitor window");
+	for (i = 0; i < ndests; ++i) {
+		dests[i].window = calloc(mon.nslots, sizeof(*dests[i].window));
+		if (!dests[i].window)
+			die_errno("Cannot allocate monitor window");
+	}
+}
+
+/* Monitor lines name the TOS when probing with several */
+static const char *
+tos_label(const struct dest *d)
+{
+	static char label[16];
+
+	if (ntos == 1)
+		return "";
+	snprintf(label, sizeof(label), " tos=%lu", tos_list[d->tos]);
+	return label;
+}
+
+static void
+monitor_event(const char *stamp, struct dest *d, int alert,
+	      double loss, double p99)
+{
+	char line[256];
+
+	snprintf(line, sizeof(line), "%s %s%s %s loss=%.1f%% p99=%.1f\n",
+		 stamp, inet_ntoa(d->addr), tos_label(d),
+		 alert ? "ALERT" : "CLEAR", loss, p99);
+	fputs(line, mon.file);
+	if (mon.file != stdout)
+		fputs(line, stderr);
+	d->alert = alert;
+}
+
+/*
+ * Print a line per destination with the loss and round trip times, in
+ * usec, of the rounds sent within the window that are settled, i.e.
+ * that were sent at least the reply timeout ago, and raise or clear
+ * alerts against the thresholds.
+ */
+static void
+monitor_report(unsigned long round, uint64_t now)
+{
+	uint64_t window_ns = tv_ns(&opt_window);
+	uint64_t timeout_ns = tv_ns(&opt_timeout);
+	unsigned long first, last, r, nr, sent;
+	struct rtt_stats st;
+	struct timeval tv;
+	char stamp[32];
+	unsigned int i;
+
+	if (reopen) {
+		reopen = 0;
+		if (mon.file != stdout &&
+		    !freopen(opt_monitor, "a", mon.file))
+			die_errno("Cannot reopen %s", opt_monitor);
+		setvbuf(mon.file, NULL, _IOLBF, 0);
+	}
+
+	/* newest settled round, then the oldest one within the window */
+	for (last = round; last > 0; last--) {
+		if (now - mon.round_ns[(last - 1) % mon.nslots] >= timeout_ns)
+			break;
+	}
+	for (first = last; first > 0 && last - first < mon.nslots; first--) {
+		if (now - mon.round_ns[(first - 1) % mon.nslots] >
+		    window_ns + timeout_ns)
+			break;
+	}
+	sent = last - first;
+
+	gettimeofday(&tv, NULL);
+	snprintf(stamp, sizeof(stamp), "%ld.%03ld", (long) tv.tv_sec,
+		 (long) tv.tv_usec / 1000);
+
+	for (i = 0; i < ndests; ++i) {
+		struct dest *d = &dests[i];
+		double avg = 0, mdev = 0, loss, p99 = 0;
+
+		for (r = first, nr = 0; r < last; r++) {
+			if (d->window[r % mon.nslots])
+				mon.scratch[nr++] = d->window[r % mon.nslots];
+		}
+
+		st.ns = mon.scratch;
+		st.nr = nr;
+		loss = sent ? (sent - nr) * 100.0 / sent : 0;
+		fprintf(mon.file, "%s %s%s sent=%lu recv=%lu loss=%.1f%%",
+			stamp, inet_ntoa(d->addr), tos_label(d), sent, nr,
+			loss);
+		if (nr) {
+			rtt_finish(&st, &avg, &mdev);
+			p99 = rtt_percentile(&st, 99);
+			fprintf(mon.file, " min=%.1f avg=%.1f p50=%.1f"
+				" p99=%.1f max=%.1f", st.ns[0] / 1e3, avg,
+				rtt_percentile(&st, 50), p99,
+				st.ns[nr - 1] / 1e3);
+		}
+		fprintf(mon.file, "\n");
+
+		if (!sent)
+			continue;
+		if ((opt_max_loss >= 0 && loss > opt_max_loss) ||
+		    (opt_max_p99 >= 0 && nr && p99 > opt_max_p99)) {
+			if (!d->alert)
+				monitor_event(stamp, d, 1, loss, p99);
+		} else if (d->alert)
+			monitor_event(stamp, d, 0, loss, p99);
+	}
+}
+
+/* Large windows can take more sockets than the default descriptor limit */
+static void
+reserve_fds(unsigned int nr)
+{
+	struct rlimit rlim;
+
+	if (getrlimit(RLIMIT_NOFILE, &rlim))
+		die_errno("getrlimit");
+
+	nr += 16;	/* stdio and friends */
+	if (rlim.rlim_cur != RLIM_INFINITY && rlim.rlim_cur < nr) {
+		rlim.rlim_cur = nr;
+		if (setrlimit(RLIMIT_NOFILE, &rlim))
+			die_errno("Cannot open %u sockets for the window", nr - 16);
+	}
+}
+
+static int
+rds_socket(struct in_addr *src, struct in_addr *dst)
+{
+	struct rds_sock_conf conf = { .tos = opt_tos };
+	struct sockaddr_in sin;
+	struct rds_sock rs;
+	int pf, sol;
+
 #ifdef DYNAMIC_PF_RDS
         pf = discover_pf_rds();
+        sol = discover_sol_rds();
 #else
         pf = PF_RDS;
+        sol = SOL_RDS;
 #endif
-	fd = socket(pf, SOCK_SEQPACKET, 0);
-	if (fd < 0)
-		die_errno("unable to create RDS socket");
 
 	/* Guess the local source addr if not given. */
-	if (src->s_addr == 0) {
-		socklen_t alen;
-		int ufd;
-
-		ufd = socket(PF_INET, SOCK_DGRAM, 0);
-		if (ufd < 0)
-			die_errno("unable to create UDP socket");
-		sin.sin_addr = *dst;
-		sin.sin_port = htons(1);
-		if (connect(ufd, (struct sockaddr *) &sin, sizeof(sin)) < 0)
-			die_errno("unable to connect to %s",
-					inet_ntoa(*dst));
-
-		alen = sizeof(sin);
-		if (getsockname(ufd, (struct sockaddr *) &sin, &alen) < 0)
-			die_errno("getsockname failed");
-
-		*src = sin.sin_addr;
-		close(ufd);
-	}
+	if (src->s_addr == 0 && rds_route_source(src, dst))
+		die_errno("unable to find a route to %s", inet_ntoa(*dst));
 
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
 	sin.sin_addr = *src;
 	sin.sin_port = 0;
 
-	if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)))
-		die_errno("bind() failed");
+	/* RDS refuses messages larger than half the send buffer */
+	conf.sndbuf = opt_size_max > opt_size ? opt_size_max : opt_size;
 
-	if (opt_tos && ioctl(fd, SIOCRDSSETTOS, &opt_tos)) 
-		die_errno("ERROR: failed to set TOS\n");
+	if (rds_sock_open(&rs, pf, sol, &sin, &conf))
+		die_errno("unable to set up RDS socket on %s",
+			  inet_ntoa(*src));
 
-	return fd;
+	return rs.fd;
 }
 
 static void
@@ -326,11 +1239,26 @@ usage(const char *complaint)
         fprintf(stderr, "rds-ping version %s\n", RDS_VERSION);
 
 	fprintf(stderr,
-		"%s\nUsage: rds-ping [options] dst_addr\n"
+		"%s\nUsage: rds-ping [options] dst_addr [dst_addr...]\n"
 		"Options:\n"
 		" -c count      limit packet count\n"
+		" -i interval   time between packets\n"
 		" -I interface  source IP address\n"
-		" -Q tos	type of service\n",
+		" -Q tos[,tos]  type of service; a list probes with each\n"
+		" -f            flood: send as soon as replies come back\n"
+		" -l count      packets in flight, one port each (default 8,\n"
+		"               1 in flood mode)\n"
+		" -W timeout    time to wait for a reply in flood mode,\n"
+		"               or for the last replies of a sweep\n"
+		" -F file       read destinations from file, one per line\n"
+		" -s size       payload size, or min:max[:step] to sweep\n"
+		"               sizes (doubling unless a step is given)\n"
+		" -M file       monitor: probe until interrupted, reporting\n"
+		"               to file (- for stdout) every period\n"
+		" -w window     monitor: time covered by a report (default 60s)\n"
+		" -r period     monitor: time between reports (default 10s)\n"
+		" -T loss=pct,p99=usec\n"
+		"               monitor: raise alerts above these thresholds\n",
 		complaint);
 	exit(1);
 }
@@ -359,6 +1287,89 @@ parse_timeval(const char *ptr, struct timeval *ret)
 	return 1;
 }
 
+/* size, or min:max[:step] for a sweep that doubles the size by default */
+static int
+parse_size(const char *ptr)
+{
+	char buf[64], *max, *step;
+
+	if (strlen(ptr) >= sizeof(buf))
+		return 0;
+	strcpy(buf, ptr);
+
+	if ((max = strchr(buf, ':')) != NULL) {
+		*max++ = '\0';
+		if ((step = strchr(max, ':')) != NULL) {
+			*step++ = '\0';
+			if (!parse_long(step, &opt_size_step) || !opt_size_step)
+				return 0;
+		}
+		if (!parse_long(max, &opt_size_max) ||
+		    opt_size_max > MAX_SIZE)
+			return 0;
+	}
+
+	if (!parse_long(buf, &opt_size) || opt_size > MAX_SIZE)
+		return 0;
+	return !max || opt_size <= opt_size_max;
+}
+
+/* tos[,tos...] */
+static int
+parse_tos_list(const char *ptr)
+{
+	char buf[1024], *tok;
+	unsigned long tos;
+	unsigned int i;
+
+	if (strlen(ptr) >= sizeof(buf))
+		return 0;
+	strcpy(buf, ptr);
+
+	ntos = 0;
+	for (tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+		if (!parse_long(tok, &tos) || tos > 255)
+			return 0;
+		for (i = 0; i < ntos && tos_list[i] != tos; ++i)
+			;
+		if (i == ntos)
+			tos_list[ntos++] = tos;
+	}
+	if (!ntos)
+		return 0;
+
+	opt_tos = tos_list[0];
+	return 1;
+}
+
+/* loss=pct and/or p99=usec, comma separated */
+static int
+parse_thresholds(const char *ptr)
+{
+	char buf[64], *tok, *val, *end;
+	double d;
+
+	if (strlen(ptr) >= sizeof(buf))
+		return 0;
+	strcpy(buf, ptr);
+
+	for (tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+		if (!(val = strchr(tok, '=')))
+			return 0;
+		*val++ = '\0';
+		d = strtod(val, &end);
+		if (end == val || *end || d < 0)
+			return 0;
+		if (!strcmp(tok, "loss"))
+			opt_max_loss = d;
+		else if (!strcmp(tok, "p99"))
+			opt_max_p99 = d;
+		else
+			return 0;
+	}
+	return 1;
+}
+
 static int
 parse_long(const char *ptr, unsigned long *ret)
 {
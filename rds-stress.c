@@ -1,9 +1,12 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/time.h>
+#include <stddef.h>
 #include <errno.h>
 #include <string.h>
 #include <netinet/in.h>
@@ -24,7 +27,12 @@
 #include <getopt.h>
 #include <byteswap.h>
 #include <sys/ioctl.h>
+#include <sys/utsname.h>
+#include <signal.h>
+#include <limits.h>
 #include "rds.h"
+#include "rdsinfo.h"
+#include "librds.h"
 
 #include "pfhack.h"
 
@@ -48,6 +56,14 @@ enum {
 };
 #define VERSION_MAX_LEN 16 
 
+/*
+ * 2.0.7 sent the options below up to and including async, behind its
+ * version string. We still send that layout when the newer options are
+ * not used, so 2.0.7 peers keep working.
+ */
+#define VERSION_2_0_7		"2.0.7"
+#define OPTIONS_2_0_7_SIZE	offsetof(struct options, one_way)
+
 struct options_2_0_6 {
 	uint32_t	req_depth;
 	uint32_t	req_size;
@@ -109,6 +125,8 @@ struct options {
         uint32_t        connect_retries;
         uint8_t         tos;
         uint8_t         async;
+        uint8_t         one_way;
+        uint8_t         audit;
 } __attribute__((packed));
 
 
@@ -120,6 +138,9 @@ static uint64_t         rtt_threshold;
 static int              show_histogram;
 static int		reset_connection;
 static char		peer_version[VERSION_MAX_LEN];
+static char *		result_file;
+static uint16_t		peer_port;	/* the peer's starting port */
+static double		regress_threshold = 5.0;	/* percent */
 
 static int get_bucket(uint64_t rtt_time)
 {
@@ -138,6 +159,10 @@ static int get_bucket(uint64_t rtt_time)
     }
   }
 
+  /* Anything slower than the last bucket is counted in it */
+  if (i >= MAX_BUCKETS)
+    i = MAX_BUCKETS - 1;
+
   return i;
 }
 
@@ -148,6 +173,24 @@ struct counter {
 	uint64_t	max;
 };
 
+/*
+ * Anomalies counted by --audit.  The first S_AUDIT stats counters and each
+ * struct audit_flow follow this order.
+ */
+enum {
+	A_GAP = 0,	/* messages skipped in sequence */
+	A_DUP,		/* messages seen twice */
+	A_REORDER,	/* skipped messages arriving late, or too late to tell */
+	A_BAD,		/* unexpected or malformed messages */
+	A_STALL,	/* send windows given up on */
+	A_SEND_ERR,	/* failed sends */
+	A__LAST
+};
+
+static const char *audit_names[A__LAST] = {
+	"gap", "dup", "ooo", "bad", "stall", "serr",
+};
+
 enum {
 	S_REQ_TX_BYTES = 0,
 	S_REQ_RX_BYTES,
@@ -159,7 +202,9 @@ enum {
 	S_MBUS_OUT_BYTES,
 	S_SENDMSG_USECS,
 	S_RTT_USECS,
-	S__LAST
+	S_ONEWAY_USECS,
+	S_AUDIT,
+	S__LAST = S_AUDIT + A__LAST
 };
 
 #define NR_STATS S__LAST
@@ -177,8 +222,43 @@ struct child_control {
 	struct counter cur[NR_STATS];
 	struct counter last[NR_STATS];
         uint64_t       latency_histogram[MAX_BUCKETS];
+	uint64_t	oneway_histogram[MAX_BUCKETS];
 } __attribute__((aligned (256))); /* arbitrary */
 
+/*
+ * With --one-way, messages carry the sender's CLOCK_MONOTONIC time and
+ * the receiver takes off that and the offset between the two clocks,
+ * as estimated by clock_sync(). The parent keeps the estimate up to
+ * date in shared memory while the children use it.
+ */
+struct clock_est {
+	volatile uint32_t	seq;	/* odd while being updated */
+	int64_t			offset;	/* ns, local minus peer clock at ref */
+	double			drift;	/* change in offset per ns */
+	uint64_t		ref;	/* local ns */
+	uint64_t		bound;	/* ns, error bound of the offset */
+};
+
+static struct clock_est *clock_est;
+
+/*
+ * With --audit, sequence and header anomalies are counted per flow rather
+ * than being fatal.  A flow is one of our tasks and one of the peer's; the
+ * parent shares nr_tasks * nr_tasks of these with the children, indexed by
+ * our task and then the peer's.
+ */
+struct audit_flow {
+	uint64_t	count[A__LAST];
+};
+
+static struct audit_flow *audit_flows;
+
+/* How long a request may go unanswered before --audit gives up on it */
+#define AUDIT_STALL_USECS	2000000
+
+/* How long a task waits after a failed send before --audit retries it */
+#define AUDIT_SEND_BACKOFF_MS	100
+
 struct soak_control {
 	pid_t		pid;
 	uint64_t	per_sec;
@@ -236,6 +316,15 @@ struct header {
 } __attribute__((packed));
 
 #define MIN_MSG_BYTES		(sizeof(struct header))
+
+/*
+ * With --one-way the sender's clock at sendmsg time follows the header,
+ * in network byte order, so the header and payload of other runs stay
+ * as older versions expect them.
+ */
+#define ONE_WAY_BYTES		sizeof(uint64_t)
+#define HDR_BYTES(opts)		(MIN_MSG_BYTES + \
+				 ((opts)->one_way ? ONE_WAY_BYTES : 0))
 #define BASIC_HEADER_SIZE	(size_t)(&((struct header *) 0)->rdma_op)
 
 #define print_outlier(...) do {         \
@@ -255,6 +344,9 @@ struct header {
 
 static int	mrs_allocated = 0;
 
+/* A child's RDS socket, whose MR cache serves --rdma-cache-mrs */
+static struct rds_sock	rds_sk;
+
 #define trace(fmt...) do {		\
 	if (opt.tracing)		\
 		fprintf(stderr, fmt);	\
@@ -356,6 +448,28 @@ static void usage(void)
 	" -c                measure cpu use with per-cpu soak processes\n"
 	" -V                trace execution\n"
 	" -z                print a summary at end of test only\n"
+	" --one-way         measure latency in each direction, estimating\n"
+	"                   the offset between the two hosts' clocks\n"
+	" --audit           count lost, duplicate and reordered messages per\n"
+	"                   flow and keep going, instead of exiting\n"
+	"\n"
+	"Result files:\n"
+	" --result-file [file]         write parameters and results to file\n"
+	" --compare [base] [file]      compare two result files, exit 1 on regression\n"
+	" --regress-threshold [pct, 5] allowed change before flagging a regression\n"
+	"\n"
+	"Transport:\n"
+	" --loopback                   run the passive side too, on the local\n"
+	"                              address (-r, default 127.0.0.1)\n"
+	" --transport [rds|loopback]   loopback runs over AF_UNIX sockets, without\n"
+	"                              RDS or RDMA, on both sides\n"
+	"\n"
+	"Clusters:\n"
+	" --agent                      take test plans from a coordinator on\n"
+	"                              the -r address and -p port\n"
+	" --coordinate [addr[:port],...] run every ordered pair of agents with\n"
+	"                              the other options and print matrices\n"
+	" --matrix [pairwise|all]      one pair at a time (default) or all at once\n"
 	"\n"
 	"Example:\n"
 	"  recv$ rds-stress\n"
@@ -463,9 +577,11 @@ static void decode_hdr(struct header *dst, const struct header *hdr)
 
 static void fill_hdr(void *message, uint32_t bytes, struct header *hdr)
 {
+	size_t hdr_bytes = HDR_BYTES(&opt);
+
 	encode_hdr(message, hdr);
 	if (opt.verify)
-		memcpy(message + sizeof(*hdr), msg_pattern, bytes - sizeof(*hdr));
+		memcpy(message + hdr_bytes, msg_pattern, bytes - hdr_bytes);
 }
 
 /* inet_ntoa uses a static buffer, so calling it twice in
@@ -508,6 +624,10 @@ static int check_hdr(void *message, uint32_t bytes, struct header *hdr, struct o
 		msghdr.var == hdr->var ? " =" : "!=",	\
 		disp(msghdr.var)
 
+		/* --audit counts these instead */
+		if (opts->audit)
+			return 1;
+
 		/*
 		 * This is printed as one GIANT printf() so that it serializes
 		 * with stdout() and we don't get things stomping on each
@@ -537,11 +657,15 @@ static int check_hdr(void *message, uint32_t bytes, struct header *hdr, struct o
 	}
 
 	if (opt.verify
-	 && memcmp(message + sizeof(*hdr), msg_pattern, bytes - sizeof(*hdr))) {
-		unsigned char *p = message + sizeof(*hdr);
-		unsigned int i, count = 0, total = bytes - sizeof(*hdr);
+	 && memcmp(message + HDR_BYTES(&opt), msg_pattern,
+		   bytes - HDR_BYTES(&opt))) {
+		unsigned char *p = message + HDR_BYTES(&opt);
+		unsigned int i, count = 0, total = bytes - HDR_BYTES(&opt);
 		int offset = -1;
 
+		if (opts->audit)
+			return 1;
+
 		for (i = 0; i < total; ++i) {
 			if (p[i] != msg_pattern[i]) {
 				if (offset < 0)
@@ -567,6 +691,14 @@ void stat_inc(struct counter *ctr, uint64_t val)
 	ctr->max = max(val, ctr->max);
 }
 
+static void audit_count(struct child_control *ctl, struct audit_flow *flow,
+			unsigned int kind, uint64_t nr)
+{
+	stat_inc(&ctl->cur[S_AUDIT + kind], nr);
+	if (flow)
+		flow->count[kind] += nr;
+}
+
 int64_t tv_cmp(const struct timeval *a, const struct timeval *b)
 {
 	int64_t a_usecs = ((uint64_t)a->tv_sec * 1000000ULL) + a->tv_usec;
@@ -582,6 +714,47 @@ uint64_t usec_sub(struct timeval *a, struct timeval *b)
 		a->tv_usec - b->tv_usec;
 }
 
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Local minus peer clock at local time t */
+static int64_t clock_offset(uint64_t t)
+{
+	int64_t offset;
+	double drift;
+	uint64_t ref;
+	uint32_t seq;
+
+	do {
+		seq = clock_est->seq;
+		__sync_synchronize();
+		offset = clock_est->offset;
+		drift = clock_est->drift;
+		ref = clock_est->ref;
+		__sync_synchronize();
+	} while ((seq & 1) || seq != clock_est->seq);
+
+	return offset + (int64_t) (drift * (double) (int64_t) (t - ref));
+}
+
+static void clock_update(int64_t offset, double drift, uint64_t ref,
+			 uint64_t bound)
+{
+	clock_est->seq++;
+	__sync_synchronize();
+	clock_est->offset = offset;
+	clock_est->drift = drift;
+	clock_est->ref = ref;
+	clock_est->bound = bound;
+	__sync_synchronize();
+	clock_est->seq++;
+}
+
 static int bound_socket(int domain, int type, int protocol,
 			struct sockaddr_in *sin)
 {
@@ -613,54 +786,295 @@ static uint32_t get_local_address(int fd, struct sockaddr_in *sin)
 
 static int rds_socket(struct options *opts, struct sockaddr_in *sin)
 {
+	struct rds_sock_conf conf = {
+		.tos		= opts->tos,
+		.cong_monitor	= opts->use_cong_monitor,
+		.nonblock	= 1,
+		.reuseaddr	= 1,
+	};
+	struct rds_sock *rs = &rds_sk;
 	int bytes;
-	int fd;
-	int val;
-	socklen_t optlen;
-
-	fd = bound_socket(pf, SOCK_SEQPACKET, 0, sin);
 
 	bytes = opts->nr_tasks * opts->req_depth *
 		(opts->req_size + opts->ack_size) * 2;
+	conf.sndbuf = conf.rcvbuf = bytes;
+	/* room for every RDMA buffer of every task */
+	conf.mr_cache = opts->nr_tasks * opts->req_depth;
 
-	if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes)))
-		die_errno("setsockopt(SNDBUF, %d) failed", bytes);
-	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes)))
-		die_errno("setsockopt(RCVBUF, %d) failed", bytes);
+	if (rds_sock_open(rs, pf, sol, sin, &conf))
+		die_errno("unable to set up RDS socket");
 
-	optlen = sizeof(val);
-	if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &val, &optlen))
-		die_errno("getsockopt(SNDBUF) failed");
-	if (val / 2 < bytes && !opts->suppress_warnings)
+	if (rs->sndbuf / 2 < bytes && !opts->suppress_warnings)
 		fprintf(stderr,
 			"getsockopt(SNDBUF) returned %d, we wanted %d * 2\n",
-			val, bytes);
-
-	optlen = sizeof(val);
-	if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &val, &optlen))
-		die_errno("getsockopt(RCVBUF) failed");
-	if (val / 2 < bytes && !opts->suppress_warnings)
+			rs->sndbuf, bytes);
+	if (rs->rcvbuf / 2 < bytes && !opts->suppress_warnings)
 		fprintf(stderr,
 			"getsockopt(RCVBUF) returned %d, we need %d * 2\n",
-			val, bytes);
+			rs->rcvbuf, bytes);
 
-	val = 1;
-	if (opts->use_cong_monitor
-	 && setsockopt(fd, sol, RDS_CONG_MONITOR, &val, sizeof(val))) {
-		if (errno != ENOPROTOOPT)
-			die_errno("setsockopt(RDS_CONG_MONITOR) failed");
+	if (opts->use_cong_monitor && !rs->cong_monitor) {
 		printf("Kernel does not support congestion monitoring; disabled\n");
 		opts->use_cong_monitor = 0;
 	}
 
-	fcntl(fd, F_SETFL, O_NONBLOCK);
+	return rs->fd;
+}
+
+/*
+ * The engine talks to its peers through a transport. RDS is the real
+ * thing; the loopback transport stands in for it on hosts without the
+ * RDS module, so that the userspace side of the engine can be run and
+ * measured anywhere.
+ */
+struct transport {
+	const char	*name;
+	int		(*socket)(struct options *opts, struct sockaddr_in *sin);
+	int		(*poll)(struct pollfd *pfd, nfds_t nfds, int timeout);
+	ssize_t		(*sendmsg)(int fd, const struct msghdr *msg, int flags);
+	ssize_t		(*recvmsg)(int fd, struct msghdr *msg, int flags);
+};
+
+static const struct transport rds_transport = {
+	.name		= "rds",
+	.socket		= rds_socket,
+	.poll		= poll,
+	.sendmsg	= sendmsg,
+	.recvmsg	= recvmsg,
+};
+
+/*
+ * The loopback transport carries messages over AF_UNIX datagram
+ * sockets, which are reliable and ordered like RDS. Each address and
+ * port maps to an abstract socket name. A peer whose receive queue is
+ * full makes the send fail with ENOBUFS, as a congested RDS port does,
+ * and with congestion monitoring an RDS_CMSG_CONG_UPDATE for it follows
+ * shortly. Async sends are reported complete as soon as they are
+ * queued. There is no RDMA.
+ *
+ * Each child has a single socket, so the emulation state is global.
+ */
+#define LO_CONG_RETRY_MIN	50	/* usecs, doubling while congested */
+#define LO_CONG_RETRY_MAX	1000
+
+static struct {
+	uint64_t	cong_mask;	/* ports that returned ENOBUFS */
+	struct timeval	cong_since;
+	unsigned int	cong_retry;	/* usecs until the update */
+	uint64_t	*done;		/* completed async send tokens */
+	unsigned int	nr_done, max_done;
+} lo;
+
+static socklen_t lo_addr(struct sockaddr_un *sun, const struct sockaddr_in *sin)
+{
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	/* sun_path[0] stays 0 for the abstract namespace */
+	return offsetof(struct sockaddr_un, sun_path) + 1 +
+		snprintf(sun->sun_path + 1, sizeof(sun->sun_path) - 1,
+			 "rds-stress/%08x:%u", ntohl(sin->sin_addr.s_addr),
+			 ntohs(sin->sin_port));
+}
+
+static void lo_sin(struct sockaddr_in *sin, const struct sockaddr_un *sun)
+{
+	unsigned int addr, port;
+
+	if (sscanf(sun->sun_path + 1, "rds-stress/%x:%u", &addr, &port) != 2)
+		die("loopback message from unknown socket\n");
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(addr);
+	sin->sin_port = htons(port);
+}
+
+static int lo_socket(struct options *opts, struct sockaddr_in *sin)
+{
+	struct sockaddr_un sun;
+	socklen_t alen;
+	int bytes;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (fd < 0)
+		die_errno("socket(AF_UNIX, SOCK_DGRAM) failed");
+
+	alen = lo_addr(&sun, sin);
+	if (bind(fd, (struct sockaddr *) &sun, alen))
+		die_errno("bind() failed");
+
+	bytes = opts->nr_tasks * opts->req_depth *
+		(opts->req_size + opts->ack_size) * 2;
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes));
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes));
 
-	if (opts->tos && ioctl(fd, SIOCRDSSETTOS, &opts->tos)) 
-		die_errno("ERROR: failed to set TOS\n");
+	fcntl(fd, F_SETFL, O_NONBLOCK);
 
 	return fd;
 }
 
+static int lo_cong_due(struct timeval *now)
+{
+	return lo.cong_mask && usec_sub(now, &lo.cong_since) >= lo.cong_retry;
+}
+
+/* Pending notifications make the socket readable */
+static int lo_poll(struct pollfd *pfd, nfds_t nfds, int timeout)
+{
+	struct timespec ts;
+	struct timeval now;
+	int ret;
+
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (timeout % 1000) * 1000000;
+	if (lo.nr_done) {
+		ts.tv_sec = ts.tv_nsec = 0;
+	} else if (lo.cong_mask) {
+		ts.tv_sec = 0;
+		ts.tv_nsec = lo.cong_retry * 1000;
+	}
+
+	ret = ppoll(pfd, nfds, &ts, NULL);
+	if (ret < 0)
+		return ret;
+
+	gettimeofday(&now, NULL);
+	if (lo.nr_done || lo_cong_due(&now)) {
+		if (!pfd[0].revents)
+			ret++;
+		pfd[0].revents |= POLLIN;
+	}
+	return ret;
+}
+
+static ssize_t lo_sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+	struct rds_asend_args args;
+	struct cmsghdr *cmsg;
+	struct sockaddr_un sun;
+	struct msghdr lmsg = *msg;
+	uint64_t token = 0;
+	int async = 0;
+	ssize_t ret;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR((struct msghdr *) msg, cmsg)) {
+		if (cmsg->cmsg_level != sol)
+			continue;
+		if (cmsg->cmsg_type != RDS_CMSG_ASYNC_SEND)
+			die("RDS cmsg %d not supported by the loopback transport\n",
+			    cmsg->cmsg_type);
+		memcpy(&args, CMSG_DATA(cmsg), sizeof(args));
+		token = args.user_token;
+		async = 1;
+	}
+
+	lmsg.msg_name = &sun;
+	lmsg.msg_namelen = lo_addr(&sun, msg->msg_name);
+	lmsg.msg_control = NULL;
+	lmsg.msg_controllen = 0;
+
+	ret = sendmsg(fd, &lmsg, flags | MSG_DONTWAIT);
+	if (ret < 0) {
+		if (errno == EAGAIN) {
+			const struct sockaddr_in *sin = msg->msg_name;
+
+			if (opt.use_cong_monitor) {
+				if (!lo.cong_mask) {
+					gettimeofday(&lo.cong_since, NULL);
+					lo.cong_retry = lo.cong_retry ?
+						min(2 * lo.cong_retry,
+						    LO_CONG_RETRY_MAX) :
+						LO_CONG_RETRY_MIN;
+				}
+				lo.cong_mask |= RDS_CONG_MONITOR_MASK(ntohs(sin->sin_port));
+			}
+			errno = ENOBUFS;
+		}
+		return ret;
+	}
+	lo.cong_retry = 0;
+
+	if (async) {
+		if (lo.nr_done == lo.max_done) {
+			lo.max_done = lo.max_done ? 2 * lo.max_done : 64;
+			lo.done = realloc(lo.done, lo.max_done * sizeof(*lo.done));
+			if (!lo.done)
+				die("ERROR: failed to alloc memory\n");
+		}
+		lo.done[lo.nr_done++] = token;
+	}
+	return ret;
+}
+
+/* Notifications come first, as messages without data */
+static ssize_t lo_recvmsg(int fd, struct msghdr *msg, int flags)
+{
+	struct sockaddr_un sun;
+	struct msghdr lmsg = *msg;
+	struct cmsghdr *cmsg;
+	struct timeval now;
+	size_t len = 0;
+	unsigned int i;
+	ssize_t ret;
+
+	gettimeofday(&now, NULL);
+	if (lo.nr_done || lo_cong_due(&now)) {
+		cmsg = CMSG_FIRSTHDR(msg);
+		if (lo_cong_due(&now) && cmsg) {
+			cmsg->cmsg_level = sol;
+			cmsg->cmsg_type = RDS_CMSG_CONG_UPDATE;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(lo.cong_mask));
+			memcpy(CMSG_DATA(cmsg), &lo.cong_mask, sizeof(lo.cong_mask));
+			len += CMSG_SPACE(sizeof(lo.cong_mask));
+			lo.cong_mask = 0;
+		}
+
+		for (i = 0; i < lo.nr_done; i++) {
+			struct rds_rdma_send_notify notify;
+
+			if (len + CMSG_SPACE(sizeof(notify)) > msg->msg_controllen)
+				break;
+			cmsg = (struct cmsghdr *)((char *) msg->msg_control + len);
+			notify.user_token = lo.done[i];
+			notify.status = 0;
+			cmsg->cmsg_level = sol;
+			cmsg->cmsg_type = RDS_CMSG_RDMA_SEND_STATUS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(notify));
+			memcpy(CMSG_DATA(cmsg), &notify, sizeof(notify));
+			len += CMSG_SPACE(sizeof(notify));
+		}
+		memmove(lo.done, lo.done + i, (lo.nr_done - i) * sizeof(*lo.done));
+		lo.nr_done -= i;
+
+		msg->msg_controllen = len;
+		return 0;
+	}
+
+	lmsg.msg_name = &sun;
+	lmsg.msg_namelen = sizeof(sun);
+	lmsg.msg_control = NULL;
+	lmsg.msg_controllen = 0;
+
+	ret = recvmsg(fd, &lmsg, flags);
+	if (ret < 0)
+		return ret;
+
+	lo_sin(msg->msg_name, &sun);
+	msg->msg_namelen = sizeof(struct sockaddr_in);
+	msg->msg_controllen = 0;
+	msg->msg_flags = lmsg.msg_flags;
+	return ret;
+}
+
+static const struct transport lo_transport = {
+	.name		= "loopback",
+	.socket		= lo_socket,
+	.poll		= lo_poll,
+	.sendmsg	= lo_sendmsg,
+	.recvmsg	= lo_recvmsg,
+};
+
+static const struct transport *transport = &rds_transport;
+
 static int check_rdma_support(struct options *opts)
 {
 	struct sockaddr_in sin;
@@ -696,16 +1110,18 @@ static int check_rdma_support(struct options *opts)
 static uint64_t get_rdma_key(int fd, uint64_t addr, uint32_t size)
 {
 	uint64_t cookie = 0;
-	struct rds_get_mr_args mr_args;
+	uint64_t flags;
+	int ret;
 
-	mr_args.vec.addr = addr;
-	mr_args.vec.bytes = size;
-	mr_args.cookie_addr = ptr64(&cookie);
-	mr_args.flags = RDS_RDMA_READWRITE; /* for now, always assume r/w */
+	flags = RDS_RDMA_READWRITE; /* for now, always assume r/w */
 	if (opt.rdma_use_once)
-		mr_args.flags |= RDS_RDMA_USE_ONCE;
+		flags |= RDS_RDMA_USE_ONCE;
 
-	if (setsockopt(fd, sol, RDS_GET_MR, &mr_args, sizeof(mr_args)))
+	if (opt.rdma_cache_mrs)
+		ret = rds_mr_get(&rds_sk, addr, size, flags, &cookie);
+	else
+		ret = rds_get_mr(fd, sol, addr, size, flags, &cookie);
+	if (ret)
 		die_errno("setsockopt(RDS_GET_MR) failed (%u allocated)", mrs_allocated);
 
 	trace("RDS get_rdma_key() = %Lx\n",
@@ -717,17 +1133,20 @@ static uint64_t get_rdma_key(int fd, uint64_t addr, uint32_t size)
 
 static void free_rdma_key(int fd, uint64_t key)
 {
-	struct rds_free_mr_args mr_args;
+	int ret;
 
 	trace("RDS free_rdma_key(%Lx)\n", (unsigned long long) key);
 
-	mr_args.cookie = key;
+	/* a cached key stays registered for the next request */
+	if (opt.rdma_cache_mrs)
+		ret = rds_mr_put(&rds_sk, key);
+	else
 #if 1
-	mr_args.flags = 0;
+		ret = rds_free_mr(fd, sol, key, 0);
 #else
-	mr_args.flags = RDS_FREE_MR_ARGS_INVALIDATE;
+		ret = rds_free_mr(fd, sol, key, RDS_FREE_MR_ARGS_INVALIDATE);
 #endif
-	if (setsockopt(fd, sol, RDS_FREE_MR, &mr_args, sizeof(mr_args)))
+	if (ret)
 		return;
 	mrs_allocated--;
 }
@@ -949,6 +1368,13 @@ struct task {
 	uint32_t            	last_retry_seq;
 	uint32_t		retry_index;
 
+	/* --audit: bit n is set if recv_seq - 1 - n was received */
+	uint64_t		recv_window;
+	struct timeval		last_ack;
+	struct audit_flow *	audit;
+	/* --audit: the last send failed; retry no sooner than send_retry */
+	unsigned char		send_err;
+	struct timeval		send_retry;
 
 	/* RDMA related stuff */
 	uint64_t **		local_buf;
@@ -1155,25 +1581,25 @@ static void rdma_mark_completed(struct task *tasks, uint64_t token, int status,
 #define MSG_MAXIOVLEN 2
 
 /*
- * Add a control message to the outgoing message
+ * Control messages for the outgoing message are built in a static
+ * buffer, which starts over with each message that has none yet.
  */
-static void rdma_put_cmsg(struct msghdr *msg, int type,
-			const void *ptr, size_t size)
+static struct rds_cmsg *rdma_cmsg(struct msghdr *msg)
 {
-	static char ctlbuf[1024];
-	struct cmsghdr *cmsg;
+	static struct rds_cmsg ctl;
 
-	if (!msg->msg_control) {
-		msg->msg_control = ctlbuf;
-		msg->msg_controllen = CMSG_SPACE(size);
-		cmsg = CMSG_FIRSTHDR(msg);
-	} else {
-		cmsg = (struct cmsghdr *)((char *)msg->msg_control + msg->msg_controllen);
-		msg->msg_controllen += CMSG_SPACE(size);
-	}cmsg->cmsg_level = sol;
-	cmsg->cmsg_type = type;
-	cmsg->cmsg_len = CMSG_LEN(size);
-	memcpy(CMSG_DATA(cmsg), ptr, size);
+	if (!msg->msg_control)
+		rds_cmsg_init(&ctl, sol);
+	return &ctl;
+}
+
+/* Attach what a builder just added to the outgoing message */
+static void rdma_put_cmsg(struct msghdr *msg, void *added,
+			  struct rds_cmsg *ctl)
+{
+	if (!added)
+		die_errno("too many control messages");
+	rds_cmsg_attach(ctl, msg);
 }
 
 /*
@@ -1189,6 +1615,7 @@ static void rdma_build_cmsg_xfer(struct msghdr *msg, const struct header *hdr,
 
 	static struct rds_iovec iov[RDS_MAX_IOV];
 	struct rds_rdma_args args;
+	struct rds_cmsg *ctl;
 	unsigned int rdma_size;
 	unsigned int rdma_vector;
 	unsigned int v;
@@ -1248,36 +1675,35 @@ static void rdma_build_cmsg_xfer(struct msghdr *msg, const struct header *hdr,
 	/* args.flags |= RDS_RDMA_REMOTE_COMPLETE; */
 	args.user_token = user_token;
 
-	rdma_put_cmsg(msg, RDS_CMSG_RDMA_ARGS, &args, sizeof(args));
+	ctl = rdma_cmsg(msg);
+	rdma_put_cmsg(msg, rds_cmsg_rdma_args(ctl, &args), ctl);
 }
 
 static void build_cmsg_async_send(struct msghdr *msg, uint64_t user_token)
 {
-	struct rds_asend_args  args;
+	struct rds_cmsg *ctl = rdma_cmsg(msg);
 
-	args.flags |= RDS_SEND_NOTIFY_ME;
-	args.user_token = user_token;
-	rdma_put_cmsg(msg, RDS_CMSG_ASYNC_SEND, &args, sizeof(args));
+	rdma_put_cmsg(msg, rds_cmsg_async_send(ctl, user_token), ctl);
 }
 
 static void rdma_build_cmsg_dest(struct msghdr *msg, rds_rdma_cookie_t rdma_dest)
 {
-	rdma_put_cmsg(msg, RDS_CMSG_RDMA_DEST, &rdma_dest, sizeof(rdma_dest));
+	struct rds_cmsg *ctl = rdma_cmsg(msg);
+
+	rdma_put_cmsg(msg, rds_cmsg_rdma_dest(ctl, rdma_dest), ctl);
 }
 
 static void rdma_build_cmsg_map(struct msghdr *msg, uint64_t addr, uint32_t size,
 			rds_rdma_cookie_t *cookie)
 {
-	struct rds_get_mr_args args;
+	struct rds_cmsg *ctl = rdma_cmsg(msg);
+	uint64_t flags;
 
-	args.vec.addr = addr;
-	args.vec.bytes = size;
-	args.cookie_addr = ptr64(cookie);
-	args.flags = RDS_RDMA_READWRITE; /* for now, always assume r/w */
+	flags = RDS_RDMA_READWRITE; /* for now, always assume r/w */
 	if (opt.rdma_use_once)
-		args.flags |= RDS_RDMA_USE_ONCE;
+		flags |= RDS_RDMA_USE_ONCE;
 
-	rdma_put_cmsg(msg, RDS_CMSG_RDMA_MAP, &args, sizeof(args));
+	rdma_put_cmsg(msg, rds_cmsg_rdma_map(ctl, addr, size, cookie, flags), ctl);
 }
 
 static void rdma_process_ack(int fd, struct header *hdr,
@@ -1290,7 +1716,7 @@ static void rdma_process_ack(int fd, struct header *hdr,
 		  (unsigned long long) hdr->rdma_addr);
 
 	/* Need to free the MR unless allocated with use_once */
-	if (!opt.rdma_use_once && !opt.rdma_cache_mrs)
+	if (!opt.rdma_use_once)
 		free_rdma_key(fd, hdr->rdma_key);
 
 	/* if acking an rdma write request - then remote node wrote local host buffer
@@ -1344,6 +1770,11 @@ static int send_msg(int fd, struct task *t, struct header *hdr,
 	ssize_t ret;
 
 	fill_hdr(buf, size, hdr);
+	if (opts->one_way) {
+		uint64_t sent_ns = htonll(now_ns());
+
+		memcpy(buf + MIN_MSG_BYTES, &sent_ns, sizeof(sent_ns));
+	}
 
 	memset(&msg, 0, sizeof(msg));
 	msg.msg_name  = (struct sockaddr *) &t->dst_addr;
@@ -1398,12 +1829,25 @@ static int send_msg(int fd, struct task *t, struct header *hdr,
 		}
 	}
 
-	ret = sendmsg(fd, &msg, 0);
+	ret = transport->sendmsg(fd, &msg, 0);
 	if (ret < 0) {
-		if (errno != EAGAIN && errno != ENOBUFS)
-			die_errno("sendto() failed");
+		if (errno != EAGAIN && errno != ENOBUFS) {
+			if (!opts->audit)
+				die_errno("sendto() failed");
+
+			/* The message is retried after a pause until the
+			 * connection comes back; count it only once. */
+			if (!t->send_err)
+				audit_count(ctl, t->audit, A_SEND_ERR, 1);
+			t->send_err = 1;
+			gettimeofday(&t->send_retry, NULL);
+			t->send_retry.tv_usec += AUDIT_SEND_BACKOFF_MS * 1000;
+			t->send_retry.tv_sec += t->send_retry.tv_usec / 1000000;
+			t->send_retry.tv_usec %= 1000000;
+		}
 		return ret;
 	}
+	t->send_err = 0;
 	if (ret != size)
 		die("sendto() truncated - %zd", ret);
 
@@ -1479,8 +1923,9 @@ static int send_one(int fd, struct task *t,
 		return ret;
 
 	t->send_time[t->send_index] = start;
-	if (!opts->rdma_cache_mrs)
-		t->rdma_req_key[t->send_index] = 0; /* we consumed this key */
+	if (opts->audit && !t->pending)
+		t->last_ack = start;
+	t->rdma_req_key[t->send_index] = 0; /* we consumed this key */
 	stat_inc(&ctl->cur[S_REQ_TX_BYTES], ret);
 	stat_inc(&ctl->cur[S_SENDMSG_USECS],
 		 usec_sub(&stop, &start));
@@ -1611,6 +2056,18 @@ eagain:
 	return -1;
 }
 
+struct completion_ctx {
+	struct task	*tasks;
+	struct options	*opts;
+};
+
+static void task_completed(void *arg, uint64_t token, int status)
+{
+	struct completion_ctx *ctx = arg;
+
+	rdma_mark_completed(ctx->tasks, token, status, ctx->opts);
+}
+
 static int recv_message(int fd,
 		void *buffer, size_t size,
 		rds_rdma_cookie_t *cookie,
@@ -1619,7 +2076,11 @@ static int recv_message(int fd,
 		struct task *tasks,
 		struct options *opts)
 {
-	struct cmsghdr *cmsg;
+	struct completion_ctx ctx = { .tasks = tasks, .opts = opts };
+	struct rds_notify notify = {
+		.complete	= task_completed,
+		.arg		= &ctx,
+	};
 	char cmsgbuf[256];
 	struct msghdr msg;
 	struct iovec iov;
@@ -1635,57 +2096,95 @@ static int recv_message(int fd,
 	iov.iov_base = buffer;
 	iov.iov_len = size;
 
-	ret = recvmsg(fd, &msg, MSG_DONTWAIT);
+	ret = transport->recvmsg(fd, &msg, MSG_DONTWAIT);
 	gettimeofday(tstamp, NULL);
 
 	if (ret < 0)
 		return ret;
 	if (ret && !strcmp(RDS_VERSION, peer_version) &&
-		ret < sizeof(struct header))
+		ret < HDR_BYTES(opts))
 		die("recvmsg() returned short data: %zd", ret);
 	if (ret && msg.msg_namelen < sizeof(struct sockaddr_in))
 		die("socklen = %d < sizeof(sin) (%zu)\n",
 		    msg.msg_namelen, sizeof(struct sockaddr_in));
 
-	/* See if the message comes with a RDMA destination */
-	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-		struct rds_rdma_send_notify notify;
-
-		if (cmsg->cmsg_level != sol)
-			continue;
-		switch (cmsg->cmsg_type) {
-		case RDS_CMSG_CONG_UPDATE:
-			if (cmsg->cmsg_len < CMSG_LEN(sizeof(uint64_t)))
-				die("RDS_CMSG_CONG_UPDATE data too small");
-			else {
-				unsigned int i, port;
-				uint64_t mask;
-
-				memcpy(&mask, CMSG_DATA(cmsg), sizeof(mask));
-				for (i = 0; i < opt.nr_tasks; ++i) {
-					port = ntohs(tasks[i].dst_addr.sin_port);
-					if (mask & RDS_CONG_MONITOR_MASK(port))
-						tasks[i].congested = 0;
-				}
-			}
-			break;
-		case RDS_CMSG_RDMA_DEST:
-			if (cmsg->cmsg_len < CMSG_LEN(sizeof(*cookie)))
-				die("RDS_CMSG_RDMA_DEST data too small");
-			memcpy(cookie, CMSG_DATA(cmsg), sizeof(*cookie));
-			break;
+	/* Congestion updates, completions and RDMA destinations */
+	if (rds_recv_notify(sol, &msg, &notify))
+		die_errno("bad RDS control message");
+	if (notify.cong_update) {
+		unsigned int i, port;
 
-		case RDS_CMSG_RDMA_SEND_STATUS:
-			if (cmsg->cmsg_len < CMSG_LEN(sizeof(notify)))
-				die("RDS_CMSG_RDMA_DEST data too small");
-			memcpy(&notify, CMSG_DATA(cmsg), sizeof(notify));
-			rdma_mark_completed(tasks, notify.user_token, notify.status, opts);
-			break;
+		for (i = 0; i < opt.nr_tasks; ++i) {
+			port = ntohs(tasks[i].dst_addr.sin_port);
+			if (notify.cong_update & RDS_CONG_MONITOR_MASK(port))
+				tasks[i].congested = 0;
 		}
 	}
+	if (notify.rdma_dest)
+		*cookie = notify.rdma_dest;
 	return ret;
 }
 
+/*
+ * --audit: account for a message that is not the next in sequence.  A
+ * message from ahead skips the ones in between, which count as a gap;
+ * we move on to it.  One from behind is a duplicate if we have seen it,
+ * or fills in an earlier gap.  Returns 1 if the message is to be dropped.
+ */
+static int audit_seq(struct task *t, uint32_t seq, struct child_control *ctl)
+{
+	int32_t diff = seq - t->recv_seq;
+	uint32_t back;
+
+	if (diff >= 0) {
+		if (diff) {
+			audit_count(ctl, t->audit, A_GAP, diff);
+			t->recv_window = diff < 64 ? t->recv_window << diff : 0;
+			t->recv_seq = seq;
+		}
+		return 0;
+	}
+
+	back = -(diff + 1);
+	if (back < 64 && (t->recv_window & (1ULL << back))) {
+		audit_count(ctl, t->audit, A_DUP, 1);
+	} else {
+		audit_count(ctl, t->audit, A_REORDER, 1);
+		if (back < 64)
+			t->recv_window |= 1ULL << back;
+	}
+	return 1;
+}
+
+/*
+ * --audit: the message is next in sequence but not in the queue slot we
+ * expected, because messages were lost before it.  For a request, our
+ * ACKs pick up from its slot; ACKs we still owe for the lost ones are
+ * dropped.  For an ACK, the requests before it will not be answered.
+ * Returns 1 if the slot makes no sense.
+ */
+static int audit_index(struct task *t, const struct header *in_hdr,
+		       uint16_t expect_index, struct options *opts)
+{
+	unsigned int skip;
+
+	if (in_hdr->index >= opts->req_depth)
+		return 1;
+
+	if (in_hdr->op == OP_REQ) {
+		t->recv_index = in_hdr->index;
+		t->unacked = 0;
+		return 0;
+	}
+
+	skip = (in_hdr->index - expect_index + opts->req_depth) %
+	       opts->req_depth;
+	if (skip >= t->pending)
+		return 1;
+	t->pending -= skip;
+	return 0;
+}
+
 static int recv_one(int fd, struct task *tasks,
 			struct options *opts,
 		struct child_control *ctl,
@@ -1701,11 +2200,14 @@ static int recv_one(int fd, struct task *tasks,
 	int task_index;
 	ssize_t ret;
 	int	check_status;
+	uint64_t rx_ns = 0;
 
 
 	ret = recv_message(fd, buf, sizeof(buf), &rdma_dest, &sin, &tstamp, tasks, opts);
 	if (ret < 0)
 		return ret;
+	if (opts->one_way)
+		rx_ns = now_ns();
 
 	/* If we received only RDMA completions or cong updates,
 	 * ret will be 0 */
@@ -1714,9 +2216,14 @@ static int recv_one(int fd, struct task *tasks,
 	}
 
 	/* check the incoming sequence number */
-	task_index = ntohs(sin.sin_port) - opts->starting_port - 1;
-	if (task_index >= opts->nr_tasks)
+	task_index = ntohs(sin.sin_port) - peer_port - 1;
+	if (task_index < 0 || task_index >= opts->nr_tasks) {
+		if (opts->audit) {
+			audit_count(ctl, NULL, A_BAD, 1);
+			return 0;
+		}
 		die("received bad task index %u\n", task_index);
+	}
 	t = &tasks[task_index];
 
 	/* make sure the incoming message's size matches its op */
@@ -1724,24 +2231,45 @@ static int recv_one(int fd, struct task *tasks,
 	switch(in_hdr.op) {
 	case OP_REQ:
 		stat_inc(&ctl->cur[S_REQ_RX_BYTES], ret);
-		if (ret != opts->req_size)
+		if (ret != opts->req_size) {
+			if (opts->audit)
+				goto bad;
 			die("req size %zd, not %u\n", ret,
 			    opts->req_size);
+		}
 		expect_index = t->recv_index;
 		break;
 	case OP_ACK:
 		stat_inc(&ctl->cur[S_ACK_RX_BYTES], ret);
-		if (ret != opts->ack_size)
+		if (ret != opts->ack_size) {
+			if (opts->audit)
+				goto bad;
 			die("ack size %zd, not %u\n", ret,
 			    opts->ack_size);
+		}
 
 		/* This ACK should be for the oldest outstanding REQ */
 		expect_index = (t->send_index - t->pending + opts->req_depth) % opts->req_depth;
 		break;
 	default:
+		if (opts->audit)
+			goto bad;
 		die("unknown op %u\n", in_hdr.op);
 	}
 
+	if (opts->audit) {
+		/* resends of old messages are dropped below, uncounted */
+		if (in_hdr.retry && (int32_t)(in_hdr.seq - t->recv_seq) < 0)
+			return 0;
+		if (audit_seq(t, in_hdr.seq, ctl))
+			return 0;
+		if (in_hdr.index != expect_index) {
+			if (audit_index(t, &in_hdr, expect_index, opts))
+				goto bad_seq;
+			expect_index = in_hdr.index;
+		}
+	}
+
 	/*
 	 * Verify that the incoming header indicates that this
 	 * is the next in-order message to us.  We can't predict
@@ -1758,6 +2286,8 @@ static int recv_one(int fd, struct task *tasks,
 	check_status = check_hdr(buf, ret, &hdr, opts);
 	if (check_status) {
 		if (check_status > 0) {
+			if (opts->audit)
+				goto bad_seq;
 			die("header from %s:%u to id %u bogus\n",
 		    	inet_ntoa(sin.sin_addr), htons(sin.sin_port),
 		    	ntohs(t->src_addr.sin_port));
@@ -1765,6 +2295,19 @@ static int recv_one(int fd, struct task *tasks,
 			return 0;
 	}
 
+	/* Forward on the passive side, reverse on the active side */
+	if (opts->one_way) {
+		uint64_t sent_ns, usecs;
+		int64_t owd;
+
+		memcpy(&sent_ns, buf + MIN_MSG_BYTES, sizeof(sent_ns));
+		owd = (int64_t) (rx_ns - ntohll(sent_ns)) - clock_offset(rx_ns);
+		usecs = owd > 0 ? owd / 1000 : 0;
+
+		stat_inc(&ctl->cur[S_ONEWAY_USECS], usecs);
+		ctl->oneway_histogram[get_bucket(usecs)]++;
+	}
+
 	if (hdr.op == OP_ACK) {
                 uint64_t rtt_time = 
                   usec_sub(&tstamp, &t->send_time[expect_index]);
@@ -1773,13 +2316,15 @@ static int recv_one(int fd, struct task *tasks,
                 if (rtt_time > rtt_threshold)
 			print_outlier("Found RTT = 0x%lx\n", rtt_time);
 
-                if (show_histogram)
+                if (show_histogram || result_file)
                 {
                   ctl->latency_histogram[get_bucket(rtt_time)]++;
                 }
 
 		if (t->pending > 0)
 			t->pending -= 1;
+		if (opts->audit)
+			t->last_ack = tstamp;
 
 		if (in_hdr.rdma_key)
 			rdma_process_ack(fd, &in_hdr, ctl);
@@ -1807,8 +2352,35 @@ static int recv_one(int fd, struct task *tasks,
 		t->recv_index = (t->recv_index + 1) % opts->req_depth;
 	}
 	t->recv_seq++;
+	t->recv_window = (t->recv_window << 1) | 1;
 
 	return ret;
+
+bad_seq:
+	/* it had the right sequence number, so don't count a gap for it */
+	t->recv_seq++;
+	t->recv_window = (t->recv_window << 1) | 1;
+bad:
+	audit_count(ctl, t->audit, A_BAD, 1);
+	return 0;
+}
+
+/* --audit: give up on requests that went unanswered for too long */
+static void audit_stalls(struct task *tasks, struct options *opts,
+			 struct child_control *ctl)
+{
+	struct timeval now;
+	struct task *t;
+	uint16_t i;
+
+	gettimeofday(&now, NULL);
+	for (i = 0, t = tasks; i < opts->nr_tasks; i++, t++) {
+		if (t->pending &&
+		    usec_sub(&now, &t->last_ack) > AUDIT_STALL_USECS) {
+			audit_count(ctl, t->audit, A_STALL, 1);
+			t->pending = 0;
+		}
+	}
 }
 
 static void run_child(pid_t parent_pid, struct child_control *ctl,
@@ -1823,6 +2395,7 @@ static void run_child(pid_t parent_pid, struct child_control *ctl,
 	struct task tasks[opts->nr_tasks];
 	struct timeval start;
         int do_work = opts->simplex ? active : 1;
+	int backoff = 0;
 	int j;
 
 	sin.sin_family = AF_INET;
@@ -1839,7 +2412,7 @@ static void run_child(pid_t parent_pid, struct child_control *ctl,
 		tasks[i].src_addr = sin;
 		tasks[i].dst_addr.sin_family = AF_INET;
 		tasks[i].dst_addr.sin_addr.s_addr = htonl(opts->send_addr);
-		tasks[i].dst_addr.sin_port = htons(opts->starting_port + 1 + i);
+		tasks[i].dst_addr.sin_port = htons(peer_port + 1 + i);
 
 		tasks[i].send_time = malloc(opts->req_depth * sizeof(struct timeval));
 		if (!tasks[i].send_time) {
@@ -1902,12 +2475,14 @@ static void run_child(pid_t parent_pid, struct child_control *ctl,
 		memset(tasks[i].retry_token, 0, 2 * opts->req_depth * sizeof(uint64_t));
 
 		tasks[i].rdma_next_op = (i & 1)? RDMA_OP_READ : RDMA_OP_WRITE;
+		if (audit_flows)
+			tasks[i].audit = &audit_flows[id * opts->nr_tasks + i];
 	}
 
 	if (opts->rdma_size)
 		alloc_rdma_buffers(tasks, opts);
 
-	fd = rds_socket(opts, &sin);
+	fd = transport->socket(opts, &sin);
 
 	ctl->ready = 1;
 
@@ -1927,11 +2502,13 @@ static void run_child(pid_t parent_pid, struct child_control *ctl,
 	pfd.events = POLLIN | POLLOUT;
 	while (1) {
 		struct task *t;
+		struct timeval now;
 		int can_send;
 
 		check_parent(parent_pid);
 
-		ret = poll(&pfd, 1, 1000);
+		ret = transport->poll(&pfd, 1,
+				      backoff ? AUDIT_SEND_BACKOFF_MS : 1000);
 		if (ret < 0) {
 			if (errno == EINTR)
 				continue;
@@ -1949,14 +2526,31 @@ static void run_child(pid_t parent_pid, struct child_control *ctl,
 		if (ctl->stopping)
 			continue;
 
+		if (opts->audit)
+			audit_stalls(tasks, opts, ctl);
+
 		/* keep the pipeline full */
 		can_send = !!(pfd.revents & POLLOUT);
+		gettimeofday(&now, NULL);
+		backoff = 0;
 		for (i = 0, t = tasks; i < opts->nr_tasks; i++, t++) {
 			if (opt.use_cong_monitor && t->congested)
 				continue;
 			if (t->drain_rdmas)
 				continue;
+			if (t->send_err && tv_cmp(&now, &t->send_retry) < 0) {
+				backoff = 1;
+				continue;
+			}
 			if (send_anything(fd, t, opts, ctl, can_send, do_work) < 0) {
+				/* --audit: a failed send waits out its
+				 * backoff in poll rather than spinning
+				 * on POLLOUT */
+				if (t->send_err && errno != EAGAIN &&
+				    errno != ENOBUFS && errno != EBADSLT) {
+					backoff = 1;
+					continue;
+				}
 
 				pfd.events |= POLLOUT;
 
@@ -1997,6 +2591,25 @@ static struct child_control *start_children(struct options *opts, int active)
 
 	memset(ctl, 0, len);
 
+	if (opts->one_way) {
+		clock_est = mmap(NULL, sizeof(*clock_est), PROT_READ|PROT_WRITE,
+				 MAP_ANONYMOUS|MAP_SHARED, 0, 0);
+		if (clock_est == MAP_FAILED)
+			die("mmap of the clock estimate failed");
+		memset(clock_est, 0, sizeof(*clock_est));
+	}
+
+	if (opts->audit) {
+		len = (size_t)opts->nr_tasks * opts->nr_tasks *
+		      sizeof(*audit_flows);
+		audit_flows = mmap(NULL, len, PROT_READ|PROT_WRITE,
+				   MAP_ANONYMOUS|MAP_SHARED, 0, 0);
+		if (audit_flows == MAP_FAILED)
+			die("mmap of %u audit flows failed",
+			    opts->nr_tasks * opts->nr_tasks);
+		memset(audit_flows, 0, len);
+	}
+
 	init_msg_pattern(opts);
 
 	if (opts->rdma_key_o_meter)
@@ -2032,7 +2645,7 @@ static struct child_control *start_children(struct options *opts, int active)
 	return ctl;
 }
 
-static double avg(struct counter *ctr)
+static double avg(const struct counter *ctr)
 {
 	if (ctr->nr)
 		return (double)ctr->sum / (double)ctr->nr;
@@ -2223,11 +2836,10 @@ static void
 get_perfdata(int initialize)
 {
 	static struct timeval last_ts, now;
+	static struct rds_info_buf curr = RDS_INFO_BUF_INIT(RDS_INFO_COUNTERS);
 	static struct rds_info_counter *prev, *ctr;
-	static unsigned char *curr = NULL;
-	static socklen_t buflen = 0;
 	static int sock_fd = -1;
-	int i, count, item_size;
+	int i, count;
 
 	if (sock_fd < 0) {
 		sock_fd = socket(pf, SOCK_SEQPACKET, 0);
@@ -2235,29 +2847,22 @@ get_perfdata(int initialize)
 			die_errno("Unable to create socket");
 	}
 
-	/* We should only loop once on the first call; after that the
+	/* The buffer only grows on the first call; after that the
 	 * buffer requirements for RDS counters should not change. */
-	while ((item_size = getsockopt(sock_fd, sol, RDS_INFO_COUNTERS, curr, &buflen)) < 0) {
-		if (errno != ENOSPC)
-			die_errno("getsockopt(RDS_INFO_COUNTERS) failed");
-		curr = realloc(curr, buflen);
-		if (!curr)
-			die_errno("Cannot allocate buffer for stats counters");
-	}
-
-	if (item_size > sizeof(*ctr))
-		die("Bad counter item size in RDS_INFO_COUNTERS (got %d, max %zd)\n",
-				item_size, sizeof(*ctr));
-	count = buflen / item_size;
+	if (rds_info_get(sock_fd, sol, &curr))
+		die_errno("getsockopt(RDS_INFO_COUNTERS) failed");
+	count = rds_info_count(&curr);
 
 	if (prev == NULL) {
 		/* First call - allocate buffer */
 		prev = calloc(count, sizeof(*ctr));
 		ctr = calloc(count, sizeof(*ctr));
+		if (!prev || !ctr)
+			die_errno("Cannot allocate buffer for stats counters");
 	}
 
 	for (i = 0; i < count; ++i)
-		memcpy(ctr + i, curr + i * item_size, item_size);
+		rds_info_counter_at(&curr, i, ctr + i);
 
 	gettimeofday(&now, NULL);
 
@@ -2311,24 +2916,677 @@ static int reap_one_child(int wflags)
 	die("child pid %u wait status %d\n", pid, status);
 }
 
-static void release_children_and_wait(struct options *opts,
-				      struct child_control *ctl,
-				      struct soak_control *soak_arr,
-				      int active)
-{
-	struct counter disp[NR_STATS];
-	struct counter summary[NR_STATS];
-	struct timeval start, end, now, first_ts, last_ts;
-	double cpu_total = 0;
-	uint16_t i, j, cpu_samples = 0;
-	uint16_t nr_running;
-        uint64_t latency_histogram[MAX_BUCKETS];
+/*
+ * Result files.
+ *
+ * A result file records the parameters and environment of a run together
+ * with its summary and RTT histogram, one "key value" pair per line, so
+ * that a later run can be compared against it with --compare.
+ */
+#define RESULT_FILE_MAGIC	"# rds-stress result v1"
+#define RESULT_MAX_ENTRIES	256
 
-	if (show_histogram) 
-        	memset(latency_histogram, 0, sizeof(latency_histogram));
+struct result_entry {
+	char		key[64];
+	char		value[192];
+};
 
-	gettimeofday(&start, NULL);
-	start.tv_sec += 2;
+struct result_set {
+	unsigned int		nr;
+	struct result_entry	entry[RESULT_MAX_ENTRIES];
+};
+
+/*
+ * The metrics we compare. Throughput figures regress when they drop,
+ * latency figures regress when they grow.
+ */
+/* One-way latencies of a --one-way test, gathered by the active side */
+struct oneway_report {
+	struct counter	fwd, rev;
+	uint64_t	fwd_hist[MAX_BUCKETS];
+	uint64_t	rev_hist[MAX_BUCKETS];
+	int64_t		offset;		/* ns, passive minus active */
+	double		drift;		/* ppm */
+	uint64_t	bound;		/* ns */
+};
+
+static const struct result_metric {
+	const char	*key;
+	int		higher_is_better;
+} result_metrics[] = {
+	{ "summary.tx_per_sec",		1 },
+	{ "summary.rx_per_sec",		1 },
+	{ "summary.throughput_kbs",	1 },
+	{ "summary.rdma_in_kbs",	1 },
+	{ "summary.rdma_out_kbs",	1 },
+	{ "summary.tx_usecs",		0 },
+	{ "summary.rtt_usecs",		0 },
+	{ "latency.p50_usecs",		0 },
+	{ "latency.p90_usecs",		0 },
+	{ "latency.p99_usecs",		0 },
+	{ "latency.p999_usecs",		0 },
+	{ "oneway.fwd_p50_usecs",	0 },
+	{ "oneway.fwd_p99_usecs",	0 },
+	{ "oneway.rev_p50_usecs",	0 },
+	{ "oneway.rev_p99_usecs",	0 },
+};
+
+/*
+ * Estimate a percentile from the log2 RTT histogram. Bucket i holds RTTs
+ * in [2^i, 2^(i+1)) usecs; we interpolate linearly within the bucket.
+ */
+static double histogram_percentile(const uint64_t *hist, double pct)
+{
+	uint64_t total = 0, seen = 0, want;
+	unsigned int i;
+
+	for (i = 0; i < MAX_BUCKETS; i++)
+		total += hist[i];
+	if (total == 0)
+		return 0.0;
+
+	want = (uint64_t) (total * pct / 100.0);
+	if (want >= total)
+		want = total - 1;
+
+	for (i = 0; i < MAX_BUCKETS; i++) {
+		double lo = i ? (double) (1ULL << i) : 0.0;
+		double hi = (double) (1ULL << (i + 1));
+
+		if (seen + hist[i] > want)
+			return lo + (hi - lo) * (want - seen) / hist[i];
+		seen += hist[i];
+	}
+	return (double) (1ULL << MAX_BUCKETS);
+}
+
+static void write_result_file(const char *path, struct options *opts,
+			      struct counter *summary, double scale,
+			      double cpu, const uint64_t *hist,
+			      const struct oneway_report *ow)
+{
+	struct utsname uts;
+	char hostname[256];
+	time_t now = time(NULL);
+	FILE *fp;
+	int i;
+
+	fp = fopen(path, "w");
+	if (fp == NULL)
+		die_errno("Cannot create result file %s", path);
+
+	fprintf(fp, "%s\n", RESULT_FILE_MAGIC);
+	fprintf(fp, "version %s\n", RDS_VERSION);
+
+	fprintf(fp, "param.nr_tasks %u\n", opts->nr_tasks);
+	fprintf(fp, "param.req_depth %u\n", opts->req_depth);
+	fprintf(fp, "param.req_size %u\n", opts->req_size);
+	fprintf(fp, "param.ack_size %u\n", opts->ack_size);
+	fprintf(fp, "param.rdma_size %u\n", opts->rdma_size);
+	fprintf(fp, "param.rdma_vector %u\n", opts->rdma_vector);
+	fprintf(fp, "param.rw_mode %u\n", opts->rw_mode);
+	fprintf(fp, "param.simplex %u\n", opts->simplex);
+	fprintf(fp, "param.tos %u\n", opts->tos);
+	fprintf(fp, "param.async %u\n", opts->async);
+	fprintf(fp, "param.verify %u\n", opts->verify);
+	fprintf(fp, "param.audit %u\n", opts->audit);
+	fprintf(fp, "param.run_time %u\n", opts->run_time);
+
+	if (gethostname(hostname, sizeof(hostname)) == 0) {
+		hostname[sizeof(hostname) - 1] = '\0';
+		fprintf(fp, "env.hostname %s\n", hostname);
+	}
+	if (uname(&uts) == 0) {
+		fprintf(fp, "env.kernel %s\n", uts.release);
+		fprintf(fp, "env.kernel_version %s\n", uts.version);
+		fprintf(fp, "env.machine %s\n", uts.machine);
+	}
+	fprintf(fp, "env.nr_cpus %ld\n", sysconf(_SC_NPROCESSORS_ONLN));
+	fprintf(fp, "env.local_addr %s\n", inet_ntoa_32(htonl(opts->receive_addr)));
+	fprintf(fp, "env.peer_addr %s\n", inet_ntoa_32(htonl(opts->send_addr)));
+	fprintf(fp, "env.time %lu\n", (unsigned long) now);
+
+	fprintf(fp, "summary.tx_per_sec %f\n", scale * summary[S_REQ_TX_BYTES].nr);
+	fprintf(fp, "summary.rx_per_sec %f\n", scale * summary[S_REQ_RX_BYTES].nr);
+	fprintf(fp, "summary.throughput_kbs %f\n", scale * throughput(summary) / 1024.0);
+	fprintf(fp, "summary.rdma_in_kbs %f\n", scale * throughput_mbi(summary) / 1024.0);
+	fprintf(fp, "summary.rdma_out_kbs %f\n", scale * throughput_mbo(summary) / 1024.0);
+	fprintf(fp, "summary.tx_usecs %f\n", avg(&summary[S_SENDMSG_USECS]));
+	fprintf(fp, "summary.rtt_usecs %f\n", avg(&summary[S_RTT_USECS]));
+	fprintf(fp, "summary.rtt_min_usecs %"PRIu64"\n", summary[S_RTT_USECS].min);
+	fprintf(fp, "summary.rtt_max_usecs %"PRIu64"\n", summary[S_RTT_USECS].max);
+	fprintf(fp, "summary.cpu_pct %f\n", cpu);
+
+	fprintf(fp, "latency.p50_usecs %f\n", histogram_percentile(hist, 50.0));
+	fprintf(fp, "latency.p90_usecs %f\n", histogram_percentile(hist, 90.0));
+	fprintf(fp, "latency.p99_usecs %f\n", histogram_percentile(hist, 99.0));
+	fprintf(fp, "latency.p999_usecs %f\n", histogram_percentile(hist, 99.9));
+
+	for (i = 0; i < MAX_BUCKETS; i++)
+		fprintf(fp, "histogram.%u %"PRIu64"\n", 1U << i, hist[i]);
+
+	if (ow) {
+		fprintf(fp, "oneway.clock_offset_usecs %f\n", ow->offset / 1000.0);
+		fprintf(fp, "oneway.clock_drift_ppm %f\n", ow->drift);
+		fprintf(fp, "oneway.clock_bound_usecs %f\n", ow->bound / 1000.0);
+		fprintf(fp, "oneway.fwd_usecs %f\n", avg(&ow->fwd));
+		fprintf(fp, "oneway.fwd_p50_usecs %f\n",
+			histogram_percentile(ow->fwd_hist, 50.0));
+		fprintf(fp, "oneway.fwd_p99_usecs %f\n",
+			histogram_percentile(ow->fwd_hist, 99.0));
+		fprintf(fp, "oneway.rev_usecs %f\n", avg(&ow->rev));
+		fprintf(fp, "oneway.rev_p50_usecs %f\n",
+			histogram_percentile(ow->rev_hist, 50.0));
+		fprintf(fp, "oneway.rev_p99_usecs %f\n",
+			histogram_percentile(ow->rev_hist, 99.0));
+	}
+
+	for (i = 0; opts->audit && i < A__LAST; i++)
+		fprintf(fp, "audit.%s %"PRIu64"\n", audit_names[i],
+			summary[S_AUDIT + i].sum);
+
+	if (fclose(fp))
+		die_errno("Error writing result file %s", path);
+	printf("wrote results to %s\n", path);
+}
+
+static void read_result_file(const char *path, struct result_set *res)
+{
+	char line[512];
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		die_errno("Cannot open result file %s", path);
+
+	if (!fgets(line, sizeof(line), fp) ||
+	    strncmp(line, RESULT_FILE_MAGIC, strlen(RESULT_FILE_MAGIC)))
+		die("%s is not an rds-stress result file\n", path);
+
+	res->nr = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		struct result_entry *ent;
+		char *value;
+
+		line[strcspn(line, "\n")] = '\0';
+		if (line[0] == '#' || line[0] == '\0')
+			continue;
+		if (res->nr >= RESULT_MAX_ENTRIES)
+			die("%s: too many entries\n", path);
+
+		value = strchr(line, ' ');
+		if (value == NULL)
+			die("%s: malformed line '%s'\n", path, line);
+		*value++ = '\0';
+
+		ent = &res->entry[res->nr++];
+		if (strlen(line) >= sizeof(ent->key) ||
+		    strlen(value) >= sizeof(ent->value))
+			die("%s: entry '%s' too long\n", path, line);
+		strcpy(ent->key, line);
+		strcpy(ent->value, value);
+	}
+	fclose(fp);
+}
+
+static const char *result_lookup(const struct result_set *res, const char *key)
+{
+	unsigned int i;
+
+	for (i = 0; i < res->nr; i++) {
+		if (!strcmp(res->entry[i].key, key))
+			return res->entry[i].value;
+	}
+	return NULL;
+}
+
+/*
+ * Compare a result file against a baseline. Returns the number of
+ * metrics which regressed by more than the threshold, so that the
+ * exit code can be used to gate kernel rollouts.
+ */
+static int compare_result_files(const char *base_path, const char *cur_path,
+				double threshold)
+{
+	static struct result_set base, cur;
+	unsigned int i, regressions = 0;
+
+	read_result_file(base_path, &base);
+	read_result_file(cur_path, &cur);
+
+	/* Results for different parameters aren't comparable; say so */
+	for (i = 0; i < base.nr; i++) {
+		const char *value;
+
+		if (strncmp(base.entry[i].key, "param.", 6) &&
+		    strcmp(base.entry[i].key, "env.kernel"))
+			continue;
+		value = result_lookup(&cur, base.entry[i].key);
+		if (value && strcmp(value, base.entry[i].value))
+			printf("note: %s differs: %s (baseline) vs %s\n",
+			       base.entry[i].key, base.entry[i].value, value);
+	}
+
+	printf("%-22s %14s %14s %9s\n", "metric", "baseline", "current", "change");
+	for (i = 0; i < sizeof(result_metrics) / sizeof(result_metrics[0]); i++) {
+		const struct result_metric *m = &result_metrics[i];
+		const char *bval, *cval;
+		double b, c, change;
+		int regressed;
+
+		bval = result_lookup(&base, m->key);
+		cval = result_lookup(&cur, m->key);
+		if (!bval)
+			continue;
+
+		/* a truncated or broken result file must not pass */
+		if (!cval) {
+			printf("%-22s %14.2f %14s %9s  MISSING\n",
+			       m->key, strtod(bval, NULL), "-", "");
+			regressions++;
+			continue;
+		}
+		b = strtod(bval, NULL);
+		c = strtod(cval, NULL);
+
+		/* nothing to compare against, e.g. no RDMA in this test */
+		if (b == 0.0 && c == 0.0)
+			continue;
+		change = b ? (c - b) * 100.0 / b : 100.0;
+
+		if (m->higher_is_better)
+			regressed = change < -threshold;
+		else
+			regressed = change > threshold;
+
+		printf("%-22s %14.2f %14.2f %+8.2f%%%s\n",
+		       m->key, b, c, change, regressed ? "  REGRESSION" : "");
+		regressions += regressed;
+	}
+
+	if (regressions)
+		printf("%u metric(s) regressed by more than %.2f%% "
+		       "or are missing\n", regressions, threshold);
+	else
+		printf("no regressions beyond %.2f%%\n", threshold);
+
+	return regressions;
+}
+
+static void peer_send(int fd, const void *ptr, size_t size);
+static void peer_recv(int fd, void *ptr, size_t size);
+
+/*
+ * Messages on the control connection during a --one-way test. The
+ * active parent estimates the clock offset NTP style: it sends SYNC
+ * with its time t1, the passive parent returns it with its receive and
+ * send times t2 and t3, and on arrival at t4
+ *
+ *	offset = ((t2 - t1) + (t3 - t4)) / 2	(passive minus active)
+ *	delay  = (t4 - t1) - (t3 - t2)
+ *
+ * The true offset is within delay / 2 of the estimate. Each sync takes
+ * the exchange with the smallest delay out of CLOCK_SYNC_ROUNDS, once a
+ * second. A least squares fit of those offsets over time gives the
+ * drift; ESTIMATE passes the result on to the passive side. REPORT asks
+ * for the passive side's forward latencies at the end of the test.
+ */
+#define CLOCK_SYNC_ROUNDS	8
+
+enum {
+	CTL_SYNC = 1,
+	CTL_ESTIMATE,
+	CTL_REPORT,
+};
+
+struct ctl_msg {
+	uint8_t		type;
+	uint8_t		pad[7];
+	uint64_t	val[4];
+} __attribute__((packed));
+
+static void ctl_send(int type, uint64_t a, uint64_t b, uint64_t c, uint64_t d)
+{
+	struct ctl_msg msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = type;
+	msg.val[0] = htonll(a);
+	msg.val[1] = htonll(b);
+	msg.val[2] = htonll(c);
+	msg.val[3] = htonll(d);
+	peer_send(control_fd, &msg, sizeof(msg));
+}
+
+static void ctl_recv(struct ctl_msg *msg)
+{
+	unsigned int i;
+
+	peer_recv(control_fd, msg, sizeof(*msg));
+	for (i = 0; i < 4; i++)
+		msg->val[i] = ntohll(msg->val[i]);
+}
+
+/* The active parent's view of the peer's clock */
+static struct {
+	unsigned int	nr;
+	uint64_t	t0;		/* local ns of the first sync */
+	int64_t		offset0;	/* its offset */
+	double		sx, sy, sxx, sxy;	/* least squares sums */
+	int64_t		offset;		/* fitted, passive minus active */
+	double		drift;		/* ns per ns */
+	uint64_t	bound;
+} clock_fit;
+
+static void clock_sync(void)
+{
+	uint64_t t1, t4, best_t = 0, best_delay = ~0ULL;
+	int64_t sample = 0, fitted;
+	struct ctl_msg msg;
+	double x, n, slope = 0;
+	unsigned int i;
+
+	for (i = 0; i < CLOCK_SYNC_ROUNDS; i++) {
+		uint64_t delay;
+
+		t1 = now_ns();
+		ctl_send(CTL_SYNC, t1, 0, 0, 0);
+		ctl_recv(&msg);
+		t4 = now_ns();
+		if (msg.type != CTL_SYNC || msg.val[0] != t1)
+			die("unexpected clock sync reply from peer\n");
+
+		delay = (t4 - t1) - (msg.val[2] - msg.val[1]);
+		if (delay < best_delay) {
+			best_delay = delay;
+			best_t = t4;
+			sample = ((int64_t) (msg.val[1] - t1) +
+				  (int64_t) (msg.val[2] - t4)) / 2;
+		}
+	}
+
+	/* Fit offset = a + slope * x, relative to the first sync */
+	if (clock_fit.nr++ == 0) {
+		clock_fit.t0 = best_t;
+		clock_fit.offset0 = sample;
+	}
+	x = (double) (int64_t) (best_t - clock_fit.t0);
+	clock_fit.sx += x;
+	clock_fit.sy += sample - clock_fit.offset0;
+	clock_fit.sxx += x * x;
+	clock_fit.sxy += x * (sample - clock_fit.offset0);
+
+	n = clock_fit.nr;
+	if (n > 1 && n * clock_fit.sxx - clock_fit.sx * clock_fit.sx > 0)
+		slope = (n * clock_fit.sxy - clock_fit.sx * clock_fit.sy) /
+			(n * clock_fit.sxx - clock_fit.sx * clock_fit.sx);
+	fitted = clock_fit.offset0 + (int64_t)
+		((clock_fit.sy - slope * clock_fit.sx) / n + slope * x);
+
+	clock_fit.offset = fitted;
+	clock_fit.drift = slope;
+	clock_fit.bound = best_delay / 2 +
+		(uint64_t) llabs(sample - fitted);
+
+	clock_update(-fitted, -slope, best_t, clock_fit.bound);
+	/* the drift goes over as parts per trillion */
+	ctl_send(CTL_ESTIMATE, fitted, (int64_t) (slope * 1e12), best_t,
+		 clock_fit.bound);
+}
+
+static void oneway_total(struct counter *ctr, uint64_t *hist,
+			 struct child_control *ctl, uint16_t nr_tasks)
+{
+	struct counter disp[NR_STATS];
+	uint16_t i, j;
+
+	stat_total(disp, ctl, nr_tasks);
+	*ctr = disp[S_ONEWAY_USECS];
+
+	memset(hist, 0, MAX_BUCKETS * sizeof(*hist));
+	for (i = 0; i < nr_tasks; i++)
+		for (j = 0; j < MAX_BUCKETS; j++)
+			hist[j] += ctl[i].oneway_histogram[j];
+}
+
+/* Answer one control message on the passive side; 0 at end of file */
+static int control_serve(struct options *opts, struct child_control *ctl)
+{
+	struct ctl_msg msg;
+	uint64_t t2, hist[MAX_BUCKETS];
+	struct counter ctr;
+	unsigned int i;
+	ssize_t ret;
+
+	ret = recv(control_fd, &msg, 1, MSG_PEEK);
+	if (ret <= 0)
+		return 0;
+	ctl_recv(&msg);
+	t2 = now_ns();
+
+	switch (msg.type) {
+	case CTL_SYNC:
+		ctl_send(CTL_SYNC, msg.val[0], t2, now_ns(), 0);
+		break;
+	case CTL_ESTIMATE:
+		/* Convert to our view: the ref time into our clock */
+		clock_update((int64_t) msg.val[0],
+			     (int64_t) msg.val[1] / 1e12,
+			     msg.val[2] + msg.val[0], msg.val[3]);
+		break;
+	case CTL_REPORT:
+		oneway_total(&ctr, hist, ctl, opts->nr_tasks);
+		ctl_send(CTL_REPORT, ctr.nr, ctr.sum, ctr.min, ctr.max);
+		for (i = 0; i < MAX_BUCKETS; i++)
+			hist[i] = htonll(hist[i]);
+		peer_send(control_fd, hist, sizeof(hist));
+		break;
+	default:
+		die("unknown control message %u from peer\n", msg.type);
+	}
+	return msg.type;
+}
+
+/*
+ * The passive parent waits out a second on the control connection.
+ * Returns 1 when the connection is closed, or anything arrives that
+ * isn't a --one-way control message.
+ */
+static int passive_wait(struct options *opts, struct child_control *ctl)
+{
+	struct timeval now, deadline;
+	struct pollfd pfd;
+	int64_t left;
+
+	gettimeofday(&deadline, NULL);
+	deadline.tv_sec += 1;
+
+	while (1) {
+		gettimeofday(&now, NULL);
+		left = tv_cmp(&deadline, &now);
+		if (left <= 0)
+			return 0;
+
+		pfd.fd = control_fd;
+		pfd.events = POLLIN|POLLHUP;
+		if (poll(&pfd, 1, (left + 999) / 1000) == 1 &&
+		    (!opts->one_way || !control_serve(opts, ctl)))
+			return 1;
+	}
+}
+
+/* Fetch the forward latencies from the passive side */
+static void oneway_collect(struct options *opts, struct child_control *ctl,
+			   struct oneway_report *ow)
+{
+	struct ctl_msg msg;
+	unsigned int i;
+
+	clock_sync();
+
+	ctl_send(CTL_REPORT, 0, 0, 0, 0);
+	ctl_recv(&msg);
+	if (msg.type != CTL_REPORT)
+		die("unexpected control message %u from peer\n", msg.type);
+	ow->fwd.nr = msg.val[0];
+	ow->fwd.sum = msg.val[1];
+	ow->fwd.min = msg.val[2];
+	ow->fwd.max = msg.val[3];
+	peer_recv(control_fd, ow->fwd_hist, sizeof(ow->fwd_hist));
+	for (i = 0; i < MAX_BUCKETS; i++)
+		ow->fwd_hist[i] = ntohll(ow->fwd_hist[i]);
+
+	oneway_total(&ow->rev, ow->rev_hist, ctl, opts->nr_tasks);
+
+	ow->offset = clock_fit.offset;
+	ow->drift = clock_fit.drift * 1e6;
+	ow->bound = clock_fit.bound;
+}
+
+static void oneway_print(const struct oneway_report *ow)
+{
+	const struct {
+		const char		*name;
+		const struct counter	*ctr;
+		const uint64_t		*hist;
+	} dir[] = {
+		{ "forward", &ow->fwd, ow->fwd_hist },
+		{ "reverse", &ow->rev, ow->rev_hist },
+	};
+	unsigned int i;
+
+	printf("\nOne-way latency, clock offset %.2f us, drift %.3f ppm, "
+	       "error bound +/- %.2f us\n",
+	       ow->offset / 1000.0, ow->drift, ow->bound / 1000.0);
+	printf("%-8s %10s %9s %9s %9s %9s %9s\n", "us", "count",
+	       "avg", "min", "max", "p50", "p99");
+	for (i = 0; i < 2; i++)
+		printf("%-8s %10"PRIu64" %9.2f %9"PRIu64" %9"PRIu64" %9.2f %9.2f\n",
+		       dir[i].name, dir[i].ctr->nr, avg(dir[i].ctr),
+		       dir[i].ctr->min, dir[i].ctr->max,
+		       histogram_percentile(dir[i].hist, 50.0),
+		       histogram_percentile(dir[i].hist, 99.0));
+
+	if (show_histogram) {
+		printf("\nOne-way histogram\n");
+		printf("Latency (us)    \t\t  Forward   Reverse\n");
+		for (i = 0; i < MAX_BUCKETS; i++)
+			printf("[%6u - %6u] \t\t %8u  %8u\n", 1 << i, 1 << (i+1),
+			       (unsigned int) ow->fwd_hist[i],
+			       (unsigned int) ow->rev_hist[i]);
+	}
+}
+
+static void audit_print_header(void)
+{
+	unsigned int k;
+
+	for (k = 0; k < A__LAST; k++)
+		printf(" %5s", audit_names[k]);
+}
+
+static void audit_print_counts(const struct counter *disp)
+{
+	unsigned int k;
+
+	for (k = 0; k < A__LAST; k++)
+		printf(" %5"PRIu64, disp[S_AUDIT + k].sum);
+}
+
+static void audit_flow_names(struct options *opts, unsigned int i,
+			     unsigned int j, char *local, char *peer)
+{
+	sprintf(local, "%s:%u", inet_ntoa_32(htonl(opts->receive_addr)),
+		opts->starting_port + 1 + i);
+	sprintf(peer, "%s:%u", inet_ntoa_32(htonl(opts->send_addr)),
+		peer_port + 1 + j);
+}
+
+/*
+ * Print what each flow saw since the last call, if anything, and
+ * remember where it is now.
+ */
+static void audit_print_flows(struct options *opts, struct audit_flow *last)
+{
+	char local[32], peer[32];
+	struct audit_flow cur, *prev;
+	unsigned int i, j, k;
+
+	for (i = 0; i < opts->nr_tasks; i++) {
+		for (j = 0; j < opts->nr_tasks; j++) {
+			prev = &last[i * opts->nr_tasks + j];
+			cur = audit_flows[i * opts->nr_tasks + j];
+			if (!memcmp(&cur, prev, sizeof(cur)))
+				continue;
+
+			audit_flow_names(opts, i, j, local, peer);
+			printf("  flow %s %s:", local, peer);
+			for (k = 0; k < A__LAST; k++) {
+				if (cur.count[k] != prev->count[k])
+					printf(" %s %"PRIu64, audit_names[k],
+					       cur.count[k] - prev->count[k]);
+			}
+			printf("\n");
+			*prev = cur;
+		}
+	}
+}
+
+static void audit_print_totals(struct options *opts)
+{
+	static const struct audit_flow none;
+	char local[32], peer[32];
+	struct audit_flow *flow;
+	unsigned int i, j, k, shown = 0;
+
+	printf("\nAudit, per flow\n%-21s %-21s", "local", "peer");
+	audit_print_header();
+	printf("\n");
+
+	for (i = 0; i < opts->nr_tasks; i++) {
+		for (j = 0; j < opts->nr_tasks; j++) {
+			flow = &audit_flows[i * opts->nr_tasks + j];
+			if (!memcmp(flow, &none, sizeof(none)))
+				continue;
+
+			audit_flow_names(opts, i, j, local, peer);
+			printf("%-21s %-21s", local, peer);
+			for (k = 0; k < A__LAST; k++)
+				printf(" %5"PRIu64, flow->count[k]);
+			printf("\n");
+			shown++;
+		}
+	}
+	if (!shown)
+		printf("no anomalies\n");
+}
+
+static void release_children_and_wait(struct options *opts,
+				      struct child_control *ctl,
+				      struct soak_control *soak_arr,
+				      int active)
+{
+	struct counter disp[NR_STATS];
+	struct counter summary[NR_STATS];
+	struct timeval start, end, now, first_ts, last_ts;
+	double cpu_total = 0;
+	uint16_t i, j, cpu_samples = 0;
+	uint16_t nr_running;
+        uint64_t latency_histogram[MAX_BUCKETS];
+	struct oneway_report oneway;
+	struct audit_flow *audit_last = NULL;
+
+        memset(latency_histogram, 0, sizeof(latency_histogram));
+
+	if (opts->audit) {
+		audit_last = calloc((size_t)opts->nr_tasks * opts->nr_tasks,
+				    sizeof(*audit_last));
+		if (!audit_last)
+			die("out of memory\n");
+	}
+
+	gettimeofday(&start, NULL);
+	start.tv_sec += 2;
 	for (i = 0; i < opts->nr_tasks; i++)
 		ctl[i].start = start;
 
@@ -2337,7 +3595,13 @@ static void release_children_and_wait(struct options *opts,
 	 */
 	printf("Starting up"); fflush(stdout);
 	for (i = 0; i < 4; ++i) {
-		sleep(1);
+		if (!opts->one_way)
+			sleep(1);
+		else if (active) {
+			sleep(1);
+			clock_sync();
+		} else
+			passive_wait(opts, ctl);
 		stat_snapshot(disp, ctl, opts->nr_tasks);
 		cpu_use(soak_arr);
 		printf(".");
@@ -2379,9 +3643,12 @@ static void release_children_and_wait(struct options *opts,
 		get_perfdata(1);
 		printf("\n");
 	} else {
-		printf("%4s %6s %6s %10s %10s %10s %7s %8s %5s\n",
+		printf("%4s %6s %6s %10s %10s %10s %7s %8s %5s",
 			"tsks", "tx/s", "rx/s", "tx+rx K/s", "mbi K/s",
 			"mbo K/s", "tx us/c", "rtt us", "cpu %");
+		if (opts->audit)
+			audit_print_header();
+		printf("\n");
 	}
 
 	last_ts = first_ts;
@@ -2390,13 +3657,10 @@ static void release_children_and_wait(struct options *opts,
 
 		if (active) {
 			sleep(1);
-		} else {
-			struct pollfd pfd;
-
-			pfd.fd = control_fd;
-			pfd.events = POLLIN|POLLHUP;
-			if (poll(&pfd, 1, 1000) == 1)
-				break;
+			if (opts->one_way)
+				clock_sync();
+		} else if (passive_wait(opts, ctl)) {
+			break;
 		}
 
 		/* XXX big bug, need to mark some ctl elements dead */
@@ -2415,7 +3679,7 @@ static void release_children_and_wait(struct options *opts,
 			scale = 1e6 / usec_sub(&now, &last_ts);
 
 			if (!opt.show_perfdata) {
-				printf("%4u %6"PRIu64" %6"PRIu64" %10.2f %10.2f %10.2f %7.2f %8.2f %5.2f\n",
+				printf("%4u %6"PRIu64" %6"PRIu64" %10.2f %10.2f %10.2f %7.2f %8.2f %5.2f",
 					nr_running,
 					disp[S_REQ_TX_BYTES].nr,
 					disp[S_REQ_RX_BYTES].nr,
@@ -2425,6 +3689,11 @@ static void release_children_and_wait(struct options *opts,
 					scale * avg(&disp[S_SENDMSG_USECS]),
 					scale * avg(&disp[S_RTT_USECS]),
 					scale * cpu);
+				if (opts->audit)
+					audit_print_counts(disp);
+				printf("\n");
+				if (opts->audit)
+					audit_print_flows(opts, audit_last);
 			} else {
 				printf("::");
 				printf("%u,%u,%u,%u,",
@@ -2464,6 +3733,9 @@ static void release_children_and_wait(struct options *opts,
 			nr_running--;
 	}
 
+	if (active && opts->one_way)
+		oneway_collect(opts, ctl, &oneway);
+
 	close(control_fd);
 	control_fd = -1;
 
@@ -2491,7 +3763,7 @@ static void release_children_and_wait(struct options *opts,
 
 		scale = 1e6 / usec_sub(&last_ts, &first_ts);
 
-		printf("%4u %6lu %6lu %10.2f %10.2f %10.2f %7.2f %8.2f %5.2f  (average)\n",
+		printf("%4u %6lu %6lu %10.2f %10.2f %10.2f %7.2f %8.2f %5.2f",
 			opts->nr_tasks,
 			(long) (scale * summary[S_REQ_TX_BYTES].nr),
 			(long) (scale * summary[S_REQ_RX_BYTES].nr),
@@ -2501,19 +3773,37 @@ static void release_children_and_wait(struct options *opts,
 			avg(&summary[S_SENDMSG_USECS]),
 			avg(&summary[S_RTT_USECS]),
 			soak_arr? scale * cpu_total : -1.0);
+		/* the audit columns are totals */
+		if (opts->audit)
+			audit_print_counts(summary);
+		printf("  (average)\n");
+
+		for (i = 0; i < opts->nr_tasks; i++)
+		  for (j=0;j < MAX_BUCKETS; j++)
+		    latency_histogram[j] += ctl[i].latency_histogram[j];
 
 		if (show_histogram) 
 		{
-			for (i = 0; i < opts->nr_tasks; i++)
-			  for (j=0;j < MAX_BUCKETS; j++)
-			    latency_histogram[j] += ctl[i].latency_histogram[j];
-			    
 			printf("\nRTT histogram\n");
 			printf("RTT (us)        \t\t    Count\n");
 			for (i=0;i < MAX_BUCKETS; i++)
 			  printf("[%6u - %6u] \t\t %8u\n", 1 << i, 1 << (i+1), 
 			         (unsigned int)latency_histogram[i]);
 		}
+
+		if (active && opts->one_way)
+			oneway_print(&oneway);
+
+		if (opts->audit) {
+			audit_print_totals(opts);
+			free(audit_last);
+		}
+
+		if (result_file)
+			write_result_file(result_file, opts, summary, scale,
+					  soak_arr? scale * cpu_total : -1.0,
+					  latency_histogram,
+					  active && opts->one_way ? &oneway : NULL);
 	}
 }
 
@@ -2573,12 +3863,15 @@ static void peer_recv(int fd, void *ptr, size_t size)
 		if (ret != VERSION_MAX_LEN)
 			die_errno("Failed to read version");
 
-		if (strcmp(peer_version, RDS_VERSION)) {
+		if (!strcmp(peer_version, RDS_VERSION))
+			size -= ret;
+		else if (!strcmp(peer_version, VERSION_2_0_7))
+			size = OPTIONS_2_0_7_SIZE - ret;
+		else {
 			ptr += ret;
 			memcpy(ptr, peer_version, VERSION_MAX_LEN);
 			size = sizeof(struct options_2_0_6) - ret;
-		} else
-			size -= ret;
+		}
 		ptr += ret;
 	}
 
@@ -2627,6 +3920,8 @@ static void encode_options(struct options *dst, const struct options *src)
         dst->rdma_vector = htonl(src->rdma_vector);
 	dst->tos = src->tos;
 	dst->async = src->async;
+	dst->one_way = src->one_way;
+	dst->audit = src->audit;
 }
 
 static void decode_options(struct options *dst, const struct options *src)
@@ -2663,6 +3958,8 @@ static void decode_options(struct options *dst, const struct options *src)
 	dst->rdma_vector = ntohl(src->rdma_vector);
 	dst->tos = src->tos;
 	dst->async = src->async;
+	dst->one_way = src->one_way;
+	dst->audit = src->audit;
 }
 
 static void verify_option_encdec(const struct options *opts)
@@ -2764,7 +4061,7 @@ static int active_parent(struct options *opts, struct soak_control *soak_arr)
 	control_fd = fd;
 
 	sin.sin_family = AF_INET;
-	sin.sin_port = htons(opts->starting_port);
+	sin.sin_port = htons(peer_port);
 	sin.sin_addr.s_addr = htonl(opts->send_addr);
 
 	peer_connect(fd, &sin);
@@ -2779,9 +4076,12 @@ static int active_parent(struct options *opts, struct soak_control *soak_arr)
 	 * We just tell the peer what options to use.
 	 */
 	encode_options(&enc_options, opts);
-	if (opts->tos || opts->async)
+	if (opts->one_way || opts->audit)
 		peer_send(fd, &enc_options, sizeof(struct options));
-	else
+	else if (opts->tos || opts->async) {
+		strcpy(enc_options.version, VERSION_2_0_7);
+		peer_send(fd, &enc_options, OPTIONS_2_0_7_SIZE);
+	} else
 		peer_send(fd, &enc_options.req_depth,
 				sizeof(struct options_2_0_6));
 
@@ -2800,15 +4100,10 @@ static int active_parent(struct options *opts, struct soak_control *soak_arr)
 	return 0;
 }
 
-static int passive_parent(uint32_t addr, uint16_t port,
-			  struct soak_control *soak_arr)
+static int passive_listen(uint32_t addr, uint16_t port)
 {
-	struct options remote, *opts;
-	struct child_control *ctl;
 	struct sockaddr_in sin;
-	socklen_t socklen;
-	int lfd, fd;
-	uint8_t ok;
+	int lfd;
 
 	sin.sin_family = AF_INET;
 	sin.sin_port = htons(port);
@@ -2816,11 +4111,29 @@ static int passive_parent(uint32_t addr, uint16_t port,
 
 	lfd = bound_socket(PF_INET, SOCK_STREAM, IPPROTO_TCP, &sin);
 
-	printf("waiting for incoming connection on %s:%d\n", inet_ntoa(sin.sin_addr), port);
-
 	if (listen(lfd, 255))
 		die_errno("listen() failed");
 
+	return lfd;
+}
+
+/* lfd is the listening socket if the caller already set one up, or -1 */
+static int passive_parent(uint32_t addr, uint16_t port, int lfd,
+			  struct soak_control *soak_arr)
+{
+	struct options remote, *opts;
+	struct child_control *ctl;
+	struct sockaddr_in sin;
+	socklen_t socklen;
+	int fd;
+	uint8_t ok;
+
+	if (lfd < 0)
+		lfd = passive_listen(addr, port);
+
+	sin.sin_addr.s_addr = htonl(addr);
+	printf("waiting for incoming connection on %s:%d\n", inet_ntoa(sin.sin_addr), port);
+
 	socklen = sizeof(sin);
 
 	fd = accept(lfd, (struct sockaddr *)&sin, &socklen);
@@ -2851,8 +4164,17 @@ static int passive_parent(uint32_t addr, uint16_t port,
 	 */
 	opts->send_addr = opts->receive_addr;
 	opts->receive_addr = addr;
+
+	/* Our tasks use the ports following the one we listen on, which
+	 * only differs from the peer's in loopback mode. */
+	peer_port = opts->starting_port;
+	opts->starting_port = port;
 	opt = *opts;
 
+	if (transport != &rds_transport && opts->rdma_size)
+		die("RDMA is not available over the %s transport\n",
+		    transport->name);
+
 	ctl = start_children(opts, 0);
 
 	/* Wait for "GO" from the initiating peer */
@@ -2865,6 +4187,640 @@ static int passive_parent(uint32_t addr, uint16_t port,
 	return 0;
 }
 
+/*
+ * In loopback mode we run the passive side ourselves, listening on the
+ * ports following our tasks' so that both sides can share an address.
+ * It is forked twice so that the waitpid() calls for our tasks never
+ * see it; it exits at the end of the test or when the control
+ * connection goes away, and keeps its output to itself.
+ */
+static void start_loopback_peer(struct options *opts)
+{
+	uint16_t port = opts->starting_port + opts->nr_tasks + 1;
+	pid_t pid;
+	int lfd, fd;
+
+	if (opts->starting_port + 2 * (opts->nr_tasks + 1) > 0x10000)
+		die("not enough ports above %u for the loopback peer\n",
+		    opts->starting_port);
+
+	lfd = passive_listen(opts->receive_addr, port);
+
+	pid = fork();
+	if (pid < 0)
+		die_errno("fork failed");
+	if (pid == 0) {
+		pid = fork();
+		if (pid < 0)
+			die_errno("fork failed");
+		if (pid > 0)
+			_exit(0);
+
+		fd = open("/dev/null", O_WRONLY);
+		if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0)
+			die_errno("unable to redirect loopback peer output");
+		close(fd);
+		result_file = NULL;
+		exit(passive_parent(opts->receive_addr, port, lfd, NULL));
+	}
+
+	close(lfd);
+	if (waitpid(pid, NULL, 0) < 0)
+		die_errno("waitpid failed");
+	peer_port = port;
+}
+
+/*
+ * Agent and coordinator.  An agent (--agent) waits on the -r address and
+ * -p port for test plans from a coordinator (--coordinate).  A plan is a
+ * few lines of text:
+ *
+ *	start <unix time in ms>
+ *	arg <argument>		(repeated)
+ *	run
+ *
+ * The agent runs rds-stress with the arguments at the start time, or at
+ * once if it is 0, and streams the run back as "out" and "err" lines,
+ * then the result file as "result <key> <value>" lines, then "exit
+ * <status>".  Each plan gets its own connection and process, so one agent
+ * can take part in several runs at once.  Closing the connection stops
+ * the run.  Start times are wall clock times, so the hosts' clocks must
+ * be synchronised, by NTP say, or the active sides of a round won't
+ * start together.
+ *
+ * The coordinator sends each ordered pair of agents a passive and an
+ * active plan, one pair at a time or all at once, and prints the
+ * resulting matrices.  Each pair runs on its own block of ports above
+ * the agent port.
+ */
+#define AGENT_MAX_ARGS	128
+#define AGENT_LINE	1024
+
+struct line_buf {
+	int		fd;
+	size_t		len;
+	char		buf[AGENT_LINE];
+};
+
+/*
+ * Read what is available on lb->fd and hand each complete line to fn.
+ * Overlong lines are cut into pieces.  Returns 0 at EOF, 1 otherwise.
+ */
+static int line_buf_read(struct line_buf *lb,
+			 void (*fn)(void *arg, char *line), void *arg)
+{
+	char *p, *nl;
+	ssize_t ret;
+
+	ret = read(lb->fd, lb->buf + lb->len, sizeof(lb->buf) - 1 - lb->len);
+	if (ret < 0 && errno == EINTR)
+		return 1;
+	if (ret <= 0) {
+		if (lb->len) {
+			lb->buf[lb->len] = '\0';
+			fn(arg, lb->buf);
+			lb->len = 0;
+		}
+		return 0;
+	}
+
+	lb->len += ret;
+	lb->buf[lb->len] = '\0';
+	for (p = lb->buf; (nl = strchr(p, '\n')) != NULL; p = nl + 1) {
+		*nl = '\0';
+		fn(arg, p);
+	}
+	lb->len -= p - lb->buf;
+	memmove(lb->buf, p, lb->len);
+
+	if (lb->len == sizeof(lb->buf) - 1) {
+		lb->buf[lb->len] = '\0';
+		fn(arg, lb->buf);
+		lb->len = 0;
+	}
+	return 1;
+}
+
+static uint64_t realtime_ms(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+struct agent_plan {
+	char		*argv[AGENT_MAX_ARGS + 4];
+	int		argc;
+	uint64_t	start_ms;
+	int		ready;
+};
+
+/*
+ * A plan must not turn the run into another agent or coordinator.
+ * getopt_long() takes any unambiguous prefix, so refuse those too.
+ */
+static int agent_forbidden(const char *arg)
+{
+	static const char *forbidden[] = { "agent", "coordinate" };
+	size_t len;
+	unsigned int i;
+
+	if (strncmp(arg, "--", 2) || !arg[2])
+		return 0;
+	arg += 2;
+	len = strcspn(arg, "=");
+	for (i = 0; i < sizeof(forbidden) / sizeof(forbidden[0]); i++) {
+		if (!strncmp(arg, forbidden[i], len))
+			return 1;
+	}
+	return 0;
+}
+
+static void agent_plan_line(void *arg, char *line)
+{
+	struct agent_plan *plan = arg;
+
+	if (plan->ready)
+		return;
+
+	if (!strncmp(line, "arg ", 4)) {
+		if (plan->argc > AGENT_MAX_ARGS)
+			die("too many arguments in plan\n");
+		plan->argv[plan->argc] = strdup(line + 4);
+		if (!plan->argv[plan->argc++])
+			die("out of memory\n");
+	} else if (!strncmp(line, "start ", 6))
+		plan->start_ms = strtoull(line + 6, NULL, 10);
+	else if (!strcmp(line, "run"))
+		plan->ready = 1;
+	else
+		die("unexpected plan line '%s'\n", line);
+}
+
+struct agent_relay {
+	int		fd;
+	const char	*tag;
+};
+
+static void agent_relay_line(void *arg, char *line)
+{
+	struct agent_relay *relay = arg;
+
+	/* if the coordinator has gone, the run is stopped below */
+	dprintf(relay->fd, "%s %s\n", relay->tag, line);
+}
+
+/* Runs in a child of the agent, one per plan */
+static void agent_serve(int fd, const char *self)
+{
+	char result[] = "/tmp/rds-stress-agent.XXXXXX";
+	struct line_buf sock = { .fd = fd };
+	struct line_buf pipes[2];
+	struct agent_relay relay[2] = {
+		{ fd, "out" },
+		{ fd, "err" },
+	};
+	struct agent_plan plan;
+	struct pollfd pfd[3];
+	int pipefd[2][2];
+	int status, i, open;
+	char line[AGENT_LINE];
+	uint64_t now;
+	FILE *fp;
+	pid_t pid;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(&plan, 0, sizeof(plan));
+	plan.argv[plan.argc++] = "rds-stress";
+	while (!plan.ready) {
+		if (!line_buf_read(&sock, agent_plan_line, &plan))
+			die("coordinator closed the connection before 'run'\n");
+	}
+
+	/* tell the coordinator, whose output the user is watching */
+	for (i = 1; i < plan.argc; i++) {
+		if (agent_forbidden(plan.argv[i])) {
+			dprintf(fd, "err plan may not run '%s'\nexit 1\n",
+				plan.argv[i]);
+			exit(1);
+		}
+	}
+
+	i = mkstemp(result);
+	if (i < 0)
+		die_errno("unable to create result file");
+	close(i);
+	plan.argv[plan.argc++] = "--result-file";
+	plan.argv[plan.argc++] = result;
+	plan.argv[plan.argc] = NULL;
+
+	now = realtime_ms();
+	if (plan.start_ms > now) {
+		struct timespec ts = {
+			.tv_sec = (plan.start_ms - now) / 1000,
+			.tv_nsec = (plan.start_ms - now) % 1000 * 1000000,
+		};
+
+		while (nanosleep(&ts, &ts) && errno == EINTR)
+			;
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (pipe(pipefd[i]))
+			die_errno("pipe failed");
+	}
+
+	pid = fork();
+	if (pid < 0)
+		die_errno("fork failed");
+	if (pid == 0) {
+		if (dup2(pipefd[0][1], STDOUT_FILENO) < 0 ||
+		    dup2(pipefd[1][1], STDERR_FILENO) < 0)
+			die_errno("unable to redirect output");
+		for (i = 0; i < 2; i++) {
+			close(pipefd[i][0]);
+			close(pipefd[i][1]);
+		}
+		close(fd);
+		execv(self, plan.argv);
+		die_errno("unable to run %s", self);
+	}
+
+	for (i = 0; i < 2; i++) {
+		close(pipefd[i][1]);
+		pipes[i].fd = pipefd[i][0];
+		pipes[i].len = 0;
+		pfd[i].fd = pipefd[i][0];
+		pfd[i].events = POLLIN;
+	}
+	pfd[2].fd = fd;
+	pfd[2].events = POLLIN;
+
+	for (open = 2; open; ) {
+		if (poll(pfd, 3, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			die_errno("poll failed");
+		}
+
+		for (i = 0; i < 2; i++) {
+			if (pfd[i].revents &&
+			    !line_buf_read(&pipes[i], agent_relay_line,
+					   &relay[i])) {
+				close(pfd[i].fd);
+				pfd[i].fd = -1;
+				open--;
+			}
+		}
+
+		/* The coordinator sends nothing more, so this is EOF */
+		if (pfd[2].revents) {
+			kill(pid, SIGTERM);
+			pfd[2].fd = -1;
+		}
+	}
+
+	if (waitpid(pid, &status, 0) < 0)
+		die_errno("waitpid failed");
+
+	fp = fopen(result, "r");
+	if (fp) {
+		while (fgets(line, sizeof(line), fp))
+			dprintf(fd, "result %s", line);
+		fclose(fp);
+	}
+	unlink(result);
+
+	dprintf(fd, "exit %d\n", WIFEXITED(status) ? WEXITSTATUS(status) :
+						     128 + WTERMSIG(status));
+}
+
+static int agent(uint32_t addr, uint16_t port)
+{
+	struct sockaddr_in sin;
+	socklen_t socklen;
+	char self[PATH_MAX];
+	ssize_t len;
+	pid_t pid;
+	int lfd, fd;
+
+	len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (len < 0)
+		die_errno("unable to find our own executable");
+	self[len] = '\0';
+
+	lfd = passive_listen(addr, port);
+
+	/* plans are served by children nobody waits for */
+	signal(SIGCHLD, SIG_IGN);
+
+	sin.sin_addr.s_addr = htonl(addr);
+	printf("agent waiting for plans on %s:%u\n", inet_ntoa(sin.sin_addr),
+	       port);
+
+	while (1) {
+		socklen = sizeof(sin);
+		fd = accept(lfd, (struct sockaddr *)&sin, &socklen);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			die_errno("accept() failed");
+		}
+
+		printf("plan from %s:%u\n", inet_ntoa(sin.sin_addr),
+		       ntohs(sin.sin_port));
+
+		pid = fork();
+		if (pid < 0)
+			die_errno("fork failed");
+		if (pid == 0) {
+			close(lfd);
+			signal(SIGCHLD, SIG_DFL);
+			agent_serve(fd, self);
+			exit(0);
+		}
+		close(fd);
+	}
+
+	return 0;
+}
+
+struct coord_agent {
+	uint32_t	addr;		/* host byte order */
+	uint16_t	port;
+	char		name[INET_ADDRSTRLEN];
+};
+
+struct coord_conn {
+	struct line_buf		lb;
+	struct coord_run	*run;
+	int			active;
+	int			status;
+};
+
+struct coord_run {
+	struct coord_agent	*src;	/* active, sends requests to dst */
+	struct coord_agent	*dst;
+	uint16_t		port;
+	struct coord_conn	conn[2];	/* passive, active */
+	double			throughput;
+	double			rtt;
+};
+
+static void coord_line(void *arg, char *line)
+{
+	struct coord_conn *conn = arg;
+	struct coord_run *run = conn->run;
+	char *val;
+
+	if (!strncmp(line, "out ", 4)) {
+		if (conn->active)
+			printf("[%s>%s] %s\n", run->src->name, run->dst->name,
+			       line + 4);
+	} else if (!strncmp(line, "err ", 4)) {
+		fprintf(stderr, "[%s>%s %s] %s\n",
+			run->src->name, run->dst->name,
+			conn->active ? "active" : "passive", line + 4);
+	} else if (!strncmp(line, "result ", 7)) {
+		if (!conn->active)
+			return;
+		line += 7;
+		val = strchr(line, ' ');
+		if (!val)
+			return;
+		*val++ = '\0';
+		if (!strcmp(line, "summary.throughput_kbs"))
+			run->throughput = strtod(val, NULL);
+		else if (!strcmp(line, "summary.rtt_usecs"))
+			run->rtt = strtod(val, NULL);
+	} else if (!strncmp(line, "exit ", 5))
+		conn->status = atoi(line + 5);
+}
+
+static void coord_send_plan(struct coord_conn *conn, struct coord_agent *agent,
+			    uint64_t start_ms, char **role, char **args)
+{
+	struct sockaddr_in sin;
+	int fd;
+
+	fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (fd < 0)
+		die_errno("unable to create socket");
+
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(agent->port);
+	sin.sin_addr.s_addr = htonl(agent->addr);
+	if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)))
+		die_errno("unable to reach agent %s:%u", agent->name,
+			  agent->port);
+
+	dprintf(fd, "start %"PRIu64"\n", start_ms);
+	for (; *role; role++)
+		dprintf(fd, "arg %s\n", *role);
+	for (; *args; args++)
+		dprintf(fd, "arg %s\n", *args);
+	dprintf(fd, "run\n");
+
+	conn->lb.fd = fd;
+	conn->lb.len = 0;
+	conn->status = -1;
+}
+
+/* Start a batch of runs together and wait for all of them to finish */
+static void coord_round(struct coord_run *runs, unsigned int nr, char **args)
+{
+	struct pollfd *pfd;
+	struct coord_conn *conn;
+	char port[16], retries[16];
+	char *passive[] = { "-r", NULL, "-p", port, NULL };
+	char *active[] = { "-r", NULL, "-s", NULL, "-p", port,
+			   "--connect-retries", retries, NULL };
+	unsigned int i, j, open;
+	uint64_t start_ms;
+
+	pfd = calloc(2 * nr, sizeof(*pfd));
+	if (!pfd)
+		die("out of memory\n");
+
+	/* passive sides start as soon as they get the plan, active sides
+	 * wait for the start time, which gives the passive ones some slack */
+	start_ms = realtime_ms() + 1000 + 10 * nr;
+	snprintf(retries, sizeof(retries), "%u", 10);
+
+	for (i = 0; i < nr; i++) {
+		snprintf(port, sizeof(port), "%u", runs[i].port);
+		passive[1] = runs[i].dst->name;
+		active[1] = runs[i].src->name;
+		active[3] = runs[i].dst->name;
+
+		for (j = 0; j < 2; j++) {
+			conn = &runs[i].conn[j];
+			conn->run = &runs[i];
+			conn->active = j;
+			coord_send_plan(conn, j ? runs[i].src : runs[i].dst,
+					j ? start_ms : 0, j ? active : passive,
+					args);
+			pfd[2 * i + j].fd = conn->lb.fd;
+			pfd[2 * i + j].events = POLLIN;
+		}
+		runs[i].throughput = -1;
+		runs[i].rtt = -1;
+	}
+
+	for (open = 2 * nr; open; ) {
+		if (poll(pfd, 2 * nr, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			die_errno("poll failed");
+		}
+
+		for (i = 0; i < 2 * nr; i++) {
+			if (pfd[i].fd < 0 || !pfd[i].revents)
+				continue;
+			conn = &runs[i / 2].conn[i % 2];
+			if (line_buf_read(&conn->lb, coord_line, conn))
+				continue;
+
+			close(pfd[i].fd);
+			pfd[i].fd = -1;
+			open--;
+
+			/* A failed active side leaves its peer waiting for
+			 * a connection that will never come, stop it. */
+			if (conn->active && conn->status && pfd[i - 1].fd >= 0) {
+				close(pfd[i - 1].fd);
+				pfd[i - 1].fd = -1;
+				open--;
+			}
+		}
+	}
+
+	free(pfd);
+}
+
+static void coord_print_matrix(const char *title, struct coord_agent *agents,
+			       unsigned int nr_agents, struct coord_run *runs,
+			       unsigned int nr_runs, int rtt)
+{
+	struct coord_run **cell;
+	unsigned int i, j;
+	double val;
+
+	cell = calloc(nr_agents * nr_agents, sizeof(*cell));
+	if (!cell)
+		die("out of memory\n");
+	for (i = 0; i < nr_runs; i++)
+		cell[(runs[i].src - agents) * nr_agents +
+		     (runs[i].dst - agents)] = &runs[i];
+
+	printf("\n%s (rows send to columns)\n%-15s", title, "");
+	for (j = 0; j < nr_agents; j++)
+		printf(" %15s", agents[j].name);
+	printf("\n");
+
+	for (i = 0; i < nr_agents; i++) {
+		printf("%-15s", agents[i].name);
+		for (j = 0; j < nr_agents; j++) {
+			struct coord_run *run = cell[i * nr_agents + j];
+
+			if (!run) {
+				printf(" %15s", "-");
+				continue;
+			}
+			val = rtt ? run->rtt : run->throughput;
+			if (run->conn[1].status || val < 0)
+				printf(" %15s", "failed");
+			else
+				printf(" %15.2f", val);
+		}
+		printf("\n");
+	}
+
+	free(cell);
+}
+
+/*
+ * list is "addr[:port],..."; agents without a port listen on port.  The
+ * pairs run on the ports above "port", so that the default agent port
+ * and the default test port do not meet.
+ */
+static int coordinate(char *list, int all, uint16_t port,
+		      uint16_t nr_tasks, char **args)
+{
+	struct coord_agent *agents = NULL;
+	struct coord_run *runs;
+	unsigned int nr_agents = 0, nr_runs, i, j, failed;
+	char *name, *colon, *save;
+	unsigned long block;
+
+	for (name = strtok_r(list, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+		agents = realloc(agents, (nr_agents + 1) * sizeof(*agents));
+		if (!agents)
+			die("out of memory\n");
+
+		colon = strchr(name, ':');
+		if (colon)
+			*colon++ = '\0';
+		agents[nr_agents].addr = parse_addr(name);
+		agents[nr_agents].port = colon ? parse_ull(colon, 0xffff) :
+						 port;
+		strcpy(agents[nr_agents].name,
+		       inet_ntoa_32(htonl(agents[nr_agents].addr)));
+		nr_agents++;
+	}
+	if (nr_agents < 2)
+		die("--coordinate needs at least two agents\n");
+
+	nr_runs = nr_agents * (nr_agents - 1);
+	runs = calloc(nr_runs, sizeof(*runs));
+	if (!runs)
+		die("out of memory\n");
+
+	/* each concurrent pair needs the TCP port and one per task */
+	block = (unsigned long)nr_tasks + 1;
+	if (port + 1 + (all ? nr_runs : 1) * block > 0x10000)
+		die("not enough ports above %u for %u pairs of %u tasks\n",
+		    port, all ? nr_runs : 1, nr_tasks);
+
+	for (i = 0, nr_runs = 0; i < nr_agents; i++) {
+		for (j = 0; j < nr_agents; j++) {
+			if (i == j)
+				continue;
+			runs[nr_runs].src = &agents[i];
+			runs[nr_runs].dst = &agents[j];
+			runs[nr_runs].port = port + 1 +
+					     (all ? nr_runs * block : 0);
+			nr_runs++;
+		}
+	}
+
+	printf("coordinating %u agents, %u pairs %s\n", nr_agents, nr_runs,
+	       all ? "all at once" : "one at a time");
+
+	if (all)
+		coord_round(runs, nr_runs, args);
+	else {
+		for (i = 0; i < nr_runs; i++)
+			coord_round(&runs[i], 1, args);
+	}
+
+	coord_print_matrix("Throughput, tx+rx K/s", agents, nr_agents,
+			   runs, nr_runs, 0);
+	coord_print_matrix("RTT, us", agents, nr_agents, runs, nr_runs, 1);
+
+	for (i = 0, failed = 0; i < nr_runs; i++)
+		failed += runs[i].conn[1].status != 0;
+	if (failed)
+		printf("\n%u of %u pairs failed\n", failed, nr_runs);
+
+	free(runs);
+	free(agents);
+	return !!failed;
+}
+
 /*
  * The soaker *constantly* spins calling getpid().  It tries to execute a
  * second's worth of calls before checking that it's parent is still alive.  It
@@ -2972,6 +4928,16 @@ enum {
         OPT_SHOW_HISTOGRAM,
 	OPT_RESET,
 	OPT_ASYNC,
+	OPT_RESULT_FILE,
+	OPT_COMPARE,
+	OPT_REGRESS_THRESHOLD,
+	OPT_TRANSPORT,
+	OPT_LOOPBACK,
+	OPT_ONE_WAY,
+	OPT_AUDIT,
+	OPT_AGENT,
+	OPT_COORDINATE,
+	OPT_MATRIX,
 };
 
 static struct option long_options[] = {
@@ -3006,6 +4972,16 @@ static struct option long_options[] = {
 { "show-histogram",     no_argument,            NULL,   OPT_SHOW_HISTOGRAM   },
 { "reset",              no_argument,            NULL,   OPT_RESET },
 { "async",              no_argument,            NULL,   OPT_ASYNC },
+{ "result-file",	required_argument,	NULL,	OPT_RESULT_FILE },
+{ "compare",		no_argument,		NULL,	OPT_COMPARE },
+{ "regress-threshold",	required_argument,	NULL,	OPT_REGRESS_THRESHOLD },
+{ "transport",		required_argument,	NULL,	OPT_TRANSPORT },
+{ "loopback",		no_argument,		NULL,	OPT_LOOPBACK },
+{ "one-way",		no_argument,		NULL,	OPT_ONE_WAY },
+{ "audit",		no_argument,		NULL,	OPT_AUDIT },
+{ "agent",		no_argument,		NULL,	OPT_AGENT },
+{ "coordinate",		required_argument,	NULL,	OPT_COORDINATE },
+{ "matrix",		required_argument,	NULL,	OPT_MATRIX },
 { NULL }
 };
 
@@ -3013,6 +4989,13 @@ int main(int argc, char **argv)
 {
 	struct options opts;
 	struct soak_control *soak_arr = NULL;
+	int compare = 0;
+	int loopback = 0;
+	int run_agent = 0;
+	char *agents = NULL;
+	int matrix_all = 0;
+	char **forward;
+	int nr_forward = 0, bundled_port = 0;
 
 #ifdef DYNAMIC_PF_RDS
 	pf = discover_pf_rds();
@@ -3059,16 +5042,35 @@ int main(int argc, char **argv)
 	opts.tos = 0;
 	reset_connection = 0;
 	opts.async = 0;
+	opts.one_way = 0;
+	opts.audit = 0;
 	strcpy(opts.version, RDS_VERSION);
 
+	/* a coordinator hands its test options on to the agents */
+	forward = calloc(argc, sizeof(*forward));
+	if (!forward)
+		die("out of memory\n");
+
 	while(1) {
-		int c, index;
+		int c, index, first = optind;
 
 		c = getopt_long(argc, argv, "+a:cD:d:hI:M:op:q:Rr:s:t:T:Q:vVz",
 				long_options, &index);
 		if (c == -1)
 			break;
 
+		/* Options other than the coordinator's own, as they were
+		 * given.  A bundle of short options ends with the one that
+		 * advances optind, so only -p needs to be given alone. */
+		if (c == OPT_COORDINATE || c == OPT_MATRIX || c == 'p') {
+			if (c == 'p' && strncmp(argv[first], "-p", 2) &&
+			    strncmp(argv[first], "--p", 3))
+				bundled_port = 1;
+		} else {
+			while (first < optind)
+				forward[nr_forward++] = argv[first++];
+		}
+
 		switch(c) {
 			case 'a':
 				opts.ack_size = parse_ull(optarg, (uint32_t)~0);
@@ -3141,6 +5143,51 @@ int main(int argc, char **argv)
 			case OPT_ASYNC:
 				opts.async = 1;
 				break;
+			case OPT_RESULT_FILE:
+				result_file = optarg;
+				break;
+			case OPT_COMPARE:
+				compare = 1;
+				break;
+			case OPT_REGRESS_THRESHOLD: {
+				char *endptr;
+
+				regress_threshold = strtod(optarg, &endptr);
+				if (*endptr || regress_threshold < 0)
+					die("invalid threshold '%s'\n", optarg);
+				break;
+			}
+			case OPT_LOOPBACK:
+				loopback = 1;
+				break;
+			case OPT_ONE_WAY:
+				opts.one_way = 1;
+				break;
+			case OPT_AUDIT:
+				opts.audit = 1;
+				break;
+			case OPT_AGENT:
+				run_agent = 1;
+				break;
+			case OPT_COORDINATE:
+				agents = optarg;
+				break;
+			case OPT_MATRIX:
+				if (!strcmp(optarg, "pairwise"))
+					matrix_all = 0;
+				else if (!strcmp(optarg, "all"))
+					matrix_all = 1;
+				else
+					die("unknown matrix '%s'\n", optarg);
+				break;
+			case OPT_TRANSPORT:
+				if (!strcmp(optarg, "rds"))
+					transport = &rds_transport;
+				else if (!strcmp(optarg, "loopback"))
+					transport = &lo_transport;
+				else
+					die("unknown transport '%s'\n", optarg);
+				break;
 			case OPT_RDMA_USE_ONCE:
 				opts.rdma_use_once = parse_ull(optarg, 1);
 				break;
@@ -3179,6 +5226,34 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (compare) {
+		if (optind + 2 != argc)
+			die("--compare needs a baseline and a result file\n");
+		return !!compare_result_files(argv[optind], argv[optind + 1],
+					      regress_threshold);
+	}
+
+	if (run_agent)
+		return agent(opts.receive_addr, opts.starting_port);
+
+	if (agents) {
+		if (opts.receive_addr || opts.send_addr != ~0 || loopback ||
+		    result_file)
+			die("-r, -s, --loopback and --result-file are set by "
+			    "the coordinator for each pair\n");
+		if (bundled_port)
+			die("give -p on its own with --coordinate\n");
+		if (!opts.run_time)
+			die("--coordinate needs a run time, -T\n");
+		if (soak_arr)
+			stop_soakers(soak_arr);
+		if (opts.nr_tasks == (uint16_t)~0)
+			opts.nr_tasks = 1;
+		forward[nr_forward] = NULL;
+		return coordinate(agents, matrix_all, opts.starting_port,
+				  opts.nr_tasks, forward);
+	}
+
 	if (opts.rdma_use_once == 0xff)
 		opts.rdma_use_once = !opts.rdma_cache_mrs;
 	else if (opts.rdma_cache_mrs && opts.rdma_use_once)
@@ -3188,14 +5263,25 @@ int main(int argc, char **argv)
 	else if (opts.rdma_cache_mrs && !opts.rdma_use_get_mr)
 		die("option --rdma-cache-mrs conflicts with --rdma-use-get-mr=0\n");
 
+	if (loopback) {
+		if (opts.send_addr != ~0)
+			die("--loopback starts its own peer, -s is not needed\n");
+		if (opts.receive_addr == 0)
+			opts.receive_addr = INADDR_LOOPBACK;
+		opts.send_addr = opts.receive_addr;
+	}
+	peer_port = opts.starting_port;
+
 	/* the passive parent will read options off the wire */
 	if (opts.send_addr == ~0)
-		return passive_parent(opts.receive_addr, opts.starting_port,
+		return passive_parent(opts.receive_addr, opts.starting_port, -1,
 				      soak_arr);
 
 	/* the active parent verifies and sends its options */
-	check_size(opts.ack_size, ~0, MIN_MSG_BYTES, "ack size", "-a");
-	check_size(opts.req_size, ~0, MIN_MSG_BYTES, "req size", "-q");
+	if (opts.one_way && opts.ack_size == MIN_MSG_BYTES)
+		opts.ack_size = HDR_BYTES(&opts);
+	check_size(opts.ack_size, ~0, HDR_BYTES(&opts), "ack size", "-a");
+	check_size(opts.req_size, ~0, HDR_BYTES(&opts), "req size", "-q");
 
 	/* defaults */
 	if (opts.req_depth == ~0)
@@ -3203,6 +5289,17 @@ int main(int argc, char **argv)
 	if (opts.nr_tasks == (uint16_t)~0)
 		opts.nr_tasks = 1;
 
+	if (transport != &rds_transport) {
+		if (opts.rdma_size)
+			die("RDMA is not available over the %s transport\n",
+			    transport->name);
+		if (opts.show_perfdata || reset_connection)
+			die("--show-perfdata and --reset need the rds transport\n");
+	}
+
+	if (opts.rdma_size && opts.audit)
+		die("--audit cannot follow RDMA transfers, drop -D\n");
+
 	if (opts.rdma_size && !check_rdma_support(&opts))
 		die("RDMA not supported by this kernel\n");
 
@@ -3214,6 +5311,8 @@ int main(int argc, char **argv)
 		opts.rdma_size = (opts.rdma_size + 4095) & ~4095;
 
 	opt = opts;
+	if (loopback)
+		start_loopback_peer(&opts);
 	return active_parent(&opts, soak_arr);
 }
 
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2026 Oracle.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * rdsinfo.c - read the RDS_INFO_* sources
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "rdsinfo.h"
+
+int rds_info_get(int fd, int sol, struct rds_info_buf *buf)
+{
+	socklen_t len;
+	void *data;
+	int each;
+
+	while (1) {
+		len = buf->size;
+		each = getsockopt(fd, sol, buf->opt, buf->data, &len);
+		if (each >= 0)
+			break;
+		if (errno != ENOSPC)
+			return -1;
+
+		/* the kernel told us how much room it needs right now */
+		data = realloc(buf->data, len);
+		if (data == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		buf->data = data;
+		buf->size = len;
+	}
+
+	buf->len = len;
+	buf->each = each;
+	return 0;
+}
+
+void rds_info_free(struct rds_info_buf *buf)
+{
+	free(buf->data);
+	buf->data = NULL;
+	buf->len = buf->size = 0;
+	buf->each = 0;
+}
+
+void rds_info_swap(struct rds_info_buf *a, struct rds_info_buf *b)
+{
+	struct rds_info_buf tmp = *a;
+
+	*a = *b;
+	*b = tmp;
+}